@@ -0,0 +1,305 @@
+#include "async_log.h"
+#include "config.h"
+
+#include <sched.h>
+#include <algorithm>
+#include <chrono>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_log_async =
+    Config::Lookup<bool>("log.async", false, "write logs from a background thread");
+// 每个线程的队列能放多少条日志（向上取整到2的幂），只对之后新建的队列生效
+static ConfigVar<uint32_t>::ptr g_log_async_ring_size =
+    Config::Lookup<uint32_t>("log.async_ring_size", 8192, "per-thread async log ring capacity");
+// 队列满了怎么办：block / drop / sample
+static ConfigVar<std::string>::ptr g_log_async_overflow =
+    Config::Lookup<std::string>("log.async_overflow", "block", "async log overflow policy: block, drop or sample");
+// sample模式下每N条溢出的日志保留1条
+static ConfigVar<uint32_t>::ptr g_log_async_sample =
+    Config::Lookup<uint32_t>("log.async_sample", 64, "keep 1 of N overflowing logs in sample mode");
+// 后台线程空闲时最多睡多久，错过了唤醒也只会晚这么久
+static ConfigVar<uint32_t>::ptr g_log_async_interval_ms =
+    Config::Lookup<uint32_t>("log.async_interval_ms", 10, "max idle wait of the async log thread");
+
+std::atomic<bool> AsyncLogger::s_enabled{false};
+
+// 当前线程打的日志直接同步输出：后台线程自己，以及正在drain的线程（防止等自己腾位置）
+static thread_local int t_sync = 0;
+
+// 线程退出时把队列标记为关闭，剩下的日志照样由后台线程输出
+struct RingHolder {
+    AsyncLogger::Ring::ptr ring;
+    ~RingHolder()
+    {
+        if (ring) {
+            ring->closed.store(true, std::memory_order_release);
+        }
+    }
+};
+static thread_local RingHolder t_ring;
+
+struct SyncScope {
+    SyncScope() { ++t_sync; }
+    ~SyncScope() { --t_sync; }
+};
+
+AsyncLogger::Ring::Ring(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_slots.resize(size);
+    m_mask = size - 1;
+}
+
+bool AsyncLogger::Ring::push(LogEvent::ptr &event)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) > m_mask) {
+        return false;
+    }
+    m_slots[tail & m_mask] = std::move(event);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool AsyncLogger::Ring::pop(LogEvent::ptr &event)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    // 移走之后槽位是空的，生产者可以直接覆盖
+    event = std::move(m_slots[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool AsyncLogger::Ring::empty() const
+{
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
+
+AsyncLogger::Overflow AsyncLogger::OverflowFromString(const std::string &str)
+{
+    if (str == "drop") {
+        return DROP;
+    }
+    if (str == "sample") {
+        return SAMPLE;
+    }
+    if (str != "block") {
+        SYLAR_LOG_ERROR(g_logger) << "Invalid log.async_overflow: " << str << ", use block instead";
+    }
+    return BLOCK;
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    stop();
+}
+
+void AsyncLogger::start()
+{
+    Mutex::Lock lock(m_mutex);
+    if (m_thread) {
+        return;
+    }
+    m_stopping = false;
+    m_thread.reset(new Thread([this] { run(); }, "async_log"));
+    s_enabled.store(true, std::memory_order_release);
+}
+
+void AsyncLogger::stop()
+{
+    Thread::ptr thread;
+    {
+        Mutex::Lock lock(m_mutex);
+        thread.swap(m_thread);
+    }
+    if (!thread) {
+        return;
+    }
+    // 之后的日志同步输出，正在等位置的生产者也会转为同步输出
+    s_enabled.store(false, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_stopping = true;
+    wake();
+    thread->join();
+    // 后台线程退出之后才放进来的日志
+    drain();
+}
+
+AsyncLogger::Ring *AsyncLogger::get_ring()
+{
+    if (!t_ring.ring) {
+        t_ring.ring.reset(new Ring(g_log_async_ring_size->getValue()));
+        Mutex::Lock lock(m_mutex);
+        m_rings.push_back(t_ring.ring);
+        m_rings_changed.store(true, std::memory_order_release);
+    }
+    return t_ring.ring.get();
+}
+
+void AsyncLogger::push(LogEvent::ptr event)
+{
+    if (t_sync) {
+        event->getLogger()->log(event->getLevel(), event);
+        return;
+    }
+    // 事件里引用的线程名可能比事件先没了
+    event->detach();
+    LogLevel::Level level = event->getLevel();
+    Ring *ring = get_ring();
+    if (!ring->push(event)) {
+        Overflow overflow = m_overflow.load(std::memory_order_relaxed);
+        if (overflow == DROP
+            || (overflow == SAMPLE && m_overflowed.fetch_add(1, std::memory_order_relaxed) % m_sample)) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // 等后台线程腾出位置
+        wake();
+        while (!ring->push(event)) {
+            if (!IsEnabled()) {
+                event->getLogger()->log(level, event);
+                return;
+            }
+            sched_yield();
+        }
+    }
+    // 和run里先置m_sleeping再检查队列配对，保证不会错过唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed)) {
+        wake();
+    }
+    // FATAL：进程可能马上就要退出了
+    // 已经关掉了：检查开关之后、放进队列之前stop可能已经做完最后一次drain，自己输出
+    // 和stop里先关开关再drain配对，两边中间都有seq_cst屏障，至少有一边能看到这条日志
+    if (level >= LogLevel::FATAL || !IsEnabled()) {
+        flush();
+    }
+}
+
+void AsyncLogger::flush()
+{
+    drain();
+}
+
+void AsyncLogger::wake()
+{
+    std::lock_guard<std::mutex> lock(m_wait_mutex);
+    m_cond.notify_one();
+}
+
+bool AsyncLogger::has_pending()
+{
+    Mutex::Lock lock(m_mutex);
+    for (auto &ring : m_rings) {
+        if (!ring->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AsyncLogger::run()
+{
+    ++t_sync;
+    while (!m_stopping) {
+        if (drain()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        m_sleeping.store(true, std::memory_order_seq_cst);
+        // 睡之前再看一眼，刚放进来的日志不用等到下次醒来
+        if (!m_stopping && !has_pending()) {
+            m_cond.wait_for(lock, std::chrono::milliseconds(g_log_async_interval_ms->getValue()));
+        }
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+    drain();
+    --t_sync;
+}
+
+size_t AsyncLogger::drain()
+{
+    SyncScope sync;
+    Mutex::Lock lock(m_drain_mutex);
+    if (m_rings_changed.exchange(false, std::memory_order_acquire)) {
+        Mutex::Lock rings_lock(m_mutex);
+        m_snapshot = m_rings;
+    }
+
+    size_t total = 0;
+    bool has_closed = false;
+    {
+        LogBatchScope batch;
+        LogEvent::ptr event;
+        for (auto &ring : m_snapshot) {
+            // 每个队列最多取一圈，生产者一直在放的话也能按时flush，返回时drain之前放进来的都已经取出
+            size_t n = 0;
+            size_t limit = ring->capacity();
+            while (n < limit && ring->pop(event)) {
+                const Logger::ptr &logger = event->getLogger();
+                if (std::find(m_touched.begin(), m_touched.end(), logger) == m_touched.end()) {
+                    m_touched.push_back(logger);
+                }
+                logger->log(event->getLevel(), event);
+                event.reset();
+                ++n;
+            }
+            total += n;
+            has_closed = has_closed || ring->closed.load(std::memory_order_acquire);
+        }
+    }
+    for (auto &logger : m_touched) {
+        logger->flush();
+    }
+    m_touched.clear();
+
+    uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped != m_reported) {
+        SYLAR_LOG_WARN(g_logger) << "async log ring full, dropped " << dropped - m_reported << " logs";
+        m_reported = dropped;
+        g_logger->flush();
+    }
+
+    if (has_closed) {
+        // 线程已经退出并且队列已经取空，不会再有日志放进来
+        Mutex::Lock rings_lock(m_mutex);
+        auto pred = [](const Ring::ptr &ring) {
+            return ring->closed.load(std::memory_order_acquire) && ring->empty();
+        };
+        m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(), pred), m_rings.end());
+        m_snapshot = m_rings;
+    }
+    return total;
+}
+
+// 同hook.cc，在main函数之前注册监听器，配置打开时启动后台线程
+struct _Async_log_initer {
+    _Async_log_initer()
+    {
+        g_log_async_overflow->addListener([](const std::string &old_value, const std::string &new_value) {
+            AsyncLogMgr::GetInstance()->setOverflow(AsyncLogger::OverflowFromString(new_value));
+        });
+        g_log_async_sample->addListener([](const uint32_t &old_value, const uint32_t &new_value) {
+            AsyncLogMgr::GetInstance()->setSample(new_value);
+        });
+        g_log_async->addListener([](const bool &old_value, const bool &new_value) {
+            if (new_value) {
+                AsyncLogMgr::GetInstance()->start();
+            } else {
+                AsyncLogMgr::GetInstance()->stop();
+            }
+        });
+    }
+};
+static _Async_log_initer s_async_log_initer;
+
+}
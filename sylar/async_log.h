@@ -0,0 +1,114 @@
+#ifndef __SYLAR_ASYNC_LOG_H__
+#define __SYLAR_ASYNC_LOG_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "singleton.h"
+#include "thread.h"
+
+namespace sylar {
+
+// 异步日志
+// 打日志的线程只把事件放进自己的单生产者单消费者环形队列，由一个后台线程取出来格式化并批量输出
+// 慢的输出地（比如磁盘）只会拖慢后台线程，不会卡住工作线程上的协程
+// 由配置log.async打开，关闭或者进程退出时把队列里剩下的日志全部输出
+class AsyncLogger {
+public:
+    // 队列满了之后的处理方式
+    enum Overflow {
+        BLOCK = 0,  // 等后台线程腾出位置，不丢日志
+        DROP = 1,   // 直接丢掉
+        SAMPLE = 2, // 每N条溢出的日志等待放进去1条，其余的丢掉
+    };
+
+    AsyncLogger() = default;
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger &) = delete;
+    AsyncLogger &operator=(const AsyncLogger &) = delete;
+
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+    static Overflow OverflowFromString(const std::string &str);
+
+    // 启动/停止后台线程，停止时输出所有剩下的日志，之后的日志同步输出
+    void start();
+    void stop();
+
+    // 把事件交给后台线程，由LogEventWrap在异步模式下调用
+    void push(LogEvent::ptr event);
+    // 把目前所有队列里的日志输出并flush，返回后之前打的日志都已经写出去了
+    void flush();
+
+    void setOverflow(Overflow val) { m_overflow = val; }
+    void setSample(uint32_t val) { m_sample = val ? val : 1; }
+    // 因为队列满了被丢掉的日志条数
+    uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+public:
+    // 单生产者单消费者的环形队列，生产者是打日志的线程，消费者是持有m_drain_mutex的线程
+    class Ring {
+    public:
+        typedef std::shared_ptr<Ring> ptr;
+        explicit Ring(size_t capacity);
+
+        // 成功时取走event，满了返回false，event保持不变
+        bool push(LogEvent::ptr &event);
+        bool pop(LogEvent::ptr &event);
+        bool empty() const;
+        size_t capacity() const { return m_mask + 1; }
+
+        // 所属线程退出之后置为true，取空之后由消费者删掉
+        std::atomic<bool> closed{false};
+
+    private:
+        std::vector<LogEvent::ptr> m_slots;
+        size_t m_mask;
+        alignas(64) std::atomic<size_t> m_head{0}; // 消费者读写
+        alignas(64) std::atomic<size_t> m_tail{0}; // 生产者读写
+    };
+
+private:
+    Ring *get_ring();
+    void wake();
+    void run();
+    bool has_pending();
+    // 取出所有队列里的日志并输出，返回输出的条数
+    size_t drain();
+
+private:
+    static std::atomic<bool> s_enabled;
+
+    std::atomic<Overflow> m_overflow{BLOCK};
+    std::atomic<uint32_t> m_sample{64};
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<uint64_t> m_overflowed{0};
+    uint64_t m_reported = 0; // 已经报告过的丢弃条数
+
+    // 所有线程的队列，新线程注册时加锁
+    Mutex m_mutex;
+    std::vector<Ring::ptr> m_rings;
+    std::atomic<bool> m_rings_changed{false};
+
+    // 同一时间只有一个消费者：后台线程或者调用flush的线程
+    Mutex m_drain_mutex;
+    std::vector<Ring::ptr> m_snapshot;
+    std::vector<Logger::ptr> m_touched; // 这一批输出过的日志器，最后统一flush
+
+    Thread::ptr m_thread;
+    std::atomic<bool> m_stopping{false};
+    std::atomic<bool> m_sleeping{false};
+    std::mutex m_wait_mutex;
+    std::condition_variable m_cond;
+};
+
+typedef Singleton<AsyncLogger> AsyncLogMgr;
+
+}
+
+#endif //__SYLAR_ASYNC_LOG_H__
@@ -0,0 +1,446 @@
+#include "binlog.h"
+#include "config.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 二进制日志文件，为空时关闭二进制模式
+static ConfigVar<std::string>::ptr g_log_binary_file =
+    Config::Lookup<std::string>("log.binary_file", "", "write SYLAR_LOG_FMT_* logs in binary form to this file");
+// 每个线程的缓冲区大小，只对之后新建的缓冲区生效
+static ConfigVar<uint32_t>::ptr g_log_binary_buffer_size =
+    Config::Lookup<uint32_t>("log.binary_buffer_size", 1024 * 1024, "per-thread binary log buffer size");
+// 后台线程没东西可写时睡多久
+static ConfigVar<uint32_t>::ptr g_log_binary_interval_ms =
+    Config::Lookup<uint32_t>("log.binary_interval_ms", 10, "idle wait of the binary log thread");
+
+std::atomic<bool> BinaryLogger::s_enabled{false};
+thread_local BinaryLogger::StagingBuffer *BinaryLogger::t_buffer = nullptr;
+
+// 线程退出时把缓冲区标记为关闭，剩下的记录照样由后台线程写出去
+struct StagingBufferHolder {
+    BinaryLogger::StagingBuffer::ptr buffer;
+    ~StagingBufferHolder()
+    {
+        if (buffer) {
+            buffer->closed.store(true, std::memory_order_release);
+        }
+    }
+};
+static thread_local StagingBufferHolder t_holder;
+
+namespace binlog {
+
+void ParseFormat(const char *fmt, std::vector<ArgSpec> &specs)
+{
+    specs.clear();
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        ++p;
+        if (*p == '%') {
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        while (*p && strchr("-+ #0'", *p)) {
+            ++p;
+        }
+        if (*p == '*') {
+            specs.emplace_back();
+            ++p;
+        }
+        while (isdigit(*p)) {
+            ++p;
+        }
+        int32_t precision = -1;
+        if (*p == '.') {
+            ++p;
+            if (*p == '*') {
+                specs.emplace_back();
+                precision = -2;
+                ++p;
+            } else {
+                precision = 0;
+                for (; isdigit(*p); ++p) {
+                    precision = precision * 10 + (*p - '0');
+                }
+            }
+        }
+        while (*p && strchr("hljztLq", *p)) {
+            ++p;
+        }
+        if (!*p) {
+            break;
+        }
+        ArgSpec spec;
+        if (*p == 's') {
+            spec.string = true;
+            spec.precision = precision;
+        }
+        specs.push_back(spec);
+    }
+}
+
+}
+
+LogSite::LogSite(LogLevel::Level level, const char *file, int32_t line, const char *fmt)
+    : m_level(level), m_file(file), m_line(line), m_fmt(fmt)
+{
+    binlog::ParseFormat(fmt, m_args);
+    m_id = BinaryLogMgr::GetInstance()->addSite(this);
+}
+
+BinaryLogger::StagingBuffer::StagingBuffer(size_t capacity)
+    : m_buf(capacity)
+{
+}
+
+char *BinaryLogger::StagingBuffer::reserve(size_t n)
+{
+    size_t p = m_producer.load(std::memory_order_relaxed);
+    size_t c = m_consumer.load(std::memory_order_acquire);
+    // 写完之后生产者不能追上消费者，否则分不清空和满，所以都要求严格大于
+    if (p >= c) {
+        if (m_buf.size() - p > n) {
+            m_reserved = p;
+            return &m_buf[p];
+        }
+        if (c > n) {
+            // 末尾放不下，从头开始，commit的release保证消费者先看到m_end
+            m_end.store(p, std::memory_order_relaxed);
+            m_reserved = 0;
+            return &m_buf[0];
+        }
+        return nullptr;
+    }
+    if (c - p > n) {
+        m_reserved = p;
+        return &m_buf[p];
+    }
+    return nullptr;
+}
+
+int BinaryLogger::StagingBuffer::peek(struct iovec *iov)
+{
+    size_t c = m_consumer.load(std::memory_order_relaxed);
+    size_t p = m_producer.load(std::memory_order_acquire);
+    m_next_consumer = p;
+    if (c == p) {
+        return 0;
+    }
+    if (c < p) {
+        iov[0].iov_base = &m_buf[c];
+        iov[0].iov_len = p - c;
+        return 1;
+    }
+    // 生产者已经绕回到开头
+    int count = 0;
+    size_t end = m_end.load(std::memory_order_relaxed);
+    if (end > c) {
+        iov[count].iov_base = &m_buf[c];
+        iov[count].iov_len = end - c;
+        ++count;
+    }
+    if (p > 0) {
+        iov[count].iov_base = &m_buf[0];
+        iov[count].iov_len = p;
+        ++count;
+    }
+    return count;
+}
+
+bool BinaryLogger::StagingBuffer::empty() const
+{
+    return m_consumer.load(std::memory_order_acquire) == m_producer.load(std::memory_order_acquire);
+}
+
+BinaryLogger::~BinaryLogger()
+{
+    stop();
+}
+
+uint32_t BinaryLogger::addSite(LogSite *site)
+{
+    Mutex::Lock lock(m_mutex);
+    m_sites.push_back(site);
+    return m_sites.size();
+}
+
+BinaryLogger::StagingBuffer *BinaryLogger::get_buffer()
+{
+    if (!t_holder.buffer) {
+        t_holder.buffer.reset(new StagingBuffer(g_log_binary_buffer_size->getValue()));
+        Mutex::Lock lock(m_mutex);
+        m_buffers.push_back(t_holder.buffer);
+    }
+    return t_holder.buffer.get();
+}
+
+char *BinaryLogger::Reserve(size_t n)
+{
+    StagingBuffer *buffer = t_buffer;
+    if (!buffer) {
+        buffer = t_buffer = BinaryLogMgr::GetInstance()->get_buffer();
+    }
+    // 和stop配对：这边先标记再看开关，stop先关开关再等标记清掉，两边中间都有seq_cst屏障，
+    // 所以要么这里看到已经关了，要么stop等到这条记录提交之后才做最后一次drain
+    buffer->writing.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!IsEnabled()) {
+        buffer->writing.store(false, std::memory_order_relaxed);
+        return nullptr;
+    }
+    char *p = buffer->reserve(n);
+    if (p) {
+        return p;
+    }
+    // 要和这个缓冲区的大小比，配置改了只影响之后新建的缓冲区
+    if (n >= buffer->capacity() / 2) {
+        // 一条记录就占了半个缓冲区，多半是参数里有很长的字符串
+        BinaryLogMgr::GetInstance()->m_dropped.fetch_add(1, std::memory_order_relaxed);
+        buffer->writing.store(false, std::memory_order_relaxed);
+        return nullptr;
+    }
+    // 等后台线程腾出位置
+    while (!(p = buffer->reserve(n))) {
+        if (!IsEnabled()) {
+            buffer->writing.store(false, std::memory_order_relaxed);
+            return nullptr;
+        }
+        sched_yield();
+    }
+    return p;
+}
+
+void BinaryLogger::Flush()
+{
+    BinaryLogMgr::GetInstance()->flush();
+}
+
+bool BinaryLogger::start(const std::string &path)
+{
+    stop();
+    Mutex::Lock lock(m_drain_mutex);
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "open binary log file " << path << " failed, errno=" << errno
+                                  << " errstr=" << strerror(errno);
+        return false;
+    }
+    binlog::FileHeader header{};
+    memcpy(header.magic, binlog::MAGIC, sizeof(header.magic));
+    header.version = binlog::VERSION;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.realtime_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    header.monotonic_ns = Clock::NowNs();
+    struct iovec iov{&header, sizeof(header)};
+    if (!write_all(&iov, 1)) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    // 新文件里要重新写一遍所有调用点的定义
+    m_written_sites = 0;
+    m_stopping = false;
+    m_thread.reset(new Thread([this] { run(); }, "binlog"));
+    s_enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+void BinaryLogger::stop()
+{
+    Thread::ptr thread;
+    {
+        Mutex::Lock lock(m_drain_mutex);
+        thread.swap(m_thread);
+    }
+    if (!thread) {
+        return;
+    }
+    // 之后的日志照常格式化，正在等位置的生产者也转为照常格式化
+    s_enabled.store(false, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // 等已经看到开关打开的生产者提交完，之后不会再有记录写进缓冲区
+    std::vector<StagingBuffer::ptr> buffers;
+    {
+        Mutex::Lock lock(m_mutex);
+        buffers = m_buffers;
+    }
+    for (auto &buffer : buffers) {
+        while (buffer->writing.load(std::memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+    m_stopping = true;
+    thread->join();
+    // 后台线程退出之后才写进缓冲区的记录
+    drain();
+    Mutex::Lock lock(m_drain_mutex);
+    close(m_fd);
+    m_fd = -1;
+}
+
+void BinaryLogger::flush()
+{
+    drain();
+}
+
+void BinaryLogger::run()
+{
+    while (!m_stopping) {
+        if (!drain()) {
+            usleep(g_log_binary_interval_ms->getValue() * 1000);
+        }
+    }
+}
+
+bool BinaryLogger::write_all(struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(m_fd, iov, std::min(count, IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SYLAR_LOG_ERROR(g_logger) << "write binary log failed, errno=" << errno
+                                      << " errstr=" << strerror(errno);
+            return false;
+        }
+        // 跳过已经写完的段，最后一段可能只写了一部分
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+size_t BinaryLogger::drain()
+{
+    Mutex::Lock lock(m_drain_mutex);
+    if (m_fd < 0) {
+        return 0;
+    }
+    std::vector<StagingBuffer::ptr> buffers;
+    {
+        Mutex::Lock buffers_lock(m_mutex);
+        buffers = m_buffers;
+    }
+
+    // 先取记录再取调用点：记录引用的调用点一定在取记录之前登记过
+    m_iov.clear();
+    m_iov.resize(1);
+    bool has_closed = false;
+    for (auto &buffer : buffers) {
+        has_closed = has_closed || buffer->closed.load(std::memory_order_acquire);
+        struct iovec iov[2];
+        int n = buffer->peek(iov);
+        m_iov.insert(m_iov.end(), iov, iov + n);
+    }
+
+    std::string sites;
+    size_t site_count;
+    {
+        Mutex::Lock sites_lock(m_mutex);
+        site_count = m_sites.size();
+        for (size_t i = m_written_sites; i < site_count; ++i) {
+            LogSite *site = m_sites[i];
+            binlog::SiteRecord record;
+            record.id = i + 1;
+            record.line = site->getLine();
+            record.level = site->getLevel();
+            record.file_len = std::min(strlen(site->getFile()), (size_t) UINT16_MAX);
+            record.fmt_len = std::min(strlen(site->getFormat()), (size_t) UINT16_MAX);
+            binlog::RecordHeader header;
+            header.size = sizeof(header) + sizeof(record) + record.file_len + record.fmt_len;
+            header.site = 0;
+            sites.append((const char *) &header, sizeof(header));
+            sites.append((const char *) &record, sizeof(record));
+            sites.append(site->getFile(), record.file_len);
+            sites.append(site->getFormat(), record.fmt_len);
+        }
+    }
+    m_iov[0].iov_base = &sites[0];
+    m_iov[0].iov_len = sites.size();
+
+    size_t total = 0;
+    for (auto &iov : m_iov) {
+        total += iov.iov_len;
+    }
+    if (total) {
+        // write_all会改m_iov，先记下这一批记录的段，写失败时用来数条数
+        m_records_iov.assign(m_iov.begin() + 1, m_iov.end());
+        if (write_all(&m_iov[0], m_iov.size())) {
+            m_written_sites = site_count;
+        } else {
+            // 写失败的记录没法补了，照样从缓冲区里去掉，免得打日志的线程一直等
+            // 调用点的定义下次重新写
+            m_dropped.fetch_add(count_records(m_records_iov), std::memory_order_relaxed);
+        }
+    }
+    for (auto &buffer : buffers) {
+        buffer->consume();
+    }
+
+    if (has_closed) {
+        // 线程已经退出并且缓冲区已经写空，不会再有记录放进来
+        Mutex::Lock buffers_lock(m_mutex);
+        auto pred = [](const StagingBuffer::ptr &buffer) {
+            return buffer->closed.load(std::memory_order_acquire) && buffer->empty();
+        };
+        m_buffers.erase(std::remove_if(m_buffers.begin(), m_buffers.end(), pred), m_buffers.end());
+    }
+    return total;
+}
+
+size_t BinaryLogger::count_records(const std::vector<struct iovec> &iov)
+{
+    // 记录不会跨过缓冲区的末尾，每一段都是完整的记录
+    size_t count = 0;
+    for (auto &seg : iov) {
+        const char *p = (const char *) seg.iov_base;
+        const char *end = p + seg.iov_len;
+        while (end - p >= (ssize_t) sizeof(binlog::RecordHeader)) {
+            binlog::RecordHeader header;
+            memcpy(&header, p, sizeof(header));
+            if (header.size < sizeof(header)) {
+                break;
+            }
+            p += header.size;
+            ++count;
+        }
+    }
+    return count;
+}
+
+// 同async_log.cc，配置了文件名就打开二进制模式
+struct _Binary_log_initer {
+    _Binary_log_initer()
+    {
+        g_log_binary_file->addListener([](const std::string &old_value, const std::string &new_value) {
+            if (new_value.empty()) {
+                BinaryLogMgr::GetInstance()->stop();
+            } else {
+                BinaryLogMgr::GetInstance()->start(new_value);
+            }
+        });
+    }
+};
+static _Binary_log_initer s_binary_log_initer;
+
+}
@@ -0,0 +1,357 @@
+#ifndef __SYLAR_BINLOG_H__
+#define __SYLAR_BINLOG_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "singleton.h"
+#include "thread.h"
+
+namespace sylar {
+
+// 二进制日志（延迟格式化）
+// 配置log.binary_file打开后，SYLAR_LOG_FMT_*不再在线程里格式化：
+// 每个调用点第一次执行时登记它的格式串、文件名和行号，分到一个编号，
+// 之后每次只把编号、时间戳和原始参数拷到当前线程的环形缓冲区里，由后台线程原样写进文件
+// 文件用tools/sylar_logdecode离线还原成文本
+// 格式串必须是字符串字面量；%s的参数会被拷贝，其余参数只存值
+namespace binlog {
+
+static const char MAGIC[8] = {'S', 'Y', 'L', 'A', 'R', 'B', 'I', 'N'};
+static const uint32_t VERSION = 2;
+
+// 文件头
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t realtime_ns; // 打开文件时的墙上时间
+    uint64_t monotonic_ns; // 同一时刻的Clock::NowNs()，用来把记录里的单调时间换成墙上时间
+};
+
+// 每条记录的头，site为0表示调用点的定义，否则是一条日志
+struct RecordHeader {
+    uint32_t size; // 包括头在内的整条记录的大小
+    uint32_t site;
+};
+
+// 调用点定义的记录体，后面跟着文件名和格式串（都不带'\0'）
+struct SiteRecord {
+    uint32_t id;
+    int32_t line;
+    uint32_t level;
+    uint16_t file_len;
+    uint16_t fmt_len;
+};
+
+// 日志记录体，后面跟着参数
+struct LogRecord {
+    uint64_t time_ns; // Clock::NowNs()
+    uint32_t thread_id;
+    uint32_t fiber_id;
+};
+
+// 参数的类型，每个参数前面一个字节：低4位是类型，整数的高4位是它本来的字节数
+enum ArgType : uint8_t {
+    ARG_INT = 1,    // 有符号整数，按本来的字节数存
+    ARG_UINT = 2,   // 无符号整数，按本来的字节数存
+    ARG_DOUBLE = 3, // double
+    ARG_STRING = 4, // uint32_t长度 + 内容
+    ARG_POINTER = 5, // uint64_t
+};
+
+// 格式串里一个转换对应的参数，调用点登记时解析一次
+struct ArgSpec {
+    bool string = false;    // %s，参数按字符串拷贝，其余的都按值存
+    int32_t precision = -1; // %s的精度，-1表示没有，-2表示由前一个参数(*)给出
+};
+
+// 解析printf格式串，每个要消耗参数的地方（包括宽度和精度里的*）对应一个ArgSpec
+void ParseFormat(const char *fmt, std::vector<ArgSpec> &specs);
+
+// 按调用点的ArgSpec编码参数，先用size算出大小，预留好空间之后再encode
+// 只有对应%s的char指针才当字符串拷贝，带精度的用strnlen，不会越过调用者给的长度读
+// 其余的指针只存地址，整数保留本来的宽度和符号，由解码工具按printf的规则截断或扩展
+class ArgEncoder {
+public:
+    // 最多按字符串拷贝的参数个数，再多的只存地址
+    static const size_t MAX_STRINGS = 16;
+
+    explicit ArgEncoder(const std::vector<ArgSpec> &specs)
+        : m_specs(specs) {}
+
+    template<typename... Args>
+    size_t size(const Args &... args)
+    {
+        m_index = 0;
+        m_strings = 0;
+        m_last = -1;
+        size_t n = 0;
+        ((n += arg_size(args)), ...);
+        return n;
+    }
+
+    // 必须在size之后用同样的参数调用
+    template<typename... Args>
+    char *encode(char *p, const Args &... args)
+    {
+        m_index = 0;
+        m_strings = 0;
+        m_last = -1;
+        ((p = encode_arg(p, args)), ...);
+        return p;
+    }
+
+private:
+    template<typename T>
+    static constexpr bool is_string()
+    {
+        return std::is_pointer<T>::value
+            && std::is_same<typename std::remove_cv<typename std::remove_pointer<T>::type>::type, char>::value;
+    }
+
+    // 当前参数是不是按字符串存，是的话返回它在m_lens里的下标，否则返回-1
+    int string_slot()
+    {
+        const ArgSpec *spec = m_index < m_specs.size() ? &m_specs[m_index] : nullptr;
+        ++m_index;
+        if (!spec || !spec->string || m_strings >= MAX_STRINGS) {
+            return -1;
+        }
+        return m_strings++;
+    }
+
+    // 参数按值传入，字符数组退化成指针
+    template<typename T>
+    size_t arg_size(T v)
+    {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value,
+                      "binary log only supports printf style arguments");
+        if constexpr (is_string<T>()) {
+            int slot = string_slot();
+            if (slot < 0) {
+                return 1 + 8;
+            }
+            const ArgSpec &spec = m_specs[m_index - 1];
+            int64_t precision = spec.precision == -2 ? m_last : spec.precision;
+            const char *s = v ? v : "(null)";
+            size_t len = precision < 0 ? strlen(s) : strnlen(s, precision);
+            m_lens[slot] = std::min<size_t>(len, UINT32_MAX);
+            return 1 + sizeof(uint32_t) + m_lens[slot];
+        } else {
+            ++m_index;
+            if constexpr (std::is_integral<T>::value || std::is_enum<T>::value) {
+                m_last = (int64_t) v;
+                return 1 + sizeof(T);
+            } else {
+                return 1 + 8;
+            }
+        }
+    }
+
+    template<typename T>
+    char *encode_arg(char *p, T v)
+    {
+        if constexpr (is_string<T>()) {
+            int slot = string_slot();
+            if (slot >= 0) {
+                *p++ = ARG_STRING;
+                uint32_t len = m_lens[slot];
+                memcpy(p, &len, sizeof(len));
+                memcpy(p + sizeof(len), v ? v : "(null)", len);
+                return p + sizeof(len) + len;
+            }
+        } else {
+            ++m_index;
+        }
+        if constexpr (std::is_pointer<T>::value) {
+            *p++ = ARG_POINTER;
+            uint64_t u = (uint64_t) (uintptr_t) v;
+            memcpy(p, &u, 8);
+            return p + 8;
+        } else if constexpr (std::is_floating_point<T>::value) {
+            *p++ = ARG_DOUBLE;
+            double d = (double) v;
+            memcpy(p, &d, 8);
+            return p + 8;
+        } else {
+            m_last = (int64_t) v;
+            bool is_signed;
+            if constexpr (std::is_enum<T>::value) {
+                is_signed = std::is_signed<typename std::underlying_type<T>::type>::value;
+            } else {
+                is_signed = std::is_signed<T>::value;
+            }
+            *p++ = (is_signed ? ARG_INT : ARG_UINT) | (sizeof(T) << 4);
+            memcpy(p, &v, sizeof(T));
+            return p + sizeof(T);
+        }
+    }
+
+private:
+    const std::vector<ArgSpec> &m_specs;
+    size_t m_index = 0;
+    size_t m_strings = 0;
+    int64_t m_last = -1; // 上一个整数参数，给%.*s当精度
+    uint32_t m_lens[MAX_STRINGS];
+};
+
+}
+
+// 一个SYLAR_LOG_FMT_*调用点，静态对象，构造时登记
+class LogSite {
+public:
+    LogSite(LogLevel::Level level, const char *file, int32_t line, const char *fmt);
+
+    uint32_t getId() const { return m_id; }
+    LogLevel::Level getLevel() const { return m_level; }
+    const char *getFile() const { return m_file; }
+    int32_t getLine() const { return m_line; }
+    const char *getFormat() const { return m_fmt; }
+    const std::vector<binlog::ArgSpec> &getArgs() const { return m_args; }
+
+private:
+    uint32_t m_id;
+    LogLevel::Level m_level;
+    const char *m_file;
+    int32_t m_line;
+    const char *m_fmt;
+    std::vector<binlog::ArgSpec> m_args;
+};
+
+class BinaryLogger {
+public:
+    // 每个线程的环形缓冲区，打日志的线程写，后台线程读
+    // 记录不会跨过缓冲区的末尾，放不下时从头开始，m_end记住有效数据的末尾
+    class StagingBuffer {
+    public:
+        typedef std::shared_ptr<StagingBuffer> ptr;
+        explicit StagingBuffer(size_t capacity);
+
+        // 生产者：预留n个字节，放不下返回nullptr
+        char *reserve(size_t n);
+        // 生产者：提交最近一次预留的n个字节
+        void commit(size_t n) { m_producer.store(m_reserved + n, std::memory_order_release); }
+
+        // 消费者：取出可读的一段或两段，返回段数
+        int peek(struct iovec *iov);
+        // 消费者：peek到的数据已经写出去了
+        void consume() { m_consumer.store(m_next_consumer, std::memory_order_release); }
+        bool empty() const;
+        size_t capacity() const { return m_buf.size(); }
+
+        std::atomic<bool> closed{false};
+        // 生产者从Reserve到提交之间为true，stop等它变回false
+        std::atomic<bool> writing{false};
+
+    private:
+        std::vector<char> m_buf;
+        size_t m_reserved = 0; // 生产者最近一次预留的位置
+        std::atomic<size_t> m_end{0};
+        alignas(64) std::atomic<size_t> m_producer{0};
+        alignas(64) std::atomic<size_t> m_consumer{0};
+        size_t m_next_consumer = 0; // peek之后消费者的新位置
+    };
+
+    BinaryLogger() = default;
+    ~BinaryLogger();
+
+    BinaryLogger(const BinaryLogger &) = delete;
+    BinaryLogger &operator=(const BinaryLogger &) = delete;
+
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // SYLAR_LOG_FMT_*在二进制模式下调用
+    template<typename... Args>
+    static void Write(const LogSite &site, const std::shared_ptr<Logger> &logger,
+                      const char *fmt, const Args &... args)
+    {
+        if (fmt == site.getFormat()) {
+            binlog::ArgEncoder encoder(site.getArgs());
+            size_t n = sizeof(binlog::RecordHeader) + sizeof(binlog::LogRecord) + encoder.size(args...);
+            char *p = Reserve(n);
+            if (p) {
+                binlog::RecordHeader header{(uint32_t) n, site.getId()};
+                memcpy(p, &header, sizeof(header));
+                p += sizeof(header);
+                binlog::LogRecord record{Clock::NowNs(), (uint32_t) GetThreadId(), GetFiberId()};
+                memcpy(p, &record, sizeof(record));
+                p += sizeof(record);
+                encoder.encode(p, args...);
+                t_buffer->commit(n);
+                t_buffer->writing.store(false, std::memory_order_release);
+                if (site.getLevel() >= LogLevel::FATAL) {
+                    // 进程可能马上就要退出，不能等后台线程
+                    Flush();
+                }
+                return;
+            }
+            if (IsEnabled()) {
+                // 记录太大，丢掉了
+                return;
+            }
+        }
+        // 格式串不是字面量，没法只记编号；或者二进制日志刚被关掉。照常格式化
+        LogEventWrap(logger, site.getLevel(), site.getFile(), site.getLine())
+            .getEvent()->format(fmt, args...);
+    }
+
+    // 打开/关闭，打开时截断文件，关闭时把缓冲区里剩下的都写出去
+    bool start(const std::string &path);
+    void stop();
+    // 把所有线程缓冲区里的记录写到文件里
+    void flush();
+
+    // 调用点登记，返回编号（从1开始）
+    uint32_t addSite(LogSite *site);
+    // 丢掉的日志条数（记录太大或者写文件失败）
+    uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    // 在当前线程的缓冲区里预留n个字节，缓冲区满了就等后台线程腾出位置
+    // 记录比缓冲区的一半还大返回nullptr，这条日志丢掉；已经被关掉了也返回nullptr
+    // 成功时缓冲区的writing置为true，提交之后由调用者清掉
+    static char *Reserve(size_t n);
+    // 当前单例的flush，给Write用
+    static void Flush();
+    StagingBuffer *get_buffer();
+    void run();
+    // 把新登记的调用点和所有缓冲区里的记录写出去，返回写了多少字节
+    size_t drain();
+    bool write_all(struct iovec *iov, int count);
+    // 缓冲区里取出来的若干段里有几条记录
+    static size_t count_records(const std::vector<struct iovec> &iov);
+
+private:
+    static std::atomic<bool> s_enabled;
+    static thread_local StagingBuffer *t_buffer;
+
+    Mutex m_mutex;
+    std::vector<StagingBuffer::ptr> m_buffers;
+    std::vector<LogSite *> m_sites;
+
+    // 后台线程或者调用flush的线程持有
+    Mutex m_drain_mutex;
+    size_t m_written_sites = 0; // 已经写进文件的调用点个数
+    int m_fd = -1;
+    std::atomic<uint64_t> m_dropped{0};
+
+    Thread::ptr m_thread;
+    std::atomic<bool> m_stopping{false};
+    std::vector<struct iovec> m_iov;
+    std::vector<struct iovec> m_records_iov;
+};
+
+typedef Singleton<BinaryLogger> BinaryLogMgr;
+
+}
+
+#endif //__SYLAR_BINLOG_H__
@@ -0,0 +1,141 @@
+#include "clock.h"
+#include "config.h"
+#include "log.h"
+
+#include <atomic>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// TSC换算成单调时间：ns = base_ns + ((tsc - base_tsc) * mult) >> 32
+struct TscCalibration {
+    uint64_t base_tsc = 0;
+    uint64_t base_ns = 0;
+    uint64_t mult = 0;
+};
+
+static TscCalibration s_tsc;
+static std::atomic<bool> s_tsc_enabled{false};
+static std::once_flag s_tsc_once;
+static bool s_tsc_ok = false;
+
+static thread_local uint64_t t_cached_us = 0; // 0表示没有刷新过
+static thread_local time_t t_cached_time = 0;
+
+static uint64_t monotonic_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool tsc_invariant()
+{
+    // CPUID 0x80000007 EDX[8]：TSC不随频率和睡眠状态变化
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+}
+
+static void calibrate_tsc()
+{
+    if (!tsc_invariant()) {
+        SYLAR_LOG_INFO(g_logger) << "invariant tsc is not available, use clock_gettime";
+        return;
+    }
+    // 用CLOCK_MONOTONIC量一段时间里TSC走了多少
+    uint64_t ns0 = monotonic_ns();
+    uint64_t tsc0 = __rdtsc();
+    uint64_t ns1;
+    do {
+        ns1 = monotonic_ns();
+    } while (ns1 - ns0 < 10000000); // 10ms
+    uint64_t tsc1 = __rdtsc();
+    if (tsc1 <= tsc0) {
+        return;
+    }
+    s_tsc.base_tsc = tsc1;
+    s_tsc.base_ns = ns1;
+    s_tsc.mult = (uint64_t) (((unsigned __int128) (ns1 - ns0) << 32) / (tsc1 - tsc0));
+    s_tsc_ok = true;
+    SYLAR_LOG_INFO(g_logger) << "tsc calibrated: " << (double) (tsc1 - tsc0) / (ns1 - ns0)
+                             << " ticks/ns";
+}
+#else
+static void calibrate_tsc() {}
+#endif
+
+// 是否用TSC代替clock_gettime取单调时间
+static ConfigVar<bool>::ptr g_clock_tsc =
+    Config::Lookup<bool>("clock.tsc", false, "use calibrated tsc as the monotonic clock");
+
+struct _Clock_initer {
+    _Clock_initer()
+    {
+        g_clock_tsc->addListener([](const bool &old_value, const bool &new_value) {
+            Clock::SetTsc(new_value);
+        });
+    }
+};
+static _Clock_initer s_clock_initer;
+
+uint64_t Clock::NowNs()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (s_tsc_enabled.load(std::memory_order_acquire)) {
+        // 校准点之前的TSC（其他核上略有偏差）按校准点算，保证不会倒退到校准点之前
+        uint64_t tsc = __rdtsc();
+        uint64_t delta = tsc > s_tsc.base_tsc ? tsc - s_tsc.base_tsc : 0;
+        return s_tsc.base_ns + (uint64_t) (((unsigned __int128) delta * s_tsc.mult) >> 32);
+    }
+#endif
+    return monotonic_ns();
+}
+
+uint64_t Clock::CachedUs()
+{
+    return t_cached_us ? t_cached_us : NowUs();
+}
+
+time_t Clock::CachedTime()
+{
+    return t_cached_us ? t_cached_time : time(nullptr);
+}
+
+uint64_t Clock::Refresh()
+{
+    t_cached_us = NowUs();
+    // 粗粒度的墙上时间走vdso，只读一个变量
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    t_cached_time = ts.tv_sec;
+    return t_cached_us;
+}
+
+bool Clock::IsTsc()
+{
+    return s_tsc_enabled;
+}
+
+bool Clock::SetTsc(bool enable)
+{
+    if (!enable) {
+        s_tsc_enabled = false;
+        return true;
+    }
+    std::call_once(s_tsc_once, calibrate_tsc);
+    s_tsc_enabled.store(s_tsc_ok, std::memory_order_release);
+    return s_tsc_ok;
+}
+
+}
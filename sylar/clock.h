@@ -0,0 +1,38 @@
+#ifndef __SYLAR_CLOCK_H__
+#define __SYLAR_CLOCK_H__
+
+#include <cstdint>
+#include <ctime>
+
+namespace sylar {
+
+// 时钟
+// 1. 单调时间：基于CLOCK_MONOTONIC，不会随着NTP或者手动改时间跳变，定时器都用它
+// 2. TSC时钟：配置项clock.tsc打开后，用启动时校准过的rdtsc代替clock_gettime，
+//    CPU没有恒定频率的TSC时不会启用
+// 3. 线程缓存的时间：IOManager::idle每轮刷新一次，定时器和日志的时间戳直接读缓存；
+//    没有刷新过的线程（不是工作线程）每次现取
+class Clock {
+public:
+    // 单调时间，只能用来算时间差
+    static uint64_t NowNs();
+    static uint64_t NowUs() { return NowNs() / 1000; }
+    static uint64_t NowMs() { return NowNs() / 1000000; }
+
+    // 当前线程缓存的单调时间，比真实时间晚上一次刷新以来跑任务的时间
+    static uint64_t CachedUs();
+    static uint64_t CachedMs() { return CachedUs() / 1000; }
+    // 当前线程缓存的墙上时间(秒)，日志用
+    static time_t CachedTime();
+    // 刷新当前线程的缓存，返回新的单调时间(us)
+    static uint64_t Refresh();
+
+    // 当前是否在用TSC
+    static bool IsTsc();
+    // 打开/关闭TSC，打开时第一次会先校准（大约10ms），不支持时返回false
+    static bool SetTsc(bool enable);
+};
+
+}
+
+#endif
@@ -0,0 +1,216 @@
+#include "context.h"
+
+#include <cstdint>
+
+#ifndef SYLAR_FIBER_UCONTEXT
+
+// 切换函数: sylar_context_swap(void** from_sp, void* to_sp)
+// 把callee-saved寄存器压到当前栈上，当前栈顶存进*from_sp，然后换到to_sp上弹出寄存器并返回
+// 新建的上下文第一次"返回"到sylar_context_entry，由它调用真正的入口函数
+extern "C" void sylar_context_swap(void **from_sp, void *to_sp);
+extern "C" void sylar_context_entry();
+
+#if defined(__x86_64__)
+// 栈布局(低地址->高地址): mxcsr/x87cw, r15, r14, r13, r12, rbx, rbp, 返回地址
+// 新上下文中r12=0，r13=入口函数
+asm(R"(
+    .text
+    .globl sylar_context_swap
+    .type sylar_context_swap, @function
+    .align 16
+sylar_context_swap:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size sylar_context_swap, .-sylar_context_swap
+
+    .globl sylar_context_entry
+    .type sylar_context_entry, @function
+    .align 16
+sylar_context_entry:
+    .cfi_startproc
+    .cfi_undefined rip
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .cfi_endproc
+    .size sylar_context_entry, .-sylar_context_entry
+)");
+
+namespace {
+const size_t CONTEXT_SLOTS = 8; // 保存区 + 6个寄存器 + 返回地址
+const uint32_t DEFAULT_MXCSR = 0x1f80;
+const uint16_t DEFAULT_X87CW = 0x037f;
+}
+
+#elif defined(__aarch64__)
+// 栈布局(低地址->高地址): x19-x28, x29, x30(lr), d8-d15，共0xb0字节
+// 新上下文中x19=0，x20=入口函数，lr=sylar_context_entry
+asm(R"(
+    .text
+    .globl sylar_context_swap
+    .type sylar_context_swap, %function
+    .align 4
+sylar_context_swap:
+    sub sp, sp, #0xb0
+    stp x19, x20, [sp, #0x00]
+    stp x21, x22, [sp, #0x10]
+    stp x23, x24, [sp, #0x20]
+    stp x25, x26, [sp, #0x30]
+    stp x27, x28, [sp, #0x40]
+    stp x29, x30, [sp, #0x50]
+    stp d8, d9, [sp, #0x60]
+    stp d10, d11, [sp, #0x70]
+    stp d12, d13, [sp, #0x80]
+    stp d14, d15, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0x00]
+    ldp x21, x22, [sp, #0x10]
+    ldp x23, x24, [sp, #0x20]
+    ldp x25, x26, [sp, #0x30]
+    ldp x27, x28, [sp, #0x40]
+    ldp x29, x30, [sp, #0x50]
+    ldp d8, d9, [sp, #0x60]
+    ldp d10, d11, [sp, #0x70]
+    ldp d12, d13, [sp, #0x80]
+    ldp d14, d15, [sp, #0x90]
+    add sp, sp, #0xb0
+    ret
+    .size sylar_context_swap, .-sylar_context_swap
+
+    .globl sylar_context_entry
+    .type sylar_context_entry, %function
+    .align 4
+sylar_context_entry:
+    .cfi_startproc
+    .cfi_undefined x30
+    mov x0, x19
+    blr x20
+    brk #0
+    .cfi_endproc
+    .size sylar_context_entry, .-sylar_context_entry
+)");
+
+namespace {
+const size_t CONTEXT_SLOTS = 22; // 0xb0 / 8
+}
+
+#endif
+
+#endif
+
+namespace sylar {
+
+#ifndef SYLAR_FIBER_UCONTEXT
+
+bool Context::make(void *stack, size_t size, EntryFunc func)
+{
+    if (!stack || size < CONTEXT_SLOTS * sizeof(void *) + 64) {
+        return false;
+    }
+    // 栈从高地址往低地址长，先把栈顶按16字节对齐
+    auto top = ((uintptr_t) stack + size) & ~(uintptr_t) 15;
+#if defined(__x86_64__)
+    // 返回地址所在的位置要满足: ret之后rsp按16字节对齐，这样入口里的call才符合ABI
+    auto *sp = (uint64_t *) (top - 16 - 8) - (CONTEXT_SLOTS - 1);
+    auto *fpu = (uint32_t *) sp;
+    fpu[0] = DEFAULT_MXCSR;
+    fpu[1] = DEFAULT_X87CW;
+    sp[1] = 0;                          // r15
+    sp[2] = 0;                          // r14
+    sp[3] = (uint64_t) func;            // r13
+    sp[4] = 0;                          // r12
+    sp[5] = 0;                          // rbx
+    sp[6] = 0;                          // rbp
+    sp[7] = (uint64_t) &sylar_context_entry; // 返回地址
+#elif defined(__aarch64__)
+    auto *sp = (uint64_t *) (top - CONTEXT_SLOTS * sizeof(uint64_t));
+    for (size_t i = 0; i < CONTEXT_SLOTS; ++i) {
+        sp[i] = 0;
+    }
+    sp[1] = (uint64_t) func;                  // x20
+    sp[11] = (uint64_t) &sylar_context_entry; // x30
+#endif
+    m_sp = sp;
+    return true;
+}
+
+void *Context::getSP() const
+{
+    return m_sp;
+}
+
+bool Context::Swap(Context &from, Context &to)
+{
+    sylar_context_swap(&from.m_sp, to.m_sp);
+    return true;
+}
+
+const char *Context::GetBackend()
+{
+    return "asm";
+}
+
+#else
+
+bool Context::make(void *stack, size_t size, EntryFunc func)
+{
+    if (getcontext(&m_ctx)) {
+        return false;
+    }
+    m_ctx.uc_link = nullptr;
+    m_ctx.uc_stack.ss_sp = stack;
+    m_ctx.uc_stack.ss_size = size;
+    makecontext(&m_ctx, func, 0);
+    m_saved = false;
+    return true;
+}
+
+void *Context::getSP() const
+{
+    if (!m_saved) {
+        return nullptr;
+    }
+#if defined(__x86_64__)
+    return (void *) m_ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    return (void *) m_ctx.uc_mcontext.sp;
+#else
+    return nullptr;
+#endif
+}
+
+bool Context::Swap(Context &from, Context &to)
+{
+    from.m_saved = true;
+    return swapcontext(&from.m_ctx, &to.m_ctx) == 0;
+}
+
+const char *Context::GetBackend()
+{
+    return "ucontext";
+}
+
+#endif
+
+}
@@ -0,0 +1,47 @@
+#ifndef __SYLAR_CONTEXT_H__
+#define __SYLAR_CONTEXT_H__
+
+#include <cstddef>
+
+// 默认用手写汇编切换上下文（只保存callee-saved寄存器，不走rt_sigprocmask系统调用）
+// 不支持的平台或者编译时定义了SYLAR_FIBER_UCONTEXT，则退回到ucontext
+#if !defined(SYLAR_FIBER_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define SYLAR_FIBER_UCONTEXT 1
+#endif
+
+#ifdef SYLAR_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+namespace sylar {
+
+// 协程的上下文
+class Context {
+public:
+    typedef void (*EntryFunc)();
+
+    // 在[stack, stack + size)上构造一个新的上下文，第一次切进去时从func开始执行
+    // func不能返回
+    bool make(void *stack, size_t size, EntryFunc func);
+
+    // 上下文保存的栈顶指针（切出去时的栈顶，或者make构造的初始栈顶）
+    void *getSP() const;
+
+    // 将当前上下文保存到from，并切换到to
+    static bool Swap(Context &from, Context &to);
+
+    // 编译进来的实现：asm / ucontext
+    static const char *GetBackend();
+
+private:
+#ifdef SYLAR_FIBER_UCONTEXT
+    ucontext_t m_ctx{};
+    bool m_saved = false;
+#else
+    void *m_sp = nullptr;
+#endif
+};
+
+}
+
+#endif
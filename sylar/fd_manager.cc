@@ -6,10 +6,6 @@
 
 namespace sylar {
 
-    FdCtx::FdCtx(int fd) : m_fd(fd) {}
-
-    FdCtx::~FdCtx() = default;
-
     bool FdCtx::init() {
         if (m_isInit) {
             return true;
@@ -67,40 +63,70 @@ namespace sylar {
     }
 
 
-    FdCtx::ptr FdManger::getFdCtx(int fd, bool auto_create)
+    FdManger::~FdManger()
+    {
+        for (auto &chunk : m_chunks) {
+            // 删除nullptr没有关系
+            delete[] chunk.load();
+        }
+    }
+
+    FdCtx *FdManger::getSlot(int fd, bool create)
     {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (fd >= m_datas.size()) {
-            if (!auto_create) {
+        size_t index = (size_t) fd >> CHUNK_BITS;
+        if (fd < 0 || index >= CHUNK_COUNT) {
+            return nullptr;
+        }
+        FdCtx *chunk = m_chunks[index].load(std::memory_order_acquire);
+        if (!chunk) {
+            if (!create) {
                 return nullptr;
             }
-        } else {
-            if (m_datas[fd] || !auto_create) {
-                return m_datas[fd];
+            // 多个线程同时分配的话只留下先放进去的那个
+            auto new_chunk = new FdCtx[CHUNK_SIZE];
+            for (size_t i = 0; i < CHUNK_SIZE; ++i) {
+                new_chunk[i].m_fd = (int) ((index << CHUNK_BITS) + i);
+            }
+            if (m_chunks[index].compare_exchange_strong(chunk, new_chunk,
+                                                        std::memory_order_acq_rel)) {
+                chunk = new_chunk;
+            } else {
+                delete[] new_chunk;
             }
         }
-        lock.unlock();
+        return &chunk[fd & (CHUNK_SIZE - 1)];
+    }
 
-        RWMutexType::WriteLock lock2(m_mutex);
-        // 如果查找的fd对应的上下文不存在并且想要自动创建一个
-        FdCtx::ptr ctx(new FdCtx(fd));
-        if (fd >= m_datas.size()) {
-            m_datas.resize(fd + 1);
+    FdCtx *FdManger::getFdCtx(int fd, bool auto_create)
+    {
+        FdCtx *ctx = getSlot(fd, auto_create);
+        if (!ctx) {
+            return nullptr;
+        }
+        if (ctx->m_open.load(std::memory_order_acquire)) {
+            return ctx;
+        }
+        if (!auto_create) {
+            return nullptr;
         }
-        m_datas[fd] = ctx;
+        // 如果查找的fd对应的上下文不存在并且想要自动创建一个
+        // 同一个fd只有创建它的线程会走到这里（socket/accept返回之后）
+        ctx->m_isInit = false;
+        ctx->m_isSocket = false;
+        ctx->m_sys_nonblock = false;
+        ctx->init();
+        ctx->m_open.store(true, std::memory_order_release);
         return ctx;
     }
 
     void FdManger::delFdCtx(int fd)
     {
-        RWMutexType::WriteLock lock(m_mutex);
-        if (fd >= m_datas.size()) {
+        FdCtx *ctx = getSlot(fd, false);
+        if (!ctx) {
             return;
         }
-        m_datas[fd].reset();
+        // 只是标记为不再接管，记录留给下一个同号的fd
+        ctx->m_open.store(false, std::memory_order_release);
     }
 
-
-
-
 }
\ No newline at end of file
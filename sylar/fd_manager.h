@@ -5,20 +5,40 @@
 #ifndef __SYLAR_FD_MANAGER_H__
 #define __SYLAR_FD_MANAGER_H__
 
+#include <atomic>
+#include <functional>
 #include <memory>
-#include <vector>
 
+#include "fiber.h"
 #include "thread.h"
 #include "singleton.h"
 
 namespace sylar {
 
-// 定义每一个文件描述符的类型及属性
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
+class Scheduler;
+class IOManager;
+class TaskList;
+
+// 每个文件描述符一条记录：hook需要的属性和IOManager等待事件的状态放在一起
+// 记录放在FdManger的表里，分配之后不会移动也不会释放，fd关闭之后留给下一个同号的fd
+// 独占cache line，相邻fd在不同线程上操作时不会互相影响
+class alignas(64) FdCtx {
+friend class FdManger;
+friend class IOManager;
 public:
-    using ptr = std::shared_ptr<FdCtx>;
-    explicit FdCtx(int fd);
-    ~FdCtx();
+    typedef Mutex MutexType;
+
+    // 等待某个事件的协程或者回调
+    struct EventContext {
+        Scheduler *scheduler = nullptr; // 执行该事件的调度器
+        Fiber::ptr fiber;
+        std::function<void()> cb;
+        int thread = -1; // 触发后在哪个线程执行，-1表示不指定
+    };
+
+    FdCtx() = default;
+    FdCtx(const FdCtx &) = delete;
+    FdCtx &operator=(const FdCtx &) = delete;
 
     bool init();
     bool isInit() const { return m_isInit; }
@@ -37,27 +57,55 @@ public:
     uint64_t get_timeout(int type) const;
 
 private:
+    // 以下三个函数由IOManager持有m_mutex时调用，event为IOManager::READ/WRITE，实现在iomanager.cc
+    EventContext &getContext(uint32_t event);
+    static void resetContext(EventContext &event_ctx);
+    // batch不为空时，等待者由batch_owner执行的话包装成任务放进batch，由调用者一次性加入调度器
+    void triggerEvent(uint32_t event, Scheduler *batch_owner = nullptr, TaskList *batch = nullptr);
+
+private:
+    int m_fd = -1;
+    // 是否被hook接管（hook的socket/accept创建，close时删除）
+    std::atomic<bool> m_open{false};
     bool m_isInit = false;
     bool m_isSocket = false;
     bool m_sys_nonblock = false;
     bool m_user_nonblock = false;
     bool m_isClosed = false;
-    int m_fd;
     uint64_t m_recv_timeout = -1;
     uint64_t m_send_timeout = -1;
+
+    // 以下是IOManager等待事件的状态，持有m_mutex时读写
+    // 同一时间一个fd只在一个IOManager里等待事件
+    MutexType m_mutex;
+    uint32_t m_events = 0; // 已经注册的事件（有人在等）
+    // 常驻注册模式下，fd在内核里一直关注读写两个方向
+    // 没人等的时候来的边缘事件记在m_ready里，下次有人来等时直接触发
+    bool m_registered = false;
+    uint32_t m_ready = 0;
+    EventContext read; // 读事件
+    EventContext write; // 写事件
 };
 
 // 管理文件描述符
+// 两级的表：第一级是固定大小的块指针数组，块在第一次用到时分配，查找只需要两次读，不需要加锁
 class FdManger {
 public:
-    using RWMutexType = RWMutex;
+    ~FdManger();
 
-    FdCtx::ptr getFdCtx(int fd, bool auto_create = false);
+    // 被hook接管的fd的记录，没有接管并且auto_create为false时返回nullptr
+    FdCtx *getFdCtx(int fd, bool auto_create = false);
     void delFdCtx(int fd);
 
+    // 不管有没有被hook接管，取fd的记录，IOManager用
+    // 所在的块还没分配时，create为true则分配，否则返回nullptr
+    FdCtx *getSlot(int fd, bool create);
+
 private:
-    RWMutexType m_mutex;
-    std::vector<FdCtx::ptr> m_datas;
+    static const size_t CHUNK_BITS = 10;
+    static const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    static const size_t CHUNK_COUNT = 4096; // 最多4M个fd
+    std::atomic<FdCtx *> m_chunks[CHUNK_COUNT]{};
 };
 
 using FdMgr = Singleton<FdManger>;
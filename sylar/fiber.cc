@@ -7,8 +7,10 @@
 #include "macro.h"
 #include "log.h"
 #include "scheduler.h"
+#include "stack_allocator.h"
 
 #include <atomic>
+#include <cstring>
 #include <utility>
 
 namespace sylar {
@@ -27,20 +29,67 @@ static thread_local std::shared_ptr<Fiber::ptr> t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
     Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024, "fiber stack size");
 
-// 以malloc的方式分配栈空间
-class Malloc_Stack_Allocator {
-public:
-    static void *Alloc(size_t size)
+// 栈分配器见stack_allocator.h，由配置项fiber.stack_allocator选择
+
+// 共享栈模式下每个共享栈的大小
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 8 * 1024 * 1024, "fiber shared stack size");
+// 共享栈模式下每个线程的共享栈个数
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "fiber shared stack count(per thread)");
+
+// 共享栈，同一时刻只有一个协程(occupant)的栈内容在上面
+struct SharedStack {
+    typedef Spin_Mutex MutexType;
+
+    SharedStack(StackAllocator *allocator, size_t size)
+        : allocator(allocator), size(size)
     {
-        return malloc(size);
+        stack = (char *) allocator->alloc(size);
+        SYLAR_ASSERT2(stack, "Alloc shared stack error!")
     }
-    static void Dealloc(void *vp/*size_t size*/)
+    ~SharedStack()
+    {
+        allocator->dealloc(stack, size);
+    }
+
+    StackAllocator *allocator;
+    char *stack;
+    size_t size;
+    Fiber *occupant = nullptr;
+    // 协程可能在别的线程析构，析构时要和本线程的顶替操作互斥
+    MutexType mutex;
+};
+
+// 每个线程的共享栈池，协程第一次切入时按轮转的方式绑定一个
+struct SharedStackPool {
+    std::vector<std::shared_ptr<SharedStack>> stacks;
+    size_t next = 0;
+
+    std::shared_ptr<SharedStack> get()
     {
-        free(vp);
+        if (stacks.empty()) {
+            size_t count = std::max<uint32_t>(g_fiber_shared_stack_count->getValue(), 1);
+            size_t size = g_fiber_shared_stack_size->getValue();
+            for (size_t i = 0; i < count; ++i) {
+                stacks.emplace_back(std::make_shared<SharedStack>(StackAllocator::GetDefault(), size));
+            }
+        }
+        return stacks[next++ % stacks.size()];
     }
 };
 
-using Stack_Allocator = Malloc_Stack_Allocator;
+static thread_local SharedStackPool t_shared_stack_pool;
+
+// 没有协程调度器时（比如单独测试协程），切换的对象就是线程的主协程
+static Fiber *Get_main_fiber()
+{
+    Fiber *main_fiber = Scheduler::GetMainFiber();
+    if (!main_fiber && t_threadFiber) {
+        main_fiber = t_threadFiber->get();
+    }
+    return main_fiber;
+}
 
 // 主协程的构造函数(主协程用来创建子协程）
 Fiber::Fiber()
@@ -48,39 +97,39 @@ Fiber::Fiber()
     m_state = EXEC;
     SetThis(this);
 
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "GetContext Error!")
-    }
-
+    // 主协程跑在线程自己的栈上，上下文在第一次切出去的时候保存
     ++s_fiber_count;
 
     SYLAR_LOG_INFO(g_logger) << "Main Fiber created ! id=" << m_id;
 
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
-    : m_id(++s_fiber_id), m_cb(std::move(cb))
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller, bool shared_stack)
+    : m_id(++s_fiber_id), m_cb(std::move(cb)), m_shared(shared_stack)
 {
     ++s_fiber_count;
+    if (m_shared) {
+        // 调度器所在线程的root_fiber要和主协程来回切换，不能用共享栈
+        SYLAR_ASSERT(!use_caller)
+        // 共享栈在第一次切入时才绑定，上下文也到那时再构造
+        m_state = INIT;
+        SYLAR_LOG_INFO(g_logger) << "One shared stack fiber created ! id=" << m_id;
+        return;
+    }
     // 默认使用配置文件中的栈大小
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
 
-    m_stack = Stack_Allocator::Alloc(m_stacksize);
+    // 记下分配器，析构的时候要还给同一个分配器（配置可能中途被修改）
+    m_allocator = StackAllocator::GetDefault();
+    m_stack = m_allocator->alloc(m_stacksize);
+    SYLAR_ASSERT2(m_stack, "Alloc fiber stack error!")
 
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "GetContext Error!")
-    }
     // 创建一个协程就需要创建一个上下文
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
     // 每创建一个子协程，就把该子协程的上下文绑定到mainFunc上，从而每当切换
     // 到该子协程的上下文时，就会调用mainFunc
     // use_caller表示之后协程调度的时候会把调度器所在线程算进线程池里
-    if (!use_caller) {
-        makecontext(&m_ctx, &MainFunc, 0);
-    } else {
-        makecontext(&m_ctx, &Caller_MainFunc, 0);
+    if (!m_ctx.make(m_stack, m_stacksize, use_caller ? &Caller_MainFunc : &MainFunc)) {
+        SYLAR_ASSERT2(false, "Make context error!")
     }
     m_state = INIT;
 
@@ -90,13 +139,17 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 Fiber::~Fiber()
 {
     --s_fiber_count;
-    if (m_stack) {
+    if (m_stack || m_shared) {
         SYLAR_LOG_DEBUG(g_logger) << "One sub fiber will die, id=" << m_id
                                   << ", state=" << m_state;
         SYLAR_ASSERT(m_state == INIT ||
             m_state == TERM ||
             m_state == EXCPT)
-        Stack_Allocator::Dealloc(m_stack);
+        if (m_shared) {
+            release_shared_stack();
+        } else {
+            m_allocator->dealloc(m_stack, m_stacksize);
+        }
     } else {
         SYLAR_ASSERT(!m_cb)
         SYLAR_ASSERT(m_state == EXEC)
@@ -113,19 +166,21 @@ Fiber::~Fiber()
 // 重置当前的协程（必须是子协程）
 void Fiber::reset(std::function<void()> cb)
 {
-    SYLAR_ASSERT(m_stack);
+    SYLAR_ASSERT(m_stack || m_shared);
     SYLAR_ASSERT(m_state == INIT ||
         m_state == TERM ||
         m_state == EXCPT)
     m_cb = std::move(cb);
-    // 拿出当前的上下文，并与mainFunc绑定
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "GetContext Error!")
+    if (m_shared) {
+        // 共享栈协程重新在切入的线程上绑定共享栈
+        release_shared_stack();
+        m_state = INIT;
+        return;
+    }
+    // 重新在栈上构造上下文，并与mainFunc绑定
+    if (!m_ctx.make(m_stack, m_stacksize, &MainFunc)) {
+        SYLAR_ASSERT2(false, "Make context error!")
     }
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-    makecontext(&m_ctx, &MainFunc, 0);
     m_state = INIT;
 
 }
@@ -134,49 +189,124 @@ void Fiber::call()
     SetThis(this);
     SYLAR_ASSERT(m_state != EXEC)
     m_state = EXEC;
-    if (swapcontext(&((*t_threadFiber)->m_ctx), &m_ctx)) {
+    if (!Context::Swap((*t_threadFiber)->m_ctx, m_ctx)) {
         SYLAR_ASSERT2(false, "Call error!")
     }
+    apply_yield_state();
 }
 void Fiber::back()
 {
     SetThis(t_threadFiber->get());
-    if (swapcontext(&m_ctx, &(*t_threadFiber)->m_ctx)) {
+    if (!Context::Swap(m_ctx, (*t_threadFiber)->m_ctx)) {
         SYLAR_ASSERT2(false, "Back to main fiber error.")
     }
 }
 // 将协程切换到当前线程执行
-void Fiber::swapIn()
+Fiber::State Fiber::swapIn()
 {
+    if (m_shared) {
+        prepare_shared_stack();
+    }
     SetThis(this);
     SYLAR_ASSERT(m_state != EXEC)
     m_state = EXEC;
-//        if (swapcontext(&(*t_threadFiber)->m_ctx, &m_ctx)) {
-//            SYLAR_ASSERT2(false, "SwapContext error!")
-//        }
-//        if (Scheduler::GetMainFiber() == t_threadFiber.get().get()) {
-//            SYLAR_LOG_DEBUG(g_logger) << "Equal !";
-//        }
-
     // 调用swapIn函数的协程应该是root_fiber(或者其他线程），所以将root_fiber切出去，将this指针对应的fiber切进来
-    if (swapcontext(&(Scheduler::GetMainFiber()->m_ctx), &m_ctx)) {
+    if (!Context::Swap(Get_main_fiber()->m_ctx, m_ctx)) {
         SYLAR_ASSERT2(false, "SwapContext error!")
     }
+    return apply_yield_state();
+}
+
+Fiber::State Fiber::apply_yield_state()
+{
+    // 协程已经完整地切出来了（上下文保存好了），这时才把状态改成HOLD/READY
+    // 在此之前其他线程看到的一直是EXEC，不会在上下文保存完之前就把它切进去
+    State state = m_state;
+    if (state == EXEC) {
+        // 没有经过Yield直接切出来的，当作挂起
+        state = m_yield_state == EXEC ? HOLD : m_yield_state;
+        m_state = state;
+    }
+    m_yield_state = EXEC;
+    // 状态改成HOLD之后协程可能马上就被别的线程切进去了，调用者只能用这里返回的状态
+    return state;
 }
 // 将协程切换到后台执行
 void Fiber::swapOut()
 {
-    SetThis(Scheduler::GetMainFiber());
-
-//        if (swapcontext(&m_ctx, &(*t_threadFiber)->m_ctx)) {
-//            SYLAR_ASSERT2(false, "SwapContext error!")
-//        }
-    if (swapcontext(&m_ctx, &(Scheduler::GetMainFiber()->m_ctx))) {
+    Fiber *main_fiber = Get_main_fiber();
+    SetThis(main_fiber);
+    if (!Context::Swap(m_ctx, main_fiber->m_ctx)) {
         SYLAR_ASSERT2(false, "SwapContext error!")
     }
 
 }
 
+void Fiber::prepare_shared_stack()
+{
+    if (!m_shared_stack) {
+        // 第一次切入，绑定当前线程的一个共享栈，之后只能在该线程上执行
+        m_shared_stack = t_shared_stack_pool.get();
+        m_stack_thread = GetThreadId();
+        if (!m_ctx.make(m_shared_stack->stack, m_shared_stack->size, &MainFunc)) {
+            SYLAR_ASSERT2(false, "Make context error!")
+        }
+    }
+    SYLAR_ASSERT2(m_stack_thread == GetThreadId(),
+                  "Shared stack fiber resumed on another thread, id=" + std::to_string(m_id))
+
+    SharedStack::MutexType::Lock lock(m_shared_stack->mutex);
+    Fiber *occupant = m_shared_stack->occupant;
+    if (occupant == this) {
+        // 栈上的内容还是自己的，不用拷贝
+        return;
+    }
+    if (occupant) {
+        occupant->save_shared_stack();
+    }
+    if (m_saved_stack) {
+        // 把之前保存的栈内容拷回共享栈的同一位置
+        memcpy(m_shared_stack->stack + m_shared_stack->size - m_saved_size,
+               m_saved_stack, m_saved_size);
+        free(m_saved_stack);
+        m_saved_stack = nullptr;
+        m_saved_size = 0;
+    }
+    m_shared_stack->occupant = this;
+}
+
+void Fiber::save_shared_stack()
+{
+    // 调用时已经持有共享栈的锁
+    m_shared_stack->occupant = nullptr;
+    if (m_state == TERM || m_state == EXCPT || m_state == INIT) {
+        // 已经结束的协程栈上没有需要保留的东西
+        return;
+    }
+    // 只保存栈顶指针到栈底之间实际用到的部分
+    char *sp = (char *) m_ctx.getSP();
+    char *top = m_shared_stack->stack + m_shared_stack->size;
+    SYLAR_ASSERT(sp >= m_shared_stack->stack && sp < top)
+    m_saved_size = top - sp;
+    m_saved_stack = (char *) malloc(m_saved_size);
+    memcpy(m_saved_stack, sp, m_saved_size);
+}
+
+void Fiber::release_shared_stack()
+{
+    if (m_shared_stack) {
+        SharedStack::MutexType::Lock lock(m_shared_stack->mutex);
+        if (m_shared_stack->occupant == this) {
+            m_shared_stack->occupant = nullptr;
+        }
+    }
+    m_shared_stack.reset();
+    m_stack_thread = -1;
+    free(m_saved_stack);
+    m_saved_stack = nullptr;
+    m_saved_size = 0;
+}
+
 void Fiber::setState(State state)
 {
     //SYLAR_LOG_DEBUG(g_logger) << "Change state to " << state << ", id=" << m_id;
@@ -205,7 +335,7 @@ Fiber::ptr Fiber::GetThis()
 void Fiber::Yield_to_Ready()
 {
     Fiber::ptr cur = GetThis();
-    cur->m_state = READY;
+    cur->m_yield_state = READY;
     cur->swapOut();
 }
 
@@ -214,7 +344,7 @@ void Fiber::Yield_to_Hold()
 {
     Fiber::ptr cur = GetThis();
     SYLAR_LOG_DEBUG(g_logger) << "Change state to HOLD, id=" << cur->getId();
-    cur->m_state = HOLD;
+    cur->m_yield_state = HOLD;
     cur->swapOut();
 }
 
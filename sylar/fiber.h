@@ -7,13 +7,16 @@
 
 #include <memory>
 #include <functional>
-#include <ucontext.h>
 #include "thread.h"
+#include "context.h"
 //#include "scheduler.h"
 
 
 namespace sylar {
 
+    class StackAllocator;
+    struct SharedStack;
+
     class Fiber: public std::enable_shared_from_this<Fiber> {
     friend class Scheduler;
     public:
@@ -31,8 +34,10 @@ namespace sylar {
         Fiber();
 
     public:
+        // shared_stack为true时使用共享栈模式：协程跑在所在线程的几个共享栈上，
+        // 被别的协程顶替时才把用到的那部分栈拷贝到堆上，适合大量挂起的协程
         explicit Fiber(std::function<void()> cb, size_t stacksize = 0,
-                       bool use_caller = false);
+                       bool use_caller = false, bool shared_stack = false);
         ~Fiber();
 
         // 重置协程函数，并重置状态
@@ -42,8 +47,8 @@ namespace sylar {
         void call();
 
         void back();
-        // 切换到当前协程执行
-        void swapIn();
+        // 切换到当前协程执行，返回协程切出来时的状态
+        State swapIn();
         // 切换到后台执行
         void swapOut();
         // 返回该协程的id
@@ -54,6 +59,10 @@ namespace sylar {
 //        {
 //            m_state = state;
 //        }
+        // 是否为共享栈协程
+        bool isSharedStack() const { return m_shared; }
+        // 共享栈协程只能在绑定共享栈的线程上恢复执行，返回该线程id（未绑定则为-1）
+        int getStackThread() const { return m_stack_thread; }
     public:
         // 设置当前协程
         static void SetThis(Fiber* f);
@@ -78,12 +87,31 @@ namespace sylar {
         uint64_t m_id = 0;
         uint32_t m_stacksize = 0;
         State m_state = INIT;
+        State m_yield_state = EXEC; // Yield时要切换到的状态，切出去之后才生效
 
-        ucontext_t m_ctx{};
+        Context m_ctx;
         void* m_stack = nullptr;
+        StackAllocator* m_allocator = nullptr; // 分配该协程栈的分配器
 
         std::function<void()> m_cb;
 
+        // 共享栈模式
+        bool m_shared = false;
+        int m_stack_thread = -1; // 绑定的共享栈所属的线程
+        std::shared_ptr<SharedStack> m_shared_stack; // 绑定的共享栈
+        char* m_saved_stack = nullptr; // 被顶替时保存下来的栈内容
+        size_t m_saved_size = 0;
+
+    private:
+        // 切入共享栈协程之前，把占着该共享栈的协程的栈保存下来，再恢复自己的栈
+        void prepare_shared_stack();
+        // 把自己用到的那部分共享栈拷贝到堆上
+        void save_shared_stack();
+        // 解除与共享栈的绑定
+        void release_shared_stack();
+        // 切回来之后，让Yield时设置的状态生效
+        State apply_yield_state();
+
     public:
 
     };
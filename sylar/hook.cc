@@ -6,6 +6,7 @@
 #include "config.h"
 
 #include <dlfcn.h>
+#include <atomic>
 #include <cstdarg>
 
 namespace sylar {
@@ -15,6 +16,13 @@ static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 // 定义一个配置项
 static ConfigVar<int>::ptr g_tcp_connect_timeout =
     Config::Lookup("tcp_connect_timeout", 5000, "tcp connect timeout");
+// 读写和连接超时允许晚触发的比例(千分比)，超时时间相近的连接合并到一次唤醒里处理
+static ConfigVar<int>::ptr g_tcp_timeout_slack =
+    Config::Lookup("tcp_timeout_slack", 10, "tcp timeout slack, permille of the timeout");
+// hook创建的socket上设置SO_BUSY_POLL(微秒)，阻塞读的时候内核先忙等网卡队列，0表示不设置
+// 调大到超过net.core.busy_read需要CAP_NET_ADMIN
+static ConfigVar<int>::ptr g_tcp_busy_poll =
+    Config::Lookup("tcp_busy_poll_us", 0, "SO_BUSY_POLL(us) on hooked sockets, 0 to disable");
 
 static thread_local bool t_hook_enable = false;
 
@@ -55,6 +63,8 @@ void hook_init()
 }
 
 static uint64_t s_connect_timeout = -1;
+static std::atomic<int> s_timeout_slack{0};
+static std::atomic<int> s_busy_poll{0};
 // 以下操作的目地是：
 // 让hook_init()函数在main函数前执行，因为静态变量在main函数前初始化
 struct _Hook_initer {
@@ -66,6 +76,14 @@ struct _Hook_initer {
             SYLAR_LOG_INFO(sylar::g_logger) << "Tcp connect timeout changed from " <<
                                             old_value << " to " << new_value;
         });
+        s_timeout_slack = g_tcp_timeout_slack->getValue();
+        g_tcp_timeout_slack->addListener([](const int &old_value, const int &new_value) {
+            s_timeout_slack = new_value;
+        });
+        s_busy_poll = g_tcp_busy_poll->getValue();
+        g_tcp_busy_poll->addListener([](const int &old_value, const int &new_value) {
+            s_busy_poll = new_value;
+        });
     }
 };
 static _Hook_initer s_hook_initer;
@@ -75,6 +93,12 @@ bool is_hook_enable()
     return t_hook_enable;
 }
 
+// 超时定时器的slack：超时时间的千分之tcp_timeout_slack
+static std::chrono::microseconds timeout_slack(uint64_t timeout_ms)
+{
+    return std::chrono::microseconds(timeout_ms * s_timeout_slack);
+}
+
 void set_hook_enable(bool flag)
 {
     t_hook_enable = flag;
@@ -89,17 +113,37 @@ struct timer_info {
     int cancelled = 0;
 };
 
+// do_io等待时用的对象，放在协程栈上，超时用的定时器节点也嵌在里面
+// 定时器在当前线程的分片里，等到的事件也指定回当前线程执行，
+// 所以超时回调和取消定时器都在同一个线程里，整个EAGAIN->挂起->唤醒的过程不分配内存
+struct io_waiter : public sylar::TimerNode {
+    sylar::IOManager *iom = nullptr;
+    int fd = -1;
+    uint32_t event = 0;
+    int cancelled = 0;
+};
+
+static void on_io_timeout(sylar::TimerNode *node)
+{
+    auto waiter = static_cast<io_waiter *>(node);
+    // 事件已经先到了的话不算超时，让协程回去重试
+    // 协程只会在当前线程里被切回来，所以回调返回之前waiter都还在
+    if (waiter->iom->cancel_event(waiter->fd, (sylar::IOManager::Event) waiter->event)) {
+        waiter->cancelled = ETIMEDOUT;
+    }
+}
+
 template<typename Original_fun, typename ... Args>
 static ssize_t do_io(int fd, Original_fun fun, const char *hook_fun_name,
                      uint32_t event, int timeout_so, Args... args)
 {
     if (!sylar::is_hook_enable()) {
         // 直接调用传进来的函数
-        fun(fd, std::forward<Args>(args)...);
+        return fun(fd, std::forward<Args>(args)...);
     }
 
     // 通过fd_manager获取该fd对应的上下文信息
-    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
+    sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
     if (!ctx) {
         // 如果对应的信息不存在
         return fun(fd, std::forward<Args>(args)...);
@@ -116,9 +160,15 @@ static ssize_t do_io(int fd, Original_fun fun, const char *hook_fun_name,
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    std::shared_ptr<timer_info> tinfo(new timer_info);
     // 获取该fd对应的超时时间
     int64_t fd_timeout = ctx->get_timeout(timeout_so);
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    io_waiter waiter;
+    waiter.iom = iom;
+    waiter.fd = fd;
+    waiter.event = event;
+    // 用不了侵入式定时器时才用到
+    std::shared_ptr<timer_info> tinfo;
 
     while (true) {
         // 先调用一下试试看
@@ -131,29 +181,41 @@ static ssize_t do_io(int fd, Original_fun fun, const char *hook_fun_name,
             // 如果是EAGAIN代表该调用是个异步调用
             // 则以该fd对应的超时时间开一个定时器(定时器发挥作用即代表时间到了，该事件直接取消）
             // 并且将该事件丢到iomanager里，等待epoll_wait接收到信息
-            sylar::IOManager *iom = sylar::IOManager::GetThis();
             sylar::Timer::ptr timer;
-            std::weak_ptr<timer_info> winfo(tinfo);
+            int thread = -1;
 
             if (fd_timeout != -1) {
-                timer = iom->add_condition_timer(fd_timeout, [iom, winfo, fd, event]() {
-                    // 将weak_ptr转为shared_ptr
-                    auto t = winfo.lock();
-                    // 如果该条件已经不存在了或者条件中已设置为取消
-                    if (!t || t->cancelled) {
-                        return;
+                // 共享栈协程挂起之后栈会被换走，节点不能放在上面
+                if (!sylar::Fiber::GetThis()->isSharedStack()
+                    && iom->add_timer_node(&waiter, std::chrono::milliseconds(fd_timeout),
+                                           &on_io_timeout, sylar::timeout_slack(fd_timeout))) {
+                    thread = sylar::GetThreadId();
+                } else {
+                    // 不在工作线程里或者定时器存储不支持，用普通的定时器
+                    if (!tinfo) {
+                        tinfo.reset(new timer_info);
                     }
-                    // 如果还没有则手动设置为取消
-                    t->cancelled = ETIMEDOUT;
-                    iom->cancel_event(fd, (sylar::IOManager::Event) (1));
-                }, winfo);
+                    std::weak_ptr<timer_info> winfo(tinfo);
+                    timer = iom->add_condition_timer(fd_timeout, [iom, winfo, fd, event]() {
+                        // 将weak_ptr转为shared_ptr
+                        auto t = winfo.lock();
+                        // 如果该条件已经不存在了或者条件中已设置为取消
+                        if (!t || t->cancelled) {
+                            return;
+                        }
+                        // 如果还没有则手动设置为取消
+                        t->cancelled = ETIMEDOUT;
+                        iom->cancel_event(fd, (sylar::IOManager::Event) event);
+                    }, winfo, false, sylar::timeout_slack(fd_timeout));
+                }
             }
 
             // 这里没有传入cb,则会将当前协程作为回调任务
-            int rt = iom->add_event(fd, (sylar::IOManager::Event) (1));
+            int rt = iom->add_event(fd, (sylar::IOManager::Event) event, nullptr, thread);
             if (rt) {
                 SYLAR_LOG_ERROR(sylar::g_logger) << hook_fun_name << " addEvent("
-                                                 << fd << ", " << 1 << ")Failed!";
+                                                 << fd << ", " << event << ")Failed!";
+                iom->cancel_timer_node(&waiter);
                 if (timer) {
                     timer->cancel();
                 }
@@ -162,13 +224,15 @@ static ssize_t do_io(int fd, Original_fun fun, const char *hook_fun_name,
             // 添加好定时器和事件之后就可以让出协程了
             sylar::Fiber::Yield_to_Hold();
             // 下一次该任务被切回来时就会来到这里
+            // 定时器还存在意味着还没超时
+            iom->cancel_timer_node(&waiter);
             if (timer) {
-                // 定时器还存在意味着还没超时
                 timer->cancel();
             }
-            if (tinfo->cancelled) {
+            int cancelled = waiter.cancelled ? waiter.cancelled : (tinfo ? tinfo->cancelled : 0);
+            if (cancelled) {
                 // 如果取消掉了，说明已经超时
-                errno = tinfo->cancelled;
+                errno = cancelled;
                 return -1;
             }
             // 不然说明定时器还没超时，意味着是epoll_wait等到了事件, 则重新执行这个过程
@@ -179,6 +243,75 @@ static ssize_t do_io(int fd, Original_fun fun, const char *hook_fun_name,
 
 }
 
+// io_uring后端下把读写直接交给内核完成，省掉EAGAIN之后注册事件再重试的过程
+// timeout_so为-1时使用req里已经设好的超时时间
+// 返回false表示不能走这条路（没开hook、不是socket、共享栈协程等），由调用者走原来的do_io
+static bool do_uring_io(int fd, sylar::IoRequest &req, int timeout_so, ssize_t &n)
+{
+    if (!sylar::is_hook_enable()) {
+        return false;
+    }
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    if (!iom || !iom->supports_completion()) {
+        return false;
+    }
+    sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
+    if (!ctx || ctx->isClosed() || !ctx->isSocket() || ctx->get_user_nonblock()) {
+        return false;
+    }
+    // 共享栈协程挂起之后栈上的内容会被换走，内核不能往上面的缓冲区写
+    if (sylar::Fiber::GetThis()->isSharedStack()) {
+        return false;
+    }
+    if (timeout_so != -1) {
+        req.timeout_ms = ctx->get_timeout(timeout_so);
+    }
+
+    int rt = iom->submit_io(req);
+    if (rt == -EAGAIN && !req.timed_out) {
+        // 提交队列满了之类的，退回就绪式的do_io
+        return false;
+    }
+    if (rt < 0) {
+        if (req.timed_out) {
+            errno = ETIMEDOUT;
+        } else if (rt == -ECANCELED) {
+            // 被close取消的
+            errno = EBADF;
+        } else {
+            errno = -rt;
+        }
+        n = -1;
+    } else {
+        n = rt;
+    }
+    return true;
+}
+
+// 新建的socket在常驻注册模式下直接注册到当前的IOManager
+// 配置了tcp_busy_poll_us的话顺便打开SO_BUSY_POLL
+static void register_fd(int fd)
+{
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    auto ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
+    if (!ctx || !ctx->isSocket()) {
+        return;
+    }
+    if (iom) {
+        iom->register_fd(fd);
+    }
+    int busy_poll = sylar::s_busy_poll.load(std::memory_order_relaxed);
+    if (busy_poll > 0
+        && setsockopt_f(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll))) {
+        // 没有权限的话每个socket都会失败，只提示一次
+        static std::atomic<bool> s_warned{false};
+        if (!s_warned.exchange(true)) {
+            SYLAR_LOG_WARN(sylar::g_logger) << "setsockopt SO_BUSY_POLL=" << busy_poll
+                                            << " failed, errno=" << errno;
+        }
+    }
+}
+
 extern "C" {
 // 该宏是定义一个跟sleep同函数签名的函数指针(全局变量）
 #define XX(name) name ## _fun name ## _f = nullptr;
@@ -198,7 +331,7 @@ unsigned int sleep(unsigned int seconds)
     // 这样就能防止sleep的时候程序啥都不做
 //        SYLAR_LOG_DEBUG(sylar::g_logger) << "Add a timer: " << seconds << "s"
 //            << ", fiber id=" << fiber->getId();
-    iom->add_timer(seconds * 1000, [fiber, iom, seconds]() {
+    iom->add_timer(std::chrono::seconds(seconds), [fiber, iom, seconds]() {
 //            SYLAR_LOG_DEBUG(sylar::g_logger) << "timeout: " << seconds << "s"
 //                << ", fiber id=" << fiber->getId();
         iom->schedule(fiber);
@@ -215,7 +348,7 @@ int usleep(useconds_t useconds)
 
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     auto iom = sylar::IOManager::GetThis();
-    iom->add_timer(useconds / 1000, [fiber, iom]() {
+    iom->add_timer(std::chrono::microseconds(useconds), [fiber, iom]() {
         iom->schedule(fiber);
     });
     fiber->Yield_to_Hold();
@@ -230,7 +363,7 @@ int nanosleep(const struct timespec *req, struct timespec *rem)
 
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     auto iom = sylar::IOManager::GetThis();
-    iom->add_timer(req->tv_sec * 1000 + req->tv_nsec / 1e6,
+    iom->add_timer(std::chrono::seconds(req->tv_sec) + std::chrono::nanoseconds(req->tv_nsec),
                    [fiber, iom]() {
                        iom->schedule(fiber);
                    });
@@ -249,6 +382,7 @@ int socket(int domain, int type, int protocol)
     }
     // 创建一个fd的相关信息
     sylar::FdMgr::GetInstance()->getFdCtx(fd, true);
+    register_fd(fd);
     return fd;
 }
 
@@ -272,6 +406,18 @@ int connect_with_timeout(int fd, const struct sockaddr *addr,
         return connect_f(fd, addr, addrlen);
     }
 
+    sylar::IoRequest req(sylar::IoRequest::CONNECT, fd);
+    req.addr = (sockaddr *) addr;
+    req.len = addrlen;
+    req.timeout_ms = timeout_ms;
+    ssize_t rt_uring;
+    if (do_uring_io(fd, req, -1, rt_uring)) {
+        return (int) rt_uring;
+    }
+
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    // 未连接的socket注册时就报了HUP，只有connect之后的可写事件才表示连接完成
+    iom->clear_ready(fd);
     int n = connect_f(fd, addr, addrlen);
     if (n == 0) {
         return 0;
@@ -280,7 +426,6 @@ int connect_with_timeout(int fd, const struct sockaddr *addr,
         return n;
     }
 
-    sylar::IOManager *iom = sylar::IOManager::GetThis();
     sylar::Timer::ptr timer;
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
@@ -296,7 +441,7 @@ int connect_with_timeout(int fd, const struct sockaddr *addr,
             // 该事件已经超时了，取消掉
             t->cancelled = ETIMEDOUT;
             iom->cancel_event(fd, sylar::IOManager::WRITE);
-        }, winfo);
+        }, winfo, false, sylar::timeout_slack(timeout_ms));
     }
 
     // connect是一个可写事件
@@ -341,17 +486,34 @@ int connect(int sockfd, const struct sockaddr *addr,
 int accept(int sockfd, struct sockaddr *addr,
             socklen_t *addrlen)
 {
-    int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ,
+    sylar::IoRequest req(sylar::IoRequest::ACCEPT, sockfd);
+    req.addr = addr;
+    req.addrlen = addrlen;
+    ssize_t n;
+    int fd;
+    if (do_uring_io(sockfd, req, SO_RCVTIMEO, n)) {
+        fd = (int) n;
+    } else {
+        fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ,
                    SO_RCVTIMEO, addr, addrlen);
+    }
     // 由于accept会返回一个新连接的句柄，需要初始化一下该句柄的相关信息
     if (fd >= 0) {
         sylar::FdMgr::GetInstance()->getFdCtx(fd, true);
+        register_fd(fd);
     }
     return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count)
 {
+    sylar::IoRequest req(sylar::IoRequest::RECV, fd);
+    req.buf = (void *) buf;
+    req.len = count;
+    ssize_t n;
+    if (do_uring_io(fd, req, SO_RCVTIMEO, n)) {
+        return n;
+    }
     return do_io(fd, read_f, "read", sylar::IOManager::READ,
                  SO_RCVTIMEO, buf, count);
 }
@@ -364,6 +526,14 @@ ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags)
 {
+    sylar::IoRequest req(sylar::IoRequest::RECV, sockfd);
+    req.buf = (void *) buf;
+    req.len = len;
+    req.flags = flags;
+    ssize_t n;
+    if (do_uring_io(sockfd, req, SO_RCVTIMEO, n)) {
+        return n;
+    }
     return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ,
                  SO_RCVTIMEO, buf, len, flags);
 }
@@ -384,6 +554,13 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
 
 ssize_t write(int fd, const void *buf, size_t count)
 {
+    sylar::IoRequest req(sylar::IoRequest::SEND, fd);
+    req.buf = (void *) buf;
+    req.len = count;
+    ssize_t n;
+    if (do_uring_io(fd, req, SO_SNDTIMEO, n)) {
+        return n;
+    }
     return do_io(fd, write_f, "write", sylar::IOManager::WRITE,
                  SO_SNDTIMEO, buf, count);
 }
@@ -396,6 +573,14 @@ ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 {
+    sylar::IoRequest req(sylar::IoRequest::SEND, sockfd);
+    req.buf = (void *) buf;
+    req.len = len;
+    req.flags = flags;
+    ssize_t n;
+    if (do_uring_io(sockfd, req, SO_SNDTIMEO, n)) {
+        return n;
+    }
     return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE,
                  SO_SNDTIMEO, buf, len, flags);
 }
@@ -439,7 +624,7 @@ int fcntl(int fd, int cmd, ...)
     case F_SETFL: {
         int arg = va_arg(vl, int);
         va_end(vl);
-        sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
+        sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->getFdCtx(fd);
         if (!ctx || ctx->isClosed() || !ctx->isSocket()) {
             // 不存在或者已经关闭或者不是socket
             return fcntl_f(fd, cmd, arg);
@@ -1,38 +1,81 @@
 #include "iomanager.h"
+#include "clock.h"
+#include "config.h"
 #include "log.h"
 #include "macro.h"
+#include "stack_allocator.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <cerrno>
 
 namespace sylar {
 
 static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name)
-{
-    m_epfd = epoll_create(5000);
-    SYLAR_ASSERT(m_epfd > 0)
+// 事件后端: auto / epoll / io_uring，auto在内核支持时使用io_uring
+static ConfigVar<std::string>::ptr g_iomanager_poller =
+    Config::Lookup<std::string>("iomanager.poller", "auto", "iomanager poller(auto/epoll/io_uring)");
+
+// io_uring后端下hook的read/recv/write/send/accept/connect是否直接交给内核完成
+static ConfigVar<bool>::ptr g_iomanager_uring_completion =
+    Config::Lookup<bool>("iomanager.io_uring_completion", true, "use completion based io with io_uring");
 
-    int rt = pipe(m_tickle_fds);
-    SYLAR_ASSERT(rt == 0)
+// fd是否常驻注册在后端里：注册一次读写两个方向，事件触发后不再epoll_ctl修改
+static ConfigVar<bool>::ptr g_iomanager_persistent_events =
+    Config::Lookup<bool>("iomanager.persistent_events", false, "register fds once for both directions");
 
-    epoll_event event{}; // 某个事件的配置
-    memset(&event, 0, sizeof(epoll_event));
-    event.events = EPOLLIN | EPOLLET; // 将事件设为可读和边缘触发
-    event.data.fd = m_tickle_fds[0]; // 把事件句柄与管道的读端连起来
+// 定时器的存储方式: set / wheel(分层时间轮)
+static ConfigVar<std::string>::ptr g_iomanager_timer_engine =
+    Config::Lookup<std::string>("iomanager.timer_engine", "wheel", "iomanager timer engine(set/wheel)");
 
-    rt = fcntl(m_tickle_fds[0], F_SETFL, O_NONBLOCK); // 将读端设成非阻塞
-    SYLAR_ASSERT(rt != -1)
+// 一次从后端最多取多少个事件，实际的批量从64开始，根据上一次取满没有在16到这个值之间调整
+static ConfigVar<int>::ptr g_iomanager_max_events =
+    Config::Lookup<int>("iomanager.max_events", 1024, "iomanager max events per poll");
 
-    // 将m_tickle_fds[0]句柄对应的事件，按照event中的设定，加入到m_epfd中，
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickle_fds[0], &event);
-    SYLAR_ASSERT(rt == 0)
+// 等待事件的线程阻塞之前最多忙等多少微秒，0表示不忙等，用CPU换唤醒延迟
+static ConfigVar<int>::ptr g_iomanager_busy_poll =
+    Config::Lookup<int>("iomanager.busy_poll_us", 0, "iomanager busy poll budget(us) before blocking");
 
-    context_resize(32);
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
+    : Scheduler(threads, use_caller, name),
+      TimerManager(TimerManager::EngineFromName(g_iomanager_timer_engine->getValue()), m_workers.size())
+{
+    m_backend = Poller::Create(g_iomanager_poller->getValue());
+    m_completion = m_backend->supportsCompletion()
+        && g_iomanager_uring_completion->getValue();
+    m_persistent = g_iomanager_persistent_events->getValue();
+    m_max_events = std::max(g_iomanager_max_events->getValue(), MIN_POLL_EVENTS);
+    m_busy_poll_us = (uint64_t) std::max(g_iomanager_busy_poll->getValue(), 0);
+    m_spin_budget_us = m_busy_poll_us;
+    SYLAR_LOG_INFO(g_logger) << "iomanager name=" << name
+                             << " poller=" << m_backend->getName()
+                             << " completion=" << m_completion
+                             << " persistent=" << m_persistent
+                             << " max_events=" << m_max_events
+                             << " busy_poll_us=" << m_busy_poll_us
+                             << " timer_engine=" << (getEngine() == WHEEL ? "wheel" : "set");
+
+    // 用来唤醒阻塞在后端上等待事件的线程
+    m_poller_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    SYLAR_ASSERT(m_poller_wake_fd >= 0)
+
+    // 一直关注可读，data为空表示是唤醒用的fd
+    bool rt = m_backend->update(m_poller_wake_fd, NONE, READ, nullptr);
+    SYLAR_ASSERT(rt)
+
+    // 每个工作线程一个eventfd，空闲时睡在上面，可以被单独唤醒
+    for (auto &worker : m_workers) {
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(worker->wake_fd >= 0)
+    }
+    // 加锁时不能再分配内存
+    m_idle_workers.reserve(m_workers.size());
 
     start();
 }
@@ -40,41 +83,68 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
 IOManager::~IOManager() noexcept
 {
     stop();
-    close(m_epfd);
-    close(m_tickle_fds[0]);
-    close(m_tickle_fds[1]);
-    for (auto i : m_fd_contexts) {
-        // 删除nullptr没有关系
-        delete i;
+    m_backend.reset();
+    close(m_poller_wake_fd);
+    for (auto &worker : m_workers) {
+        close(worker->wake_fd);
+        worker->wake_fd = -1;
+    }
+}
 
+IOManager::FdContext *IOManager::get_context(int fd, bool create)
+{
+    FdContext *fd_ctx = FdMgr::GetInstance()->getSlot(fd, create);
+    if (!fd_ctx && create) {
+        SYLAR_LOG_ERROR(g_logger) << "fd=" << fd << " out of range";
     }
+    return fd_ctx;
 }
 
-void IOManager::context_resize(size_t size)
+bool IOManager::register_locked(FdContext *fd_ctx)
 {
-    m_fd_contexts.resize(size);
-    for (int i = 0; i < m_fd_contexts.size(); ++i) {
-        if (!m_fd_contexts[i]) {
-            m_fd_contexts[i] = new FdContext;
-            m_fd_contexts[i]->fd = i;
-        }
+    if (fd_ctx->m_registered) {
+        return true;
     }
+    if (!m_backend->update(fd_ctx->m_fd, NONE, READ | WRITE, fd_ctx)) {
+        return false;
+    }
+    fd_ctx->m_registered = true;
+    fd_ctx->m_ready = NONE;
+    if (!get_this_worker()) {
+        m_backend->flush();
+    }
+    return true;
 }
 
-int IOManager::add_event(int fd, Event event, std::function<void()> cb)
+bool IOManager::register_fd(int fd)
 {
-    FdContext *fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_fd_contexts.size() > fd) {
-        fd_ctx = m_fd_contexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        while (m_fd_contexts.size() <= fd) {
-            context_resize(m_fd_contexts.size() + m_fd_contexts.size() / 2);
-        }
-        fd_ctx = m_fd_contexts[fd];
+    // 完成式读写不需要就绪事件，用到的时候再注册
+    if (!m_persistent || m_completion) {
+        return true;
+    }
+    FdContext *fd_ctx = get_context(fd, true);
+    if (!fd_ctx) {
+        return false;
+    }
+    FdContext::MutexType::Lock lock(fd_ctx->m_mutex);
+    return register_locked(fd_ctx);
+}
+
+void IOManager::clear_ready(int fd)
+{
+    FdContext *fd_ctx = get_context(fd, false);
+    if (!fd_ctx) {
+        return;
+    }
+    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
+    fd_ctx->m_ready = NONE;
+}
+
+int IOManager::add_event(int fd, Event event, std::function<void()> cb, int thread)
+{
+    FdContext *fd_ctx = get_context(fd, true);
+    if (!fd_ctx) {
+        return -1;
     }
 
     FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
@@ -86,21 +156,20 @@ int IOManager::add_event(int fd, Event event, std::function<void()> cb)
         return -1;
     }
 
-    // 如果该句柄已有事件，则是修改(mod)，否则是添加(add)
-    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    // 定义一个新的事件设置（将新事件或上原有事件集合）
-    epoll_event new_event_setting{};
-    new_event_setting.events = EPOLLET | fd_ctx->m_events | event;
-    new_event_setting.data.ptr = fd_ctx;
-
-    // 将新加的事件添加到m_epfd中
-    int rt = epoll_ctl(m_epfd, op, fd, &new_event_setting);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << op << ", " << fd << ", " << new_event_setting.events
-                                  << "): " << rt << " (" << errno << ") (" << strerror(errno)
-                                  << ") ";
-        return -1;
+    if (m_persistent) {
+        // 常驻注册只在第一次用到时注册一次，之后只改本地的记录
+        if (!register_locked(fd_ctx)) {
+            return -1;
+        }
+    } else {
+        // 将新事件或上原有事件集合，交给后端注册
+        if (!m_backend->update(fd, fd_ctx->m_events, fd_ctx->m_events | event, fd_ctx)) {
+            return -1;
+        }
+        if (!get_this_worker()) {
+            // 不是工作线程的话没人会替它提交，马上提交
+            m_backend->flush();
+        }
     }
 
     ++m_pending_event_count;
@@ -115,6 +184,7 @@ int IOManager::add_event(int fd, Event event, std::function<void()> cb)
 
     // 将调度器设为当前线程的调度器
     event_ctx.scheduler = Scheduler::GetThis();
+    event_ctx.thread = thread;
     if (cb) {
         // 有传入cb就直接给cb
         event_ctx.cb.swap(cb);
@@ -124,21 +194,25 @@ int IOManager::add_event(int fd, Event event, std::function<void()> cb)
         // 确保当前协程正在执行
         SYLAR_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC)
     }
+
+    if (fd_ctx->m_ready & event) {
+        // 登记之前事件已经来过了（边缘触发不会再来），直接触发让调用者重试
+        fd_ctx->m_ready = (Event) (fd_ctx->m_ready & ~event);
+        fd_ctx->triggerEvent(event);
+        --m_pending_event_count;
+    }
     return 0;
 }
 
 bool IOManager::del_event(int fd, Event event)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_fd_contexts.size() <= fd) {
+    FdContext *fd_ctx = get_context(fd, false);
+    if (!fd_ctx) {
         SYLAR_LOG_ERROR(g_logger) << "Event fd=" << fd << " doesn't exist.";
         return false;
     }
-    FdContext *fd_ctx = m_fd_contexts[fd];
 
-    // 解开外面的锁，锁住里面的东西
-    lock.unlock();
-    FdContext::MutexType lock2(fd_ctx->m_mutex);
+    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
     if (!(fd_ctx->m_events & event)) {
         // 如果该fd对应的事件不存在
         SYLAR_LOG_ERROR(g_logger) << "Del_event assert fd=" << fd
@@ -147,17 +221,8 @@ bool IOManager::del_event(int fd, Event event)
         return false;
     }
     auto new_event = (Event) (fd_ctx->m_events & (~event));
-    int op = new_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event new_event_setting{};
-    new_event_setting.events = new_event | EPOLLET;
-    new_event_setting.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &new_event_setting);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << op << ", " << fd << ", " << new_event_setting.events
-                                  << "): " << rt << " (" << errno << ") (" << strerror(errno)
-                                  << ") ";
+    if (!fd_ctx->m_registered
+        && !m_backend->update(fd, fd_ctx->m_events, new_event, fd_ctx)) {
         return false;
     }
 
@@ -171,16 +236,13 @@ bool IOManager::del_event(int fd, Event event)
 
 bool IOManager::cancel_event(int fd, Event event)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_fd_contexts.size() <= fd) {
+    FdContext *fd_ctx = get_context(fd, false);
+    if (!fd_ctx) {
         SYLAR_LOG_ERROR(g_logger) << "Event fd=" << fd << " doesn't exist.";
         return false;
     }
-    FdContext *fd_ctx = m_fd_contexts[fd];
 
-    // 解开外面的锁，锁住里面的东西
-    lock.unlock();
-    FdContext::MutexType lock2(fd_ctx->m_mutex);
+    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
     if (!(fd_ctx->m_events & event)) {
         // 如果该fd对应的事件不存在
         SYLAR_LOG_ERROR(g_logger) << "Del_event assert fd=" << fd
@@ -189,17 +251,8 @@ bool IOManager::cancel_event(int fd, Event event)
         return false;
     }
     auto new_event = (Event) (fd_ctx->m_events & (~event));
-    int op = new_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event new_event_setting{};
-    new_event_setting.events = new_event | EPOLLET;
-    new_event_setting.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &new_event_setting);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << op << ", " << fd << ", " << new_event_setting.events
-                                  << "): " << rt << " (" << errno << ") (" << strerror(errno)
-                                  << ") ";
+    if (!fd_ctx->m_registered
+        && !m_backend->update(fd, fd_ctx->m_events, new_event, fd_ctx)) {
         return false;
     }
 
@@ -213,32 +266,32 @@ bool IOManager::cancel_event(int fd, Event event)
 
 bool IOManager::cancel_all(int fd)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_fd_contexts.size() <= fd) {
-        SYLAR_LOG_ERROR(g_logger) << "Event fd=" << fd << " doesn't exist.";
+    // fd要关闭了，还没完成的完成式请求也都取消掉（它们不会登记在fd上下文里）
+    m_backend->cancel(fd);
+
+    FdContext *fd_ctx = get_context(fd, false);
+    if (!fd_ctx) {
+        SYLAR_LOG_DEBUG(g_logger) << "Event fd=" << fd << " doesn't exist.";
         return false;
     }
-    FdContext *fd_ctx = m_fd_contexts[fd];
 
-    // 解开外面的锁，锁住里面的东西
-    lock.unlock();
-    FdContext::MutexType lock2(fd_ctx->m_mutex);
+    FdContext::MutexType::Lock lock2(fd_ctx->m_mutex);
+    if (fd_ctx->m_registered) {
+        // 常驻注册在fd关闭时删除
+        m_backend->update(fd, READ | WRITE, NONE, fd_ctx);
+        fd_ctx->m_registered = false;
+        fd_ctx->m_ready = NONE;
+    } else if (fd_ctx->m_events
+        && !m_backend->update(fd, fd_ctx->m_events, NONE, fd_ctx)) {
+        return false;
+    }
     if (!fd_ctx->m_events) {
-        // 如果该fd对应的事件不存在
-        SYLAR_LOG_ERROR(g_logger) << "Del_event assert fd=" << fd
+        // 如果该fd对应的事件不存在（关闭没有等待者的fd时很常见）
+        SYLAR_LOG_DEBUG(g_logger) << "Del_event assert fd=" << fd
                                   << " fd_ctx.event=" << fd_ctx->m_events;
         // SYLAR_ASSERT(fd_ctx->m_events & event)
         return false;
     }
-    int op = EPOLL_CTL_DEL;
-    int rt = epoll_ctl(m_epfd, op, fd, nullptr);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << op << ", " << fd << ", " << "nullptr"
-                                  << "): " << rt << " (" << errno << ") (" << strerror(errno)
-                                  << ") ";
-        return false;
-    }
 
     if (fd_ctx->m_events & READ) {
         //FdContext::EventContext &event_ctx = fd_ctx->getContext(READ);
@@ -257,28 +310,118 @@ bool IOManager::cancel_all(int fd)
     return true;
 }
 
+int IOManager::submit_io(IoRequest &req)
+{
+    // 等待请求完成的协程，在协程栈上，请求完成之前协程不会返回
+    struct Waiter {
+        IOManager *iom;
+        Scheduler *scheduler;
+        Fiber::ptr fiber;
+    } waiter{this, Scheduler::GetThis(), Fiber::GetThis()};
+    SYLAR_ASSERT(waiter.fiber->getState() == Fiber::EXEC)
+
+    req.arg = &waiter;
+    req.done = [](IoRequest *r) {
+        auto w = (Waiter *) r->arg;
+        IOManager *iom = w->iom;
+        --iom->m_pending_event_count;
+        // 调度之后协程可能马上在别的线程返回，之后不能再访问waiter
+        w->scheduler->schedule(&w->fiber);
+    };
+
+    ++m_pending_event_count;
+    if (!m_backend->submit(&req)) {
+        --m_pending_event_count;
+        return -EAGAIN;
+    }
+    if (!get_this_worker()) {
+        m_backend->flush();
+    }
+    // 请求会在工作线程空闲时和别的请求一起提交
+    Fiber::Yield_to_Hold();
+    return req.result;
+}
+
 IOManager *IOManager::GetThis()
 {
     // 基类指针转派生类
     return dynamic_cast<IOManager *>(Scheduler::GetThis());
 }
 
+int IOManager::wake_poller_locked()
+{
+    if (m_poller) {
+        if (m_poller_notified) {
+            // 已经通知过了，还没醒
+            return -1;
+        }
+        m_poller_notified = true;
+        return m_poller_wake_fd;
+    }
+    // 没有线程在等待事件，叫醒一个睡着的线程来接替
+    Worker *worker = pop_idle_worker_locked();
+    return worker ? worker->wake_fd : -1;
+}
+
+IOManager::Worker *IOManager::pop_idle_worker_locked()
+{
+    if (m_idle_workers.empty()) {
+        return nullptr;
+    }
+    Worker *worker = m_idle_workers.back();
+    m_idle_workers.pop_back();
+    return worker;
+}
+
+bool IOManager::remove_idle_worker_locked(Worker *worker)
+{
+    for (auto it = m_idle_workers.begin(); it != m_idle_workers.end(); ++it) {
+        if (*it == worker) {
+            m_idle_workers.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
 void IOManager::tickle()
 {
-    if (hasIdleThread()) {
-        // 有空闲线程才处理任务
-        // 发送消息唤醒
-        int rt = write(m_tickle_fds[1], "T", 1);
-        SYLAR_ASSERT(rt == 1)
+    // 只唤醒一个线程：优先叫醒睡着的线程，让等待事件的线程继续等io
+    // 所有线程都在忙的话不用通知，它们忙完会自己来取任务
+    int fd;
+    {
+        Spin_Mutex::Lock lock(m_idle_mutex);
+        Worker *worker = pop_idle_worker_locked();
+        fd = worker ? worker->wake_fd : wake_poller_locked();
+    }
+    if (fd >= 0) {
+        eventfd_write(fd, 1);
+    }
+}
+
+void IOManager::tickle_worker(Worker *worker)
+{
+    int fd = -1;
+    {
+        Spin_Mutex::Lock lock(m_idle_mutex);
+        if (remove_idle_worker_locked(worker)) {
+            fd = worker->wake_fd;
+        } else if (m_poller == worker) {
+            fd = wake_poller_locked();
+        }
+    }
+    if (fd >= 0) {
+        eventfd_write(fd, 1);
     }
 }
 
 bool IOManager::stopping(uint64_t &timeout)
 {
-    timeout = get_next_timeout();
+    // 只算当前线程自己的定时器，停止时要看所有分片
+    timeout = get_next_timeout_us();
     //SYLAR_LOG_DEBUG(g_logger) << "stopping timeout: " << timeout
     //    << "pending_events: " << m_pending_event_count;
-    return timeout == ~0ull
+    return !has_timer()
         && m_pending_event_count == 0
         && Scheduler::stopping();
 }
@@ -291,177 +434,326 @@ bool IOManager::stopping()
 
 void IOManager::idle()
 {
-    // 定义堆数组的原因是协程不适合定义太大的栈数组（协程拥有的栈空间有限）
-    auto events = new epoll_event[64]();
-    // 由于智能指针不能处理数组，需要我们在析构的时候手动删除
-    // 定义该智能指针的目的是方便自动析构
-    std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr) {
-        delete[] ptr;
-    });
+    Worker *worker = get_this_worker();
+    SYLAR_ASSERT(worker)
+    // 放在堆上的原因是协程不适合定义太大的栈数组（协程拥有的栈空间有限）
+    // 一次取多少个事件跟着负载变：上次取满了就加倍，不到四分之一就减半
+    int batch = std::min(64, m_max_events);
+    std::vector<PollEvent> events(batch);
+    std::vector<std::function<void()>> cbs;
 
     while (true) {
+        // 每轮开始刷新一次缓存的时间，这一轮里的定时器和日志都用它
+        Clock::Refresh();
+        // 找出自己分片里已经超时的定时器，触发一遍
+        list_expired_cbs(cbs);
+        if (!cbs.empty()) {
+            // 批量将任务加入调度器
+            SYLAR_LOG_DEBUG(g_logger) << "Schedule timer cbs.";
+            schedule(cbs.begin(), cbs.end());
+            cbs.clear();
+        }
+
         uint64_t next_timeout;
         if (stopping(next_timeout)) {
             // stopping函数里修改了next_timeout的值
             // 说明此时set里没有定时器了
             SYLAR_LOG_INFO(g_logger) << "name=" << Scheduler::getName()
                                      << " idle stopping, exit.";
+            // 其他线程可能还睡着，接力唤醒一个让它也退出
+            tickle();
             break;
         }
 
-        int rt;
-        do {
-            // 从定时器中取出的最近一次需要执行的时间，并且跟最大超时时间比较
-            //next_timeout = get_next_timeout();
-            static const int MAX_TIMEOUT = 5000; // 5000ms
-            if (next_timeout == ~0ull) {
-                next_timeout = MAX_TIMEOUT;
+        // 要等事件了，顺便把突发时缓存下来的协程栈还给内核
+        MmapStackAllocator::Trim();
+
+        // 没人在等待事件就自己去，否则睡在自己的eventfd上
+        bool is_poller = false;
+        {
+            Spin_Mutex::Lock lock(m_idle_mutex);
+            if (!m_poller) {
+                m_poller = worker;
+                m_poller_notified = false;
+                is_poller = true;
             } else {
-                next_timeout = MAX_TIMEOUT > next_timeout ? next_timeout : MAX_TIMEOUT;
+                m_idle_workers.push_back(worker);
             }
-            SYLAR_LOG_DEBUG(g_logger) << "Next_timeout: " << next_timeout;
-
-
-            // 核心函数！
-            rt = epoll_wait(m_epfd, events, 64, (int) next_timeout);
+        }
 
-            if (rt < 0 && errno == EINTR) {
-                // 如果没有事件并且是EINTR,说明是被中断了，则接着循环
-                continue;
+        // 登记完之后再检查一次：登记之前加入的任务和定时器消息不会有人来通知
+        if (has_task(worker) || has_timer_message(worker->index) || stopping()) {
+            Spin_Mutex::Lock lock(m_idle_mutex);
+            if (is_poller) {
+                m_poller = nullptr;
             } else {
-                // 不然跳出循环开始处理所有发出响应的事件
-                break;
+                remove_idle_worker_locked(worker);
+            }
+        } else if (is_poller) {
+            // 攒下来的提交和等待在一起做
+            int rt = poll_once(worker, &events[0], batch, next_timeout);
+            if (rt == batch && batch < m_max_events) {
+                batch = std::min(batch * 2, m_max_events);
+                events.resize(batch);
+            } else if (rt < batch / 4 && batch > MIN_POLL_EVENTS) {
+                batch = std::max(batch / 2, MIN_POLL_EVENTS);
             }
-        } while (true);
+        } else {
+            // 睡下去之前把攒下来的请求提交掉，不然要等到等待事件的线程醒来
+            m_backend->flush();
+            // 自己分片里的定时器到期时要醒来
+            static const uint64_t MAX_PARK_TIMEOUT = 5000000; // 5000ms
+            park(worker, (int64_t) std::min(next_timeout, MAX_PARK_TIMEOUT));
+        }
 
-        //SYLAR_LOG_DEBUG(g_logger) << "Get out of epoll_wait!";
+        if (!has_task(worker) && !stopping()) {
+            // 没有能做的任务，接着等
+            continue;
+        }
 
-        // 找出所有已经超时的定时器，触发一遍
-        std::vector<std::function<void()>> cbs;
-        list_expired_cbs(cbs);
-        if (!cbs.empty()) {
-            // 批量将任务加入调度器
-            SYLAR_LOG_DEBUG(g_logger) << "Schedule timer cbs.";
-            schedule(cbs.begin(), cbs.end());
-            cbs.clear();
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr = cur.get();
+        cur.reset();
+
+        //SYLAR_LOG_DEBUG(g_logger) << "Next i'm gonna swap out!";
+        // 将当前协程切出去
+        raw_ptr->swapOut();
+    }
+
+}
+
+void IOManager::park(Worker *worker, int64_t timeout_us)
+{
+    pollfd pfd{};
+    pfd.fd = worker->wake_fd;
+    pfd.events = POLLIN;
+    // 用ppoll才能精确到微秒
+    timespec ts{};
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = timeout_us % 1000000 * 1000;
+    int rt;
+    do {
+        rt = ::ppoll(&pfd, 1, timeout_us < 0 ? nullptr : &ts, nullptr);
+    } while (rt < 0 && errno == EINTR);
+    {
+        // 超时醒来的话自己从空闲栈里出来
+        Spin_Mutex::Lock lock(m_idle_mutex);
+        remove_idle_worker_locked(worker);
+    }
+    eventfd_t dummy;
+    eventfd_read(worker->wake_fd, &dummy);
+}
+
+int IOManager::busy_poll(Worker *worker, PollEvent *events, int max_events,
+                         uint64_t &next_timeout)
+{
+    // 不能忙等过最近的定时器
+    uint64_t budget = std::min(m_spin_budget_us, next_timeout);
+    uint64_t begin = Clock::NowUs();
+    uint64_t spent = 0;
+    int rt;
+    do {
+        rt = m_backend->wait(events, max_events, 0);
+        if (rt > 0) {
+            break;
         }
+        // 别的线程加了任务或者定时器，tickle写的eventfd也会在下一次wait里出现，这里直接看更快
+        if (has_task(worker) || has_timer_message(worker->index)) {
+            rt = 0;
+            break;
+        }
+        rt = -1;
+        // 和要发请求过来的线程挤在同一个核上时，让它先跑，不然忙等只会推迟事件的到来
+        sched_yield();
+        spent = Clock::NowUs() - begin;
+    } while (spent < budget);
+
+    if (rt < 0 && next_timeout != ~0ull) {
+        next_timeout = next_timeout > spent ? next_timeout - spent : 0;
+    }
+    return rt;
+}
 
-        // 遍历所有待处理的事件句柄
-        SYLAR_LOG_DEBUG(g_logger) << "Epoll wait: rt=" << rt;
-        for (int i = 0; i < rt; ++i) {
-            epoll_event &event = events[i];
+int IOManager::poll_once(Worker *worker, PollEvent *events, int max_events, uint64_t next_timeout)
+{
+    int rt = -1;
+    uint64_t wait_begin = 0;
+    if (m_busy_poll_us) {
+        wait_begin = Clock::NowUs();
+        rt = busy_poll(worker, events, max_events, next_timeout);
+    }
+    // 忙等等到了事件或者新任务就不用阻塞了
+    while (rt < 0) {
+        // 从定时器中取出的最近一次需要执行的时间，并且跟最大超时时间比较
+        static const uint64_t MAX_TIMEOUT = 5000000; // 5000ms
+        if (next_timeout == ~0ull) {
+            next_timeout = MAX_TIMEOUT;
+        } else {
+            next_timeout = MAX_TIMEOUT > next_timeout ? next_timeout : MAX_TIMEOUT;
+        }
+        SYLAR_LOG_DEBUG(g_logger) << "Next_timeout: " << next_timeout;
 
-            //SYLAR_LOG_DEBUG(g_logger) << "Deal with event fd=" << event.data.fd;
 
-            if (event.data.fd == m_tickle_fds[0]) {
-                // 说明该事件是被tickle唤醒的
-                uint8_t dummy;
-                // 可能有多次，当作一次处理，所以得读干净
-                // 并且由于是边沿触发，下次epoll_wait就不会再来一次了
-                while (read(m_tickle_fds[0], &dummy, 1) == 1);
-                continue;
-            }
+        // 核心函数！
+        rt = m_backend->wait(events, max_events, (int64_t) next_timeout);
 
-            auto fd_ctx = (FdContext *) event.data.ptr;
-            SYLAR_LOG_DEBUG(g_logger) << "new fd_ctx->m_events: " << fd_ctx->m_events;
-            FdContext::MutexType::Lock lock(fd_ctx->m_mutex);
-            if (event.events & (EPOLLERR | EPOLLHUP)) {
-                // 如果事件里有错误或者中断
-                SYLAR_LOG_DEBUG(g_logger) << "ERR or HUP";
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
-            }
-            int real_events = NONE;
-            if (event.events & EPOLLIN) {
-                // 有读事件
-                real_events |= READ;
-            }
-            if (event.events & EPOLLOUT) {
-                // 有写事件
-                real_events |= WRITE;
-            }
+        if (rt < 0 && errno == EINTR) {
+            // 如果没有事件并且是EINTR,说明是被中断了，则接着循环
+            continue;
+        } else {
+            // 不然跳出循环开始处理所有发出响应的事件
+            break;
+        }
+    }
 
-            if ((fd_ctx->m_events & real_events) == NONE) {
-                // 说明事件已经被别人处理完了
-                continue;
-            }
+    if (m_busy_poll_us) {
+        // 看这次等了多久才来事情：在预算的上限以内就加倍，说明忙等划算；否则减半
+        // 按上限判断而不是按当前预算，预算降下来以后负载回来了还能涨回去
+        // 不减到0，总留一点忙等
+        uint64_t waited = Clock::NowUs() - wait_begin;
+        if (waited <= m_busy_poll_us) {
+            m_spin_budget_us = std::min(m_busy_poll_us, std::max(m_spin_budget_us * 2, (uint64_t) 1));
+        } else {
+            m_spin_budget_us = std::max(m_busy_poll_us / 16, m_spin_budget_us / 2);
+        }
+    }
+
+    {
+        // 交出poller令牌，之后有需要的话由别的空闲线程接替
+        Spin_Mutex::Lock lock(m_idle_mutex);
+        m_poller = nullptr;
+        m_poller_notified = false;
+    }
+
+    //SYLAR_LOG_DEBUG(g_logger) << "Get out of epoll_wait!";
+
+    // 遍历所有待处理的事件句柄
+    SYLAR_LOG_DEBUG(g_logger) << "Epoll wait: rt=" << rt;
+    TaskList tasks;
+    size_t triggered = 0;
+    for (int i = 0; i < rt; ++i) {
+        PollEvent &event = events[i];
+
+        if (!event.data) {
+            // 说明该事件是被tickle唤醒的
+            // 可能有多次，当作一次处理，所以得读干净
+            eventfd_t dummy;
+            eventfd_read(m_poller_wake_fd, &dummy);
+            continue;
+        }
 
+        auto fd_ctx = (FdContext *) event.data;
+        SYLAR_LOG_DEBUG(g_logger) << "new fd_ctx->m_events: " << fd_ctx->m_events;
+        FdContext::MutexType::Lock lock(fd_ctx->m_mutex);
+        if (event.events & (EPOLLERR | EPOLLHUP)) {
+            // 如果事件里有错误或者中断
+            SYLAR_LOG_DEBUG(g_logger) << "ERR or HUP";
+            event.events |= (EPOLLIN | EPOLLOUT)
+                & (fd_ctx->m_registered ? (READ | WRITE) : fd_ctx->m_events);
+        }
+        int real_events = NONE;
+        if (event.events & EPOLLIN) {
+            // 有读事件
+            real_events |= READ;
+        }
+        if (event.events & EPOLLOUT) {
+            // 有写事件
+            real_events |= WRITE;
+        }
+
+        if (fd_ctx->m_registered) {
+            // 常驻注册不用修改内核里的注册，没人等的方向记下来
+            fd_ctx->m_ready = (Event) (fd_ctx->m_ready | (real_events & ~fd_ctx->m_events));
+            real_events &= fd_ctx->m_events;
+        } else if ((fd_ctx->m_events & real_events) == NONE) {
+            // 说明事件已经被别人处理完了
+            continue;
+        } else {
             // 修改该fd对应的事件设置
             // 剩余事件
             int left_events = (fd_ctx->m_events & (~real_events));
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if (rt2) {
-                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                          << op << ", " << fd_ctx->fd << ", " << event.events
-                                          << "): " << rt << " (" << errno << ") ("
-                                          << strerror(errno) << ") ";
+            if (!m_backend->update(fd_ctx->m_fd, fd_ctx->m_events, left_events, fd_ctx)) {
                 continue;
             }
+        }
 
-            if (real_events & READ) {
-                SYLAR_LOG_DEBUG(g_logger) << "Start to trigger read event..";
-                fd_ctx->triggerEvent(READ);
-                --m_pending_event_count;
-            }
-            if (real_events & WRITE) {
-                SYLAR_LOG_DEBUG(g_logger) << "Start to trigger write event..";
-                fd_ctx->triggerEvent(WRITE);
-                --m_pending_event_count;
-            }
+        if (real_events & READ) {
+            SYLAR_LOG_DEBUG(g_logger) << "Start to trigger read event..";
+            fd_ctx->triggerEvent(READ, this, &tasks);
+            ++triggered;
         }
+        if (real_events & WRITE) {
+            SYLAR_LOG_DEBUG(g_logger) << "Start to trigger write event..";
+            fd_ctx->triggerEvent(WRITE, this, &tasks);
+            ++triggered;
+        }
+    }
 
-        Fiber::ptr cur = Fiber::GetThis();
-        auto raw_ptr = cur.get();
-        cur.reset();
+    // 这一批唤醒的协程和回调一次性加入调度器
+    // 先加入再减计数，不然中间stopping()可能误判为没有事情可做
+    schedule_tasks(tasks);
+    m_pending_event_count -= triggered;
+    return rt;
+}
 
-        //SYLAR_LOG_DEBUG(g_logger) << "Next i'm gonna swap out!";
-        // 将当前协程切出去
-        raw_ptr->swapOut();
-    }
+int IOManager::current_shard()
+{
+    Worker *worker = get_this_worker();
+    return worker ? worker->index : -1;
+}
 
+int IOManager::select_shard()
+{
+    // use_caller时调用者线程要到stop才开始调度，不把定时器放给它
+    size_t first = m_root_thread_id != -1 && m_workers.size() > 1 ? 1 : 0;
+    return (int) (first + TimerManager::select_shard() % (m_workers.size() - first));
 }
 
-void IOManager::on_timer_insert_at_front()
+void IOManager::on_timer_insert_at_front(int shard)
 {
-    // 当新添加的计时器刚好是set里的首个元素时
-    tickle();
+    // 别的线程往分片里加了定时器，负责它的线程睡着的话要叫醒它重新算超时时间
+    tickle_worker(m_workers[shard].get());
 }
 
-IOManager::FdContext::EventContext &
-IOManager::FdContext::getContext(IOManager::Event event)
+FdCtx::EventContext &FdCtx::getContext(uint32_t event)
 {
     switch (event) {
-    case READ:return read;
-    case WRITE:return write;
+    case IOManager::READ:return read;
+    case IOManager::WRITE:return write;
     default:SYLAR_ASSERT2(false, "GetContext error!")
     }
 }
 
-void
-IOManager::FdContext::resetContext(IOManager::FdContext::EventContext &event_ctx)
+void FdCtx::resetContext(FdCtx::EventContext &event_ctx)
 {
     event_ctx.scheduler = nullptr;
     event_ctx.fiber.reset();
     event_ctx.cb = nullptr;
+    event_ctx.thread = -1;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event)
+void FdCtx::triggerEvent(uint32_t event, Scheduler *batch_owner, TaskList *batch)
 {
     // 先确认该事件存在
     SYLAR_LOG_DEBUG(g_logger) << "m_events: " << m_events << " event: " << event;
     SYLAR_ASSERT(m_events & event)
     // 清除该事件
-    m_events = (Event) (m_events & (~event));
+    m_events &= ~event;
     EventContext &event_ctx = getContext(event);
-    if (event_ctx.cb) {
+    if (batch && event_ctx.scheduler == batch_owner) {
+        Task *task = event_ctx.cb ? Task::Create(&event_ctx.cb, event_ctx.thread)
+                                  : Task::Create(&event_ctx.fiber, event_ctx.thread);
+        if (task) {
+            batch->push_back(task);
+        }
+    } else if (event_ctx.cb) {
         // 由于'Fiber_and_Thread'构造函数有指针的指针版本
         // 会调用swap将传入的实参交换为nullptr
-        event_ctx.scheduler->schedule(&event_ctx.cb);
+        event_ctx.scheduler->schedule(&event_ctx.cb, event_ctx.thread);
     } else {
-        event_ctx.scheduler->schedule(&event_ctx.fiber);
+        event_ctx.scheduler->schedule(&event_ctx.fiber, event_ctx.thread);
     }
     event_ctx.scheduler = nullptr;
+    event_ctx.thread = -1;
 }
 }
\ No newline at end of file
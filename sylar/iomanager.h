@@ -7,6 +7,8 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "poller.h"
+#include "fd_manager.h"
 
 namespace sylar {
 class IOManager : public Scheduler, public TimerManager {
@@ -21,28 +23,8 @@ public:
     };
 
 private:
-    struct FdContext {
-        typedef Mutex MutexType;
-        struct EventContext {
-            Scheduler *scheduler = nullptr; // 执行该事件的调度器
-//                std::variant<Fiber::ptr, std::function<void()>>
-//                    fiber_or_cb;
-            Fiber::ptr fiber;
-            std::function<void()> cb;
-        };
-
-        EventContext &getContext(Event event);
-
-        static void resetContext(EventContext &event_ctx);
-
-        void triggerEvent(Event event);
-
-        EventContext read; // 读事件
-        EventContext write; // 写事件
-        int fd; // 事件关联的句柄
-        Event m_events = NONE; // 已经注册的事件
-        MutexType m_mutex;
-    };
+    // fd的记录和hook共用一份，放在FdManger的表里
+    typedef FdCtx FdContext;
 
 public:
     explicit IOManager(size_t threads = 1, bool use_caller = true,
@@ -50,35 +32,85 @@ public:
     ~IOManager() noexcept override;
 
     // 0 success, -1 error
+    // thread不为-1时，事件触发后回调（或者当前协程）指定在该线程执行
     int add_event(int fd, Event event, std::function<void()>
-    cb = nullptr);
+    cb = nullptr, int thread = -1);
     bool del_event(int fd, Event event);
     bool cancel_event(int fd, Event event);
     bool cancel_all(int fd);
 
+    // 常驻注册模式下把fd以边缘触发的方式注册读写两个方向，直到cancel_all(close)才删除
+    // hook的socket/accept创建FdCtx时调用，其他模式下什么都不做
+    bool register_fd(int fd);
+    // 丢掉之前记下的边缘事件，之后的事件才算数（比如connect之前socket未连接时的HUP）
+    void clear_ready(int fd);
+
+    // 后端支持的话，读写直接交给内核完成，协程挂起直到完成（或者超时）
+    // 返回系统调用的结果，出错时为-errno
+    int submit_io(IoRequest &req);
+    bool supports_completion() const { return m_completion; }
+    const char *getPollerName() const { return m_backend->getName(); }
+
 public:
     static IOManager *GetThis();
 
 protected:
-    void context_resize(size_t size);
+    // 取fd对应的上下文，不加锁
+    // fd所在的块还没分配时，create为true则分配，否则返回nullptr
+    // 同一时间一个fd只能在一个IOManager里等待事件
+    FdContext *get_context(int fd, bool create);
+    // 持有fd_ctx->m_mutex时调用
+    bool register_locked(FdContext *fd_ctx);
 
     bool stopping(uint64_t &timeout);
 
+    // 唤醒一个睡着的工作线程，没有的话唤醒正在等待事件的线程
     void tickle() override;
+    void tickle_worker(Worker *worker) override;
     bool stopping() override;
     void idle() override;
 
-    void on_timer_insert_at_front() override;
+    // 定时器按工作线程分片，分片下标就是工作线程在m_workers里的下标
+    int current_shard() override;
+    int select_shard() override;
+    void on_timer_insert_at_front(int shard) override;
 
     //bool has_timer();
 
 private:
-    int m_epfd = 0; // epoll实例的fd
-    int m_tickle_fds[2];
+    // 空闲时只有一个线程（拿到poller令牌的）阻塞在后端的wait上，
+    // 其他空闲线程睡在各自的eventfd上，等着被单独唤醒
+    // 以下函数都要在持有m_idle_mutex时调用
+    // 返回需要写的fd，没有需要唤醒的线程时返回-1
+    int wake_poller_locked();
+    Worker *pop_idle_worker_locked();
+    bool remove_idle_worker_locked(Worker *worker);
+
+    // 空闲的工作线程等待被唤醒，返回时已经不在空闲栈里
+    void park(Worker *worker, int64_t timeout_us);
+    // 阻塞之前不带超时地反复查后端，同时看有没有新任务和定时器消息，最多忙等m_spin_budget_us
+    // 返回就绪的事件数，0表示有了新任务，-1表示预算用完了（next_timeout减去已经等的时间）
+    int busy_poll(Worker *worker, PollEvent *events, int max_events, uint64_t &next_timeout);
+    // 等待一次后端的事件并处理就绪的事件，唤醒的等待者一次性加入调度器
+    // 返回从后端取到的事件数
+    int poll_once(Worker *worker, PollEvent *events, int max_events, uint64_t timeout_us);
+
+private:
+    Poller::ptr m_backend; // epoll或者io_uring，由配置项iomanager.poller选择
+    bool m_completion = false; // 是否使用完成式的读写
+    bool m_persistent = false; // fd是否常驻注册在后端里，由配置项iomanager.persistent_events选择
+    static constexpr int MIN_POLL_EVENTS = 16;
+    int m_max_events = 64; // 一次最多取多少个事件，由配置项iomanager.max_events选择
+    uint64_t m_busy_poll_us = 0; // 忙等预算的上限，由配置项iomanager.busy_poll_us选择，0表示不忙等
+    uint64_t m_spin_budget_us = 0; // 当前的忙等预算，只有拿着poller令牌的线程读写
+    int m_poller_wake_fd = -1; // 注册在后端里的eventfd，用来唤醒等待事件的线程
+
+    Spin_Mutex m_idle_mutex;
+    std::vector<Worker *> m_idle_workers; // 睡在自己eventfd上的空闲线程，后进先出
+    Worker *m_poller = nullptr; // 正在后端上等待事件的线程
+    bool m_poller_notified = false; // 已经写过m_poller_wake_fd，还没被读走
 
     std::atomic<size_t> m_pending_event_count{0};
-    RWMutexType m_mutex;
-    std::vector<FdContext *> m_fd_contexts;
 
 };
 }
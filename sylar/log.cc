@@ -5,7 +5,15 @@
 #include <set>
 #include <cstdarg>
 #include <utility>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "log.h"
+#include "async_log.h"
 #include "config.h"
 
 namespace sylar {
@@ -21,6 +29,87 @@ void Filter(LogLevel::Level level)
     G_Level() = level;
 }
 
+// 当前线程是否在批量输出日志
+static thread_local bool t_log_batch = false;
+
+LogBatchScope::LogBatchScope()
+    : m_prev(t_log_batch)
+{
+    t_log_batch = true;
+}
+
+LogBatchScope::~LogBatchScope()
+{
+    t_log_batch = m_prev;
+}
+
+LogStreamBuf::LogStreamBuf()
+{
+    setp(m_inline, m_inline + INLINE_SIZE);
+}
+
+void LogStreamBuf::clear()
+{
+    if (m_heap.size() > MAX_KEEP_SIZE) {
+        // 偶尔一条很长的日志，用完就还回去，不让它一直跟着缓存的事件
+        std::string().swap(m_heap);
+        setp(m_inline, m_inline + INLINE_SIZE);
+        return;
+    }
+    setp(pbase(), epptr());
+}
+
+void LogStreamBuf::reserve(size_t n)
+{
+    size_t used = size();
+    size_t capacity = epptr() - pbase();
+    if (capacity - used >= n) {
+        return;
+    }
+    size_t new_capacity = std::max(capacity * 2, used + n);
+    if (pbase() == m_inline) {
+        m_heap.assign(m_inline, used);
+    }
+    m_heap.resize(new_capacity);
+    setp(&m_heap[0], &m_heap[0] + new_capacity);
+    pbump((int) used);
+}
+
+LogStreamBuf::int_type LogStreamBuf::overflow(int_type c)
+{
+    if (c != traits_type::eof()) {
+        reserve(1);
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize LogStreamBuf::xsputn(const char *s, std::streamsize n)
+{
+    reserve(n);
+    memcpy(pptr(), s, n);
+    pbump((int) n);
+    return n;
+}
+
+void LogStreamBuf::appendf(const char *fmt, va_list al)
+{
+    va_list copy;
+    va_copy(copy, al);
+    size_t left = epptr() - pptr();
+    int len = vsnprintf(pptr(), left, fmt, al);
+    if (len >= 0 && (size_t) len >= left) {
+        // 放不下，扩容之后再来一次
+        reserve(len + 1);
+        len = vsnprintf(pptr(), len + 1, fmt, copy);
+    }
+    va_end(copy);
+    if (len > 0) {
+        pbump(len);
+    }
+}
+
 LogEvent::LogEvent(std::shared_ptr<Logger> logger,
                    LogLevel::Level level,
                    const char *file,
@@ -30,187 +119,137 @@ LogEvent::LogEvent(std::shared_ptr<Logger> logger,
                    std::string threadName,
                    uint32_t fiberId,
                    uint64_t time)
-    : m_file(file), m_line(line), m_elapse(elapse), m_threadId(threadId), m_threadName(std::move(threadName)),
-      m_fiberId(fiberId), m_time(time), m_logger(std::move(logger)), m_level(level)
+    : m_file(file), m_line(line), m_elapse(elapse), m_threadId(threadId), m_threadNameStore(std::move(threadName)),
+      m_fiberId(fiberId), m_time(time), m_ss(&m_buf), m_logger(std::move(logger)), m_level(level)
 //, m_ss(ss)
 {
     //std::cout << m_time << std::endl;
 }
 
-// 传入可变参数（类似于printf）
-void LogEvent::format(const char *fmt, ...)
+void LogEvent::reset(const std::shared_ptr<Logger> &logger,
+                     LogLevel::Level level,
+                     const char *file,
+                     int32_t line,
+                     uint32_t threadId,
+                     const std::string &threadName,
+                     uint32_t fiberId,
+                     uint64_t time)
 {
-    va_list al;
-    va_start(al, fmt); // 逐个获取可变参数
-    format(fmt, al);
-    va_end(al);
+    m_file = file;
+    m_line = line;
+    m_threadId = threadId;
+    m_threadName = &threadName;
+    m_fiberId = fiberId;
+    m_time = time;
+    m_logger = logger;
+    m_level = level;
+    m_buf.clear();
+    m_ss.clear();
 }
 
-void LogEvent::format(const char *fmt, va_list al)
+void LogEvent::detach()
 {
-    char *buf = nullptr;
-    // 将al格式化输入到buf缓冲区
-    int len = vasprintf(&buf, fmt, al);
-    if (len != -1) {
-        // 再将buf输入到m_ss
-        m_ss << std::string(buf, len);
-        free(buf);
+    if (m_threadName != &m_threadNameStore) {
+        m_threadNameStore = *m_threadName;
+        m_threadName = &m_threadNameStore;
     }
 }
 
-LogEventWrap::LogEventWrap(LogEvent::ptr e)
-    : m_event(e) {}
-
-LogEventWrap::~LogEventWrap()
+// 传入可变参数（类似于printf）
+void LogEvent::format(const char *fmt, ...)
 {
-    m_event->getLogger()->log(m_event->getLevel(), m_event);
+    va_list al;
+    va_start(al, fmt); // 逐个获取可变参数
+    format(fmt, al);
+    va_end(al);
 }
 
-std::stringstream &LogEventWrap::getSS()
+void LogEvent::format(const char *fmt, va_list al)
 {
-    return m_event->getSS();
+    // 直接格式化到m_buf里
+    m_buf.appendf(fmt, al);
 }
 
-class MessageFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit MessageFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getContent();
-        //os << m_message;
-    }
-};
-
-class NormalStringFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit NormalStringFormatItem(const std::string &str = "")
-        : m_string(str) {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        //os << event->getContent();
-        os << m_string;
-    }
-private:
-    std::string m_string;
-};
-
-class LevelFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit LevelFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << LogLevel::toString(level);
-    }
-};
-
-class FilenameFormatItem : public LogFormatter::FormatItem {
+// 每个线程缓存的日志事件
+// 一个事件只剩缓存自己引用的时候（同步输出完了，或者异步的后台线程输出完了）就可以拿来给下一条日志用
+// 异步模式下后台线程按顺序输出，所以按顺序轮流检查，一般第一个就能用
+class LogEventCache {
 public:
-    explicit FilenameFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getFile();
-    }
-};
+    LogEventCache() { s_state = ALIVE; }
+    ~LogEventCache() { s_state = DESTROYED; }
 
-// 日志名称
-class NameFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit NameFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getLogger()->getName();
-    }
-};
+    // 线程退出时别的thread_local对象析构的时候也可能打日志，缓存已经析构了就直接分配
+    static LogEvent::ptr Get();
 
-// 回车换行
-class NewLineFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit NewLineFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
+    LogEvent::ptr get()
     {
-        os << std::endl;
+        // 从上次的位置往后找，跳过还被别人拿着的（比如用户自己留着的事件），最多看SCAN_EVENTS个
+        size_t scan = m_events.size() < SCAN_EVENTS ? m_events.size() : SCAN_EVENTS;
+        for (size_t i = 0; i < scan; ++i) {
+            size_t idx = (m_next + i) % m_events.size();
+            LogEvent::ptr &event = m_events[idx];
+            if (event.use_count() == 1) {
+                // 和其他线程释放引用时的release配对，保证它已经不再读这个事件了
+                std::atomic_thread_fence(std::memory_order_acquire);
+                m_next = (idx + 1) % m_events.size();
+                return event;
+            }
+        }
+        // 都在用（异步模式下还在队列里，或者打日志的过程中又打了日志）
+        if (m_events.size() < MAX_EVENTS) {
+            m_events.emplace_back(new LogEvent);
+            return m_events.back();
+        }
+        return LogEvent::ptr(new LogEvent);
     }
-};
 
-// 该条日志的行号
-class LineFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit LineFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getLine();
-    }
+private:
+    enum State {
+        INIT = 0,
+        ALIVE = 1,
+        DESTROYED = 2,
+    };
+    static const size_t MAX_EVENTS = 1024;
+    static const size_t SCAN_EVENTS = 16;
+    static thread_local State s_state;
+    std::vector<LogEvent::ptr> m_events;
+    size_t m_next = 0;
 };
 
-class ElapseFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit ElapseFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getElapse();
-    }
-};
+thread_local LogEventCache::State LogEventCache::s_state = LogEventCache::INIT;
+static thread_local LogEventCache t_event_cache;
 
-class ThreadIdFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit ThreadIdFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getThreadId();
+LogEvent::ptr LogEventCache::Get()
+{
+    if (s_state == DESTROYED) {
+        return LogEvent::ptr(new LogEvent);
     }
-};
+    return t_event_cache.get();
+}
 
-class ThreadNameFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit ThreadNameFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getThreadName();
-    }
-};
+LogEventWrap::LogEventWrap(LogEvent::ptr e)
+    : m_event(e) {}
 
-class FiberIdFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit FiberIdFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << event->getFiberId();
-    }
-};
+LogEventWrap::LogEventWrap(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line)
+    : m_event(LogEventCache::Get())
+{
+    m_event->reset(logger, level, file, line, GetThreadId(), Thread::GetName(),
+                   GetFiberId(), Clock::CachedTime());
+}
 
-class TabFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit TabFormatItem(const std::string &str = "") {}
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        os << "\t";
+LogEventWrap::~LogEventWrap()
+{
+    if (AsyncLogger::IsEnabled()) {
+        AsyncLogMgr::GetInstance()->push(std::move(m_event));
+        return;
     }
-};
+    m_event->getLogger()->log(m_event->getLevel(), m_event);
+}
 
-class DateTimeFormatItem : public LogFormatter::FormatItem {
-public:
-    explicit DateTimeFormatItem(const std::string &format = "%Y-%m-%d %H:%M:%S")
-        : m_format(format)
-    {
-        if (m_format.empty()) {
-            m_format = "%Y-%m-%d %H:%M:%S";
-        }
-    }
-    void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override
-    {
-        struct tm tm{};
-        time_t time = event->getTime();
-        //tm = localtime(&time);
-        localtime_r(&time, &tm);
-        char buf[64];
-        //std::cout << m_format << std::endl;
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
-        //std::cout << "hhhh\n";
-    }
-private:
-    std::string m_format;
-};
+std::ostream &LogEventWrap::getSS()
+{
+    return m_event->getSS();
+}
 
 const char *LogLevel::toString(LogLevel::Level level)
 {
@@ -301,6 +340,18 @@ void Logger::clearAppenders()
     m_appenders.clear();
 }
 
+void Logger::flush()
+{
+    Mutex::Lock lock(m_mutex);
+    if (!m_appenders.empty()) {
+        for (auto &i : m_appenders) {
+            i->flush();
+        }
+    } else if (m_root) {
+        m_root->flush();
+    }
+}
+
 void Logger::setFormatter(LogFormatter::ptr val)
 {
     Mutex::Lock lock(m_mutex);
@@ -387,7 +438,7 @@ void Logger::fatal(LogEvent::ptr event)
     log(LogLevel::FATAL, std::move(event));
 }
 
-void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+void StdoutLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event)
 {
     if (level >= m_level && level >= G_Level()) {
         Mutex::Lock lock(m_mutex);
@@ -396,6 +447,12 @@ void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level leve
     }
 }
 
+void StdoutLogAppender::flush()
+{
+    Mutex::Lock lock(m_mutex);
+    std::cout.flush();
+}
+
 std::string StdoutLogAppender::toYamlString()
 {
     Mutex::Lock lock(m_mutex);
@@ -410,16 +467,64 @@ std::string StdoutLogAppender::toYamlString()
     return ss.str();
 }
 
-FileLogAppender::FileLogAppender(const std::string &filename)
-    : m_filename(filename) {}
+// 文件appender的缓冲区大小，写满了就写到文件里
+static ConfigVar<uint32_t>::ptr g_log_file_buffer_size =
+    Config::Lookup<uint32_t>("log.file_buffer_size", 256 * 1024, "user space buffer size of a file log appender");
+
+FileLogAppender::Rotate FileLogAppender::RotateFromString(const std::string &str)
+{
+    if (str == "hourly") {
+        return HOURLY;
+    }
+    if (str == "daily") {
+        return DAILY;
+    }
+    return NONE;
+}
+
+const char *FileLogAppender::RotateToString(FileLogAppender::Rotate rotate)
+{
+    switch (rotate) {
+    case HOURLY:return "hourly";
+    case DAILY:return "daily";
+    default:return "none";
+    }
+}
+
+FileLogAppender::FileLogAppender(const std::string &filename, uint64_t max_size, Rotate rotate)
+    : m_filename(filename), m_max_size(max_size), m_rotate(rotate), m_buf(this), m_stream(&m_buf)
+{
+    size_t blocks = std::max<size_t>(g_log_file_buffer_size->getValue() / BLOCK_SIZE, 1);
+    m_blocks.resize(blocks);
+    m_iov.resize(blocks);
+    m_blocks[0].reserve(BLOCK_SIZE);
+    Mutex::Lock lock(m_mutex);
+    open_file();
+    m_next_rotate = next_rotate_time(time(nullptr));
+}
+
+FileLogAppender::~FileLogAppender()
+{
+    Mutex::Lock lock(m_mutex);
+    write_out();
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
 
 std::string FileLogAppender::toYamlString()
 {
     Mutex::Lock lock(m_mutex);
     YAML::Node node;
-    node["type"] = "StdoutLogAppender";
+    node["type"] = "FileLogAppender";
     node["file"] = m_filename;
     node["level"] = LogLevel::toString(m_level);
+    if (m_max_size) {
+        node["max_size"] = m_max_size;
+    }
+    if (m_rotate != NONE) {
+        node["rotate"] = RotateToString(m_rotate);
+    }
     if (m_formatter) {
         node["formatter"] = m_formatter->getPattern();
     }
@@ -427,26 +532,203 @@ std::string FileLogAppender::toYamlString()
     ss << node;
     return ss.str();
 }
-void FileLogAppender::reopen()
+
+void FileLogAppender::flush()
+{
+    Mutex::Lock lock(m_mutex);
+    write_out();
+}
+
+bool FileLogAppender::reopen()
 {
     Mutex::Lock lock(m_mutex);
-    if (m_filestream) {
+    write_out();
+    if (m_fd >= 0) {
         // 打开了的话就先关闭掉
-        m_filestream.close();
+        ::close(m_fd);
+        m_fd = -1;
     }
-    m_filestream.open(m_filename);
-    //printf("I can open\n");
+    return open_file();
 }
 
-void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+void FileLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event)
 {
     if (level >= m_level && level >= G_Level()) {
-        // 每次log一条日志就reopen一次，防止文件中途被删掉
-        reopen();
         Mutex::Lock lock(m_mutex);
-        m_formatter->format(m_filestream, logger, level, event);
-        //m_filestream.close();
+        check_file(event->getTime());
+        m_formatter->format(m_stream, logger, level, event);
+        if (level >= LogLevel::ERROR) {
+            // 出错之后进程可能很快就挂了，不能留在缓冲区里
+            write_out();
+        }
+    }
+}
+
+bool FileLogAppender::open_file()
+{
+    // 追加模式，多个appender（或者多个进程）写同一个文件也不会互相覆盖
+    m_fd = ::open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        std::cout << "FileLogAppender open " << m_filename << " failed, errno=" << errno
+                  << " (" << strerror(errno) << ")" << std::endl;
+        return false;
     }
+    struct stat st{};
+    fstat(m_fd, &st);
+    m_dev = st.st_dev;
+    m_ino = st.st_ino;
+    m_file_size = st.st_size;
+    return true;
+}
+
+void FileLogAppender::check_file(time_t now)
+{
+    if (m_next_rotate && now >= m_next_rotate) {
+        rotate(now);
+    } else if (m_max_size && m_file_size + m_buffered >= m_max_size) {
+        rotate(now);
+    }
+    if (now < m_next_check) {
+        return;
+    }
+    // 每秒写出去一次，再看看文件还在不在，被删掉或者改名了就重新打开
+    m_next_check = now + 1;
+    write_out();
+    struct stat st{};
+    if (m_fd < 0 || stat(m_filename.c_str(), &st) || st.st_ino != m_ino || st.st_dev != m_dev) {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        open_file();
+    }
+}
+
+void FileLogAppender::rotate(time_t now)
+{
+    write_out();
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    struct tm tm{};
+    localtime_r(&now, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), ".%Y%m%d-%H%M%S", &tm);
+    std::string name = m_filename + buf;
+    // 同一秒里按大小切了好几次
+    for (int i = 1; access(name.c_str(), F_OK) == 0; ++i) {
+        name = m_filename + buf + "." + std::to_string(i);
+    }
+    if (rename(m_filename.c_str(), name.c_str())) {
+        std::cout << "FileLogAppender rotate " << m_filename << " to " << name << " failed, errno=" << errno
+                  << " (" << strerror(errno) << ")" << std::endl;
+    }
+    open_file();
+    m_next_rotate = next_rotate_time(now);
+}
+
+time_t FileLogAppender::next_rotate_time(time_t now) const
+{
+    if (m_rotate == NONE) {
+        return 0;
+    }
+    struct tm tm{};
+    localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    if (m_rotate == HOURLY) {
+        tm.tm_hour += 1;
+    } else {
+        tm.tm_hour = 0;
+        tm.tm_mday += 1;
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+void FileLogAppender::append(const char *s, size_t n)
+{
+    while (true) {
+        std::string &block = m_blocks[m_current];
+        // 一行比一块还长的话整行放在一个空块里
+        if (block.size() + n <= BLOCK_SIZE || block.empty()) {
+            block.append(s, n);
+            m_buffered += n;
+            return;
+        }
+        if (m_current + 1 == m_blocks.size()) {
+            // 缓冲区满了
+            write_out();
+            continue;
+        }
+        m_blocks[++m_current].reserve(BLOCK_SIZE);
+    }
+}
+
+void FileLogAppender::write_out()
+{
+    if (!m_buffered) {
+        return;
+    }
+    if (m_fd >= 0) {
+        for (size_t i = 0; i <= m_current; ++i) {
+            m_iov[i].iov_base = &m_blocks[i][0];
+            m_iov[i].iov_len = m_blocks[i].size();
+        }
+        struct iovec *begin = &m_iov[0];
+        int count = (int) m_current + 1;
+        while (count > 0) {
+            // 缓冲区配得很大时块数可能超过IOV_MAX，分几次写
+            ssize_t n = ::writev(m_fd, begin, std::min(count, IOV_MAX));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // 写不进去（比如磁盘满了）就丢掉这一批，不能让缓冲区无限增长
+                std::cout << "FileLogAppender write " << m_filename << " failed, errno=" << errno
+                          << " (" << strerror(errno) << ")" << std::endl;
+                break;
+            }
+            m_file_size += n;
+            // 跳过已经写完的部分
+            while (count > 0 && (size_t) n >= begin->iov_len) {
+                n -= begin->iov_len;
+                ++begin;
+                --count;
+            }
+            if (count > 0) {
+                begin->iov_base = (char *) begin->iov_base + n;
+                begin->iov_len -= n;
+            }
+        }
+    }
+    for (size_t i = 0; i <= m_current; ++i) {
+        m_blocks[i].clear();
+    }
+    m_current = 0;
+    m_buffered = 0;
+}
+
+FileLogAppender::FileBuf::int_type FileLogAppender::FileBuf::overflow(int_type c)
+{
+    if (c != traits_type::eof()) {
+        char ch = traits_type::to_char_type(c);
+        m_appender->append(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize FileLogAppender::FileBuf::xsputn(const char *s, std::streamsize n)
+{
+    m_appender->append(s, n);
+    return n;
+}
+
+int FileLogAppender::FileBuf::sync()
+{
+    // 每行都写一次系统调用太多，由FileLogAppender决定什么时候写
+    return 0;
 }
 
 LogFormatter::LogFormatter(const std::string &pattern)
@@ -455,30 +737,174 @@ LogFormatter::LogFormatter(const std::string &pattern)
     init();
 }
 
-std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+// 每个线程缓存最近格式化过的日期，同一秒内的日志直接复用
+// 按日期格式区分，一般整个进程只有一两种格式
+struct DateCache {
+    static const size_t ENTRIES = 4;
+    struct Entry {
+        std::string format;
+        time_t time = -1;
+        char buf[64];
+        size_t len = 0;
+    };
+
+    // 取time按format格式化之后的日期
+    const Entry &get(const char *format, size_t format_len, time_t time)
+    {
+        for (size_t i = 0; i < used; ++i) {
+            Entry &e = entries[i];
+            if (e.format.size() == format_len && memcmp(e.format.data(), format, format_len) == 0) {
+                if (e.time != time) {
+                    fill(e, time);
+                }
+                return e;
+            }
+        }
+        // 没有这个格式，占一个位置（满了就轮流替换）
+        Entry &e = entries[used < ENTRIES ? used++ : (next++ % ENTRIES)];
+        e.format.assign(format, format_len);
+        fill(e, time);
+        return e;
+    }
+
+    static void fill(Entry &e, time_t time)
+    {
+        struct tm tm{};
+        localtime_r(&time, &tm);
+        e.len = strftime(e.buf, sizeof(e.buf), e.format.c_str(), &tm);
+        e.time = time;
+    }
+
+    Entry entries[ENTRIES];
+    size_t used = 0;
+    size_t next = 0;
+};
+
+static thread_local DateCache t_date_cache;
+// 拼一行日志用的缓冲区
+static thread_local std::string t_line;
+
+static void append_uint(std::string &line, uint64_t v)
 {
-    std::basic_stringstream<char> ss;
-    //std:stringstream ss;
-    for (auto &i : m_items) {
+    char buf[20];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    line.append(p, buf + sizeof(buf) - p);
+}
+
+static const char s_default_date_format[] = "%Y-%m-%d %H:%M:%S";
 
-        i->format(ss, logger, level, event);
+bool LogFormatter::render(std::string &line, LogLevel::Level level, const LogEvent &event) const
+{
+    if (m_simple) {
+        // %d%T%m%n
+        const Op &op = m_ops[0];
+        const DateCache::Entry &date = t_date_cache.get(m_text.data() + op.offset, op.len, event.getTime());
+        line.append(date.buf, date.len);
+        line.push_back('\t');
+        line.append(event.getContentData(), event.getContentSize());
+        line.push_back('\n');
+        return true;
     }
-    return ss.str();
+    bool newline = false;
+    for (const Op &op : m_ops) {
+        newline = false;
+        switch (op.type) {
+        case TEXT:
+            line.append(m_text, op.offset, op.len);
+            break;
+        case MESSAGE:
+            line.append(event.getContentData(), event.getContentSize());
+            break;
+        case LEVEL:
+            line.append(LogLevel::toString(level));
+            break;
+        case ELAPSE:
+            append_uint(line, event.getElapse());
+            break;
+        case NAME:
+            line.append(event.getLogger()->getName());
+            break;
+        case THREAD_ID:
+            append_uint(line, event.getThreadId());
+            break;
+        case NEWLINE:
+            line.push_back('\n');
+            newline = true;
+            break;
+        case FIBER_ID:
+            append_uint(line, event.getFiberId());
+            break;
+        case TAB:
+            line.push_back('\t');
+            break;
+        case DATETIME: {
+            const DateCache::Entry &date = t_date_cache.get(m_text.data() + op.offset, op.len, event.getTime());
+            line.append(date.buf, date.len);
+            break;
+        }
+        case FILENAME:
+            line.append(event.getFile());
+            break;
+        case LINE:
+            if (event.getLine() < 0) {
+                line.push_back('-');
+                append_uint(line, -(int64_t) event.getLine());
+            } else {
+                append_uint(line, event.getLine());
+            }
+            break;
+        case THREAD_NAME:
+            line.append(event.getThreadName());
+            break;
+        default:
+            break;
+        }
+    }
+    return newline;
+}
+
+std::string LogFormatter::format(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event)
+{
+    std::string line;
+    render(line, level, *event);
+    return line;
 }
 
 // 重载
 std::ostream &LogFormatter::format(std::ostream &ofs,
-                                   std::shared_ptr<Logger> logger,
+                                   const std::shared_ptr<Logger> &logger,
                                    LogLevel::Level level,
-                                   LogEvent::ptr event)
+                                   const LogEvent::ptr &event)
 {
-    for (auto &i : m_items) {
-        //std::cout << event->getTime() << std::endl;
-        i->format(ofs, logger, level, event);
+    std::string &line = t_line;
+    line.clear();
+    bool newline = render(line, level, *event);
+    ofs.write(line.data(), line.size());
+    if (newline && !t_log_batch) {
+        // 和原来的std::endl一样，每行flush一次（文件appender自己决定什么时候写）；批量输出时由调用者最后统一flush
+        ofs.flush();
     }
     return ofs;
 }
 
+void LogFormatter::add_op(OpType type, const std::string &text)
+{
+    Op op{(uint8_t) type, (uint32_t) m_text.size(), (uint32_t) text.size()};
+    if (type == TEXT && !m_ops.empty() && m_ops.back().type == TEXT
+        && m_ops.back().offset + m_ops.back().len == m_text.size()) {
+        // 和前面的文本合并
+        m_ops.back().len += text.size();
+        m_text.append(text);
+        return;
+    }
+    m_text.append(text);
+    m_ops.push_back(op);
+}
+
 // 共有三种情况：
 // 1) %xxx  2) %xxx{xxx}  3) %%
 void LogFormatter::init()
@@ -557,22 +983,22 @@ void LogFormatter::init()
         vec.emplace_back(nstr, "", 0);
         nstr.clear();
     }
-    static std::map<std::string, std::function<FormatItem::ptr(const std::string &)>> s_format_items = {
-#define XX(str, C) \
-        {#str, [](const std::string& fmt) { return FormatItem::ptr(new C(fmt)); }}
-
-        XX(m, MessageFormatItem),
-        XX(p, LevelFormatItem),
-        XX(r, ElapseFormatItem),
-        XX(c, NameFormatItem),
-        XX(t, ThreadIdFormatItem),
-        XX(n, NewLineFormatItem),
-        XX(F, FiberIdFormatItem),
-        XX(T, TabFormatItem),
-        XX(d, DateTimeFormatItem),
-        XX(f, FilenameFormatItem),
-        XX(l, LineFormatItem),
-        XX(N, ThreadNameFormatItem),
+    static std::map<std::string, OpType> s_ops = {
+#define XX(str, type) \
+        {#str, type}
+
+        XX(m, MESSAGE),
+        XX(p, LEVEL),
+        XX(r, ELAPSE),
+        XX(c, NAME),
+        XX(t, THREAD_ID),
+        XX(n, NEWLINE),
+        XX(F, FIBER_ID),
+        XX(T, TAB),
+        XX(d, DATETIME),
+        XX(f, FILENAME),
+        XX(l, LINE),
+        XX(N, THREAD_NAME),
 
 #undef XX
     };
@@ -585,22 +1011,31 @@ void LogFormatter::init()
     // %d -- 时间
     // %f -- 文件名
     // %l -- 行号
+    m_ops.clear();
+    m_text.clear();
     for (auto &i : vec) {
         if (std::get<2>(i) == 0) {
             // 说明是正常文本
-            m_items.push_back(FormatItem::ptr(new NormalStringFormatItem(std::get<0>(i))));
+            add_op(TEXT, std::get<0>(i));
         } else {
-            auto it = s_format_items.find(std::get<0>(i)); // 查找对应的fmt是否存在
-            if (it == s_format_items.end()) {
-                m_items.push_back(FormatItem::ptr(new MessageFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
+            auto it = s_ops.find(std::get<0>(i)); // 查找对应的fmt是否存在
+            if (it == s_ops.end()) {
+                add_op(TEXT, "<<error_format %" + std::get<0>(i) + ">>");
                 m_isError = true;
+            } else if (it->second == DATETIME) {
+                add_op(DATETIME, std::get<1>(i).empty() ? s_default_date_format : std::get<1>(i));
             } else {
-                m_items.push_back(it->second(std::get<1>(i)));
+                add_op(it->second);
             }
         }
 
         //std::cout << std::get<0>(i) << " - " << std::get<1>(i) << " - " << std::get<2>(i) << std::endl;
     }
+    m_simple = m_ops.size() == 4
+        && m_ops[0].type == DATETIME
+        && m_ops[1].type == TAB
+        && m_ops[2].type == MESSAGE
+        && m_ops[3].type == NEWLINE;
 }
 
 LoggerManager::LoggerManager()
@@ -641,13 +1076,17 @@ struct LogAppenderDefine {
     LogLevel::Level level = LogLevel::UNKNOWN;
     std::string formatter;
     std::string file;
+    uint64_t max_size = 0; // 文件超过多大就切分，0表示不切
+    std::string rotate; // 按时间切分：hourly / daily
 
     bool operator==(const LogAppenderDefine &oth) const
     {
         return type == oth.type
             && level == oth.level
             && formatter == oth.formatter
-            && file == oth.file;
+            && file == oth.file
+            && max_size == oth.max_size
+            && rotate == oth.rotate;
     }
 };
 // 添加logger时需要提供的定义信息
@@ -705,6 +1144,12 @@ public:
                             continue;
                         }
                         lad.file = a["file"].as<std::string>();
+                        if (a["max_size"].IsDefined()) {
+                            lad.max_size = a["max_size"].as<uint64_t>();
+                        }
+                        if (a["rotate"].IsDefined()) {
+                            lad.rotate = a["rotate"].as<std::string>();
+                        }
                         if (a["formatter"].IsDefined()) {
                             lad.formatter = a["formatter"].as<std::string>();
                         }
@@ -741,6 +1186,12 @@ public:
                 if (a.type == 1) {
                     na["type"] = "FileLogAppender";
                     na["file"] = a.file;
+                    if (a.max_size) {
+                        na["max_size"] = a.max_size;
+                    }
+                    if (!a.rotate.empty()) {
+                        na["rotate"] = a.rotate;
+                    }
                 } else if (a.type == 2) {
                     na["type"] = "StdoutLogAppender";
                 }
@@ -791,7 +1242,8 @@ struct LogIniter {
                 for (auto &a : i.appenders) {
                     LogAppender::ptr ap;
                     if (a.type == 1) {
-                        ap.reset(new FileLogAppender(a.file));
+                        ap.reset(new FileLogAppender(a.file, a.max_size,
+                                                     FileLogAppender::RotateFromString(a.rotate)));
                     } else if (a.type == 2) {
                         ap.reset(new StdoutLogAppender);
                     }
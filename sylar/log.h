@@ -4,20 +4,25 @@
 #include <string>
 #include <memory>
 #include <list>
-#include <fstream>
 #include <utility>
 #include <vector>
 #include <sstream>
 #include <unordered_map>
+#include <streambuf>
+#include <ostream>
+#include <cstdarg>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "singleton.h"
 #include "util.h"
+#include "clock.h"
 #include "thread.h"
 
 // 普通输入信息
+// 事件从当前线程的缓存里取，不用每条日志都分配
 #define SYLAR_LOG_LEVEL(logger, level) \
     if (logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadId(), \
-                            sylar::Thread::GetName(), sylar::GetFiberId(), time(nullptr)))).getSS()
+        sylar::LogEventWrap(logger, level, __FILE__, __LINE__).getSS()
 
 #define SYLAR_LOG_DEBUG(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::DEBUG)
 #define SYLAR_LOG_INFO(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::INFO)
@@ -27,11 +32,14 @@
 
 
 // 格式化输入信息
+// 打开二进制日志（log.binary_file）后不在这里格式化，只记调用点编号和原始参数，见binlog.h
 #define SYLAR_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if (logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
-                                                __FILE__, __LINE__, 0, sylar::GetThreadId(), \
-                                                sylar::Thread::GetName(), sylar::GetFiberId(), time(nullptr)))).getEvent()->format(fmt, __VA_ARGS__)
+    if (logger->getLevel() > level) {} \
+    else if (sylar::BinaryLogger::IsEnabled()) { \
+        static sylar::LogSite _sylar_log_site(level, __FILE__, __LINE__, fmt); \
+        sylar::BinaryLogger::Write(_sylar_log_site, logger, fmt, __VA_ARGS__); \
+    } else \
+        sylar::LogEventWrap(logger, level, __FILE__, __LINE__).getEvent()->format(fmt, __VA_ARGS__)
 
 #define SYLAR_LOG_FMT_DEBUG(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define SYLAR_LOG_FMT_INFO(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -69,24 +77,67 @@ public:
     static LogLevel::Level fromString(const std::string&) ;
 };
 
+// 日志内容的缓冲区，先写在内联的数组里，放不下了才用堆上的内存
+// 事件复用时缓冲区也跟着复用，不超过MAX_KEEP_SIZE的堆内存留着下次用
+class LogStreamBuf: public std::streambuf {
+public:
+    LogStreamBuf();
+    LogStreamBuf(const LogStreamBuf&) = delete;
+    LogStreamBuf& operator=(const LogStreamBuf&) = delete;
+
+    // 清空内容，堆上的内存超过MAX_KEEP_SIZE时还回去
+    void clear();
+    const char* data() const { return pbase(); }
+    size_t size() const { return pptr() - pbase(); }
+    // 类似vsnprintf，直接格式化到缓冲区里
+    void appendf(const char* fmt, va_list al);
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+private:
+    // 保证至少还能放下n个字节
+    void reserve(size_t n);
+
+private:
+    static const size_t INLINE_SIZE = 512;
+    static const size_t MAX_KEEP_SIZE = 4096;
+    char m_inline[INLINE_SIZE];
+    std::string m_heap;
+};
+
 // 日志事件
 class LogEvent {
 public:
     typedef std::shared_ptr<LogEvent> ptr;
+    LogEvent() : m_ss(&m_buf) {}
     LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char* file,
              int32_t line,uint32_t elapse, uint32_t threadId, std::string  threadName
             , uint32_t fiberId, uint64_t time);
+    LogEvent(const LogEvent&) = delete;
+    LogEvent& operator=(const LogEvent&) = delete;
+
+    // 复用一个事件，线程名只保存引用（一般是Thread::GetName()）
+    void reset(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file,
+               int32_t line, uint32_t threadId, const std::string& threadName,
+               uint32_t fiberId, uint64_t time);
+    // 事件要交给别的线程输出时调用：把引用的线程名复制一份，原来的线程退出了也能用
+    void detach();
 
     const char* getFile() const { return m_file; } // 这里返回的是指针，故前面得加const,以下函数返回的都是拷贝，故不用加const
     int32_t getLine() const { return m_line; }
     uint32_t getElapse() const { return m_elapse; }
     uint32_t getThreadId() const { return m_threadId; }
-    const std::string& getThreadName() const { return m_threadName; }
+    const std::string& getThreadName() const { return *m_threadName; }
     uint32_t getFiberId() const { return m_fiberId; }
     uint64_t getTime() const { return m_time; }
-    std::string getContent() const { return m_ss.str(); } 
-    std::stringstream& getSS()  { return m_ss; }
-    std::shared_ptr<Logger> getLogger() const { return m_logger; }
+    std::string getContent() const { return std::string(m_buf.data(), m_buf.size()); }
+    // 不拷贝地取日志内容
+    const char* getContentData() const { return m_buf.data(); }
+    size_t getContentSize() const { return m_buf.size(); }
+    std::ostream& getSS()  { return m_ss; }
+    const std::shared_ptr<Logger>& getLogger() const { return m_logger; }
     LogLevel::Level getLevel() const { return m_level; }
 
     void format(const char* fmt, ...);
@@ -97,12 +148,14 @@ private:
     int32_t m_line = 0; // 行号
     uint32_t m_elapse = 0; // 程序启动开始到现在的毫秒数
     uint32_t m_threadId = 0; // 线程号
-    std::string m_threadName; // 线程名字
+    const std::string* m_threadName = &m_threadNameStore; // 线程名字
+    std::string m_threadNameStore; // detach之后或者用构造函数传入的线程名字
     uint32_t m_fiberId = 0; // 协程号
     uint64_t m_time = 0; // 时间戳
-    std::stringstream m_ss;
+    LogStreamBuf m_buf;
+    std::ostream m_ss;
     std::shared_ptr<Logger> m_logger;
-    LogLevel::Level m_level;
+    LogLevel::Level m_level = LogLevel::UNKNOWN;
 };
 
 
@@ -110,11 +163,13 @@ private:
 class LogEventWrap {
 public:
     explicit LogEventWrap(LogEvent::ptr e);
+    // 从当前线程的缓存里取一个事件
+    LogEventWrap(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file, int32_t line);
     ~LogEventWrap();
 
-    LogEvent::ptr getEvent() const { return m_event; }
+    const LogEvent::ptr& getEvent() const { return m_event; }
 
-    std::stringstream& getSS();
+    std::ostream& getSS();
 
 private:
     LogEvent::ptr m_event;
@@ -123,28 +178,53 @@ private:
 
 
 // 日志格式器
+// 模式串在构造时编译成一串操作，格式化时按顺序拼到当前线程的行缓冲区里，最后一次写进输出流
+// 没有虚函数调用，也不拷贝智能指针；日期按秒缓存，同一秒里的日志不用再调strftime
 class LogFormatter {
 public:
     typedef std::shared_ptr<LogFormatter> ptr;
     explicit LogFormatter(const std::string& pattern);
 
     // 将日志消息进行格式化
-    std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
-    std::ostream& format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    std::string format(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
+    std::ostream& format(std::ostream& ofs, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
     void init();
     bool isError() const { return m_isError; }
     std::string getPattern() { return m_pattern; }
 
-public:
-    class FormatItem {
-    public:
-        typedef std::shared_ptr<FormatItem> ptr;
-        virtual ~FormatItem() = default;
-        virtual void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
+private:
+    enum OpType {
+        TEXT = 0,        // 普通文本
+        MESSAGE,         // %m
+        LEVEL,           // %p
+        ELAPSE,          // %r
+        NAME,            // %c
+        THREAD_ID,       // %t
+        NEWLINE,         // %n
+        FIBER_ID,        // %F
+        TAB,             // %T
+        DATETIME,        // %d
+        FILENAME,        // %f
+        LINE,            // %l
+        THREAD_NAME,     // %N
+    };
+    // TEXT的文本和DATETIME的日期格式放在m_text里
+    struct Op {
+        uint8_t type;
+        uint32_t offset;
+        uint32_t len;
     };
+
+    // 把一条日志拼到line后面，返回是否以换行结尾
+    bool render(std::string& line, LogLevel::Level level, const LogEvent& event) const;
+    void add_op(OpType type, const std::string& text = "");
+
 private:
     std::string m_pattern;
-    std::vector<FormatItem::ptr> m_items;
+    std::vector<Op> m_ops;
+    std::string m_text;
+    // 模式串是"%d%T%m%n"（config/log.yaml里用的）时走的快速路径
+    bool m_simple = false;
     bool m_isError = false;
 }; 
 
@@ -155,9 +235,11 @@ public:
     typedef std::shared_ptr<LogAppender> ptr;
     virtual ~LogAppender() = default;
 
-    virtual void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
+    virtual void log(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) = 0;
 
     virtual std::string toYamlString() = 0;
+    // 把缓冲的内容写出去
+    virtual void flush() {}
 
     void setFormatter(LogFormatter::ptr formatter)
     {
@@ -201,6 +283,8 @@ public:
     void addAppender(LogAppender::ptr appender);
     void delAppender(LogAppender::ptr appender);
     void clearAppenders();
+    // flush所有appender，没有appender时flush主日志器
+    void flush();
     
     LogLevel::Level getLevel() const { return m_level; }
     void setLevel(LogLevel::Level val) { m_level = val; }
@@ -228,24 +312,81 @@ private:
 class StdoutLogAppender: public LogAppender {
 public:
     typedef std::shared_ptr<StdoutLogAppender> ptr;
-    void log(std::shared_ptr<Logger> logger, LogLevel::Level Level, LogEvent::ptr event) override;
+    void log(const std::shared_ptr<Logger>& logger, LogLevel::Level Level, const LogEvent::ptr& event) override;
     std::string toYamlString() override;
+    void flush() override;
 };
 
 // 输出到文件的appender
+// 文件一直开着，日志先格式化到用户态的缓冲区里，攒够了或者需要flush的时候用writev一次写出去
+// 同步输出时缓冲区满了、每秒一次、遇到ERROR及以上的日志时写，异步的后台线程一批结束时写一次
+// 支持按大小或者按时间切分文件，每秒检查一次文件有没有被删掉或者改名（比如被logrotate挪走），是的话重新打开
 class FileLogAppender: public LogAppender {
 public:
     typedef std::shared_ptr<FileLogAppender> ptr;
 
-    explicit FileLogAppender(const std::string& filename);
-    void log(std::shared_ptr<Logger> logger, LogLevel::Level Level, LogEvent::ptr event) override;
+    // 按时间切分
+    enum Rotate {
+        NONE = 0,
+        HOURLY = 1,
+        DAILY = 2,
+    };
+    static Rotate RotateFromString(const std::string& str);
+    static const char* RotateToString(Rotate rotate);
+
+    // max_size为0表示不按大小切分
+    explicit FileLogAppender(const std::string& filename, uint64_t max_size = 0, Rotate rotate = NONE);
+    ~FileLogAppender() override;
+    void log(const std::shared_ptr<Logger>& logger, LogLevel::Level Level, const LogEvent::ptr& event) override;
 
     std::string toYamlString() override;
+    void flush() override;
+
+    bool reopen();
+
+private:
+    // 把格式化的输出直接追加到缓冲区里
+    class FileBuf: public std::streambuf {
+    public:
+        explicit FileBuf(FileLogAppender* appender) : m_appender(appender) {}
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        // std::endl和格式化器每行末尾的flush会调用到这里，不写文件
+        int sync() override;
+    private:
+        FileLogAppender* m_appender;
+    };
+
+    // 以下函数调用时持有m_mutex
+    void append(const char* s, size_t n);
+    void write_out();
+    bool open_file();
+    void check_file(time_t now);
+    void rotate(time_t now);
+    time_t next_rotate_time(time_t now) const;
 
-    void reopen();
 private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
     std::string m_filename;
-    std::ofstream m_filestream;
+    uint64_t m_max_size;
+    Rotate m_rotate;
+
+    int m_fd = -1;
+    dev_t m_dev = 0;
+    ino_t m_ino = 0;
+    uint64_t m_file_size = 0; // 已经写进文件的大小
+    time_t m_next_check = 0; // 下次检查文件是否还在
+    time_t m_next_rotate = 0;
+
+    // 缓冲区分成若干块，写的时候一次writev
+    std::vector<std::string> m_blocks;
+    std::vector<struct iovec> m_iov;
+    size_t m_current = 0; // 正在写的块
+    size_t m_buffered = 0; // 缓冲区里还没写出去的字节数
+    FileBuf m_buf;
+    std::ostream m_stream;
 };
 
 
@@ -270,6 +411,18 @@ typedef sylar::Singleton<LoggerManager> LoggerMgr;
 static LogLevel::Level& G_Level();
 void Filter(LogLevel::Level level);
 
+// 作用域内当前线程输出的日志换行时不flush输出流，由调用者一批输出完之后统一flush（异步日志的后台线程用）
+class LogBatchScope {
+public:
+    LogBatchScope();
+    ~LogBatchScope();
+private:
+    bool m_prev;
+};
+
 }
 
+// SYLAR_LOG_FMT_*用到的二进制日志，放在最后是因为它要用上面的Logger和LogEventWrap
+#include "binlog.h"
+
 #endif
\ No newline at end of file
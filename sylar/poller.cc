@@ -0,0 +1,123 @@
+#include "poller.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// io_uring提交队列的大小，完成队列是它的4倍
+static const unsigned URING_ENTRIES = 256;
+
+Poller::ptr Poller::Create(const std::string &name)
+{
+    if (name == "io_uring" || name == "auto") {
+        std::unique_ptr<UringPoller> poller(new UringPoller);
+        if (poller->init(URING_ENTRIES)) {
+            return poller;
+        }
+        SYLAR_LOG_INFO(g_logger) << "io_uring is not available, fall back to epoll";
+    } else if (name != "epoll") {
+        SYLAR_LOG_ERROR(g_logger) << "unknown poller: " << name << ", use epoll";
+    }
+    return ptr(new EpollPoller);
+}
+
+EpollPoller::EpollPoller()
+    : m_events(64)
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    SYLAR_ASSERT(m_epfd >= 0)
+}
+
+EpollPoller::~EpollPoller()
+{
+    if (m_timer_fd >= 0) {
+        close(m_timer_fd);
+    }
+    if (m_epfd >= 0) {
+        close(m_epfd);
+    }
+}
+
+bool EpollPoller::update(int fd, uint32_t old_events, uint32_t events, void *data)
+{
+    // 原来没有事件是添加(add)，不再有事件是删除(del)，否则是修改(mod)
+    int op = !old_events ? EPOLL_CTL_ADD : (events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    epoll_event event{};
+    event.events = EPOLLET | events;
+    event.data.ptr = data;
+
+    int rt = epoll_ctl(m_epfd, op, fd, &event);
+    if (rt) {
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                  << op << ", " << fd << ", " << event.events
+                                  << "): " << rt << " (" << errno << ") (" << strerror(errno)
+                                  << ") ";
+        return false;
+    }
+    return true;
+}
+
+int EpollPoller::wait(PollEvent *events, int max_events, int64_t timeout_us)
+{
+    if ((size_t) max_events > m_events.size()) {
+        m_events.resize(max_events);
+    }
+    int rt;
+    if (timeout_us < 0 || timeout_us % 1000 == 0) {
+        // 整毫秒的超时epoll_wait就够了
+        rt = epoll_wait(m_epfd, &m_events[0], max_events,
+                        timeout_us < 0 ? -1 : (int) (timeout_us / 1000));
+    } else {
+        rt = wait_precise(max_events, timeout_us);
+    }
+    int count = 0;
+    for (int i = 0; i < rt; ++i) {
+        if (m_events[i].data.ptr == &m_timer_fd) {
+            // timerfd只是用来唤醒的，不交给上层
+            continue;
+        }
+        events[count].data = m_events[i].data.ptr;
+        events[count].events = m_events[i].events;
+        ++count;
+    }
+    return rt < 0 ? rt : count;
+}
+
+int EpollPoller::wait_precise(int max_events, int64_t timeout_us)
+{
+    if (m_timer_fd < 0) {
+        m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_timer_fd >= 0) {
+            // 边缘触发，不用读：重新设置时间会把到期次数清零
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = &m_timer_fd;
+            if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_timer_fd, &event)) {
+                close(m_timer_fd);
+                m_timer_fd = -1;
+            }
+        }
+        if (m_timer_fd < 0) {
+            SYLAR_LOG_ERROR(g_logger) << "create timerfd failed, errno=" << errno
+                                      << " (" << strerror(errno) << ")";
+        }
+    }
+    if (m_timer_fd < 0) {
+        // 退回毫秒，向上取整
+        return epoll_wait(m_epfd, &m_events[0], max_events, (int) ((timeout_us + 999) / 1000));
+    }
+    itimerspec its{};
+    its.it_value.tv_sec = timeout_us / 1000000;
+    its.it_value.tv_nsec = timeout_us % 1000000 * 1000;
+    timerfd_settime(m_timer_fd, 0, &its, nullptr);
+    return epoll_wait(m_epfd, &m_events[0], max_events, -1);
+}
+}
@@ -0,0 +1,189 @@
+#ifndef __SYLAR_POLLER_H__
+#define __SYLAR_POLLER_H__
+
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "thread.h"
+
+struct epoll_event;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace sylar {
+
+// 一个就绪的事件
+// events的取值和EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP一致（也和POLLIN等一致）
+struct PollEvent {
+    void *data;
+    uint32_t events;
+};
+
+// 完成式的io请求：读写由后端在内核里直接完成，完成之后调用done
+struct IoRequest {
+    enum Op {
+        RECV,
+        SEND,
+        ACCEPT,
+        CONNECT
+    };
+
+    IoRequest(Op o, int f)
+        : op(o), fd(f)
+    {}
+
+    Op op;
+    int fd;
+    void *buf = nullptr;
+    size_t len = 0;            // CONNECT时为地址长度
+    int flags = 0;
+    sockaddr *addr = nullptr;  // ACCEPT/CONNECT的地址
+    socklen_t *addrlen = nullptr;
+    uint64_t timeout_ms = ~0ull;
+
+    int result = 0;            // 系统调用的返回值，出错时为-errno
+    bool timed_out = false;    // 是否因为超时被取消
+
+    // 在等待事件的线程里调用，调用之后后端不会再访问该请求
+    void (*done)(IoRequest *req) = nullptr;
+    void *arg = nullptr;
+
+    // 以下由后端使用
+    struct {
+        int64_t tv_sec;
+        long long tv_nsec;
+    } timeout_ts{};
+    int remain = 0; // 还没收到的完成事件个数
+};
+
+// IOManager使用的事件后端
+class Poller {
+public:
+    typedef std::unique_ptr<Poller> ptr;
+
+    virtual ~Poller() = default;
+
+    virtual const char *getName() const = 0;
+
+    // 修改fd关注的事件(EPOLLIN/EPOLLOUT的组合)，都是边缘触发
+    // old_events为之前注册的事件，events为0表示不再关注
+    virtual bool update(int fd, uint32_t old_events, uint32_t events, void *data) = 0;
+    // 等待就绪事件，timeout_us小于0表示一直等，精确到微秒
+    // 完成式请求的done也在这里面调用
+    // 返回就绪事件的个数，出错返回-1并设置errno
+    virtual int wait(PollEvent *events, int max_events, int64_t timeout_us) = 0;
+
+    // 把攒下来的修改和请求提交给内核，工作线程睡下去之前调用
+    virtual void flush() {}
+
+    // 是否支持完成式的请求
+    virtual bool supportsCompletion() const { return false; }
+    // 提交一个完成式的请求，失败返回false
+    virtual bool submit(IoRequest *req) { return false; }
+    // fd关闭之前调用，取消fd上所有还没完成的请求
+    virtual void cancel(int fd) {}
+
+public:
+    // 按名字创建后端("epoll" / "io_uring" / "auto")
+    // auto优先使用io_uring，内核不支持时退回epoll
+    static ptr Create(const std::string &name);
+};
+
+// epoll后端（原来的实现）
+class EpollPoller : public Poller {
+public:
+    EpollPoller();
+    ~EpollPoller() override;
+
+    const char *getName() const override { return "epoll"; }
+    bool update(int fd, uint32_t old_events, uint32_t events, void *data) override;
+    int wait(PollEvent *events, int max_events, int64_t timeout_us) override;
+
+private:
+    // 不是整毫秒的超时用timerfd定时，timerfd不受内核timer slack的影响，比epoll_pwait2准
+    int wait_precise(int max_events, int64_t timeout_us);
+
+private:
+    int m_epfd = -1;
+    // 第一次需要时才创建，注册在epoll里，数据指针指向它自己
+    int m_timer_fd = -1;
+    // 只有拿到poller令牌的线程会调用wait，不用加锁
+    std::vector<epoll_event> m_events;
+};
+
+// io_uring后端，直接用系统调用，不依赖liburing
+// 1. 就绪事件用multishot的POLL_ADD，注册一次之后每次就绪都会产生一个完成事件
+// 2. 注册的修改和完成式请求都只是写进提交队列，等线程空闲时一起提交，
+//    等待事件的线程在同一次io_uring_enter里提交并等待
+class UringPoller : public Poller {
+public:
+    UringPoller() = default;
+    ~UringPoller() override;
+
+    // 内核不支持或者被禁用时返回false
+    bool init(unsigned entries);
+
+    const char *getName() const override { return "io_uring"; }
+    bool update(int fd, uint32_t old_events, uint32_t events, void *data) override;
+    int wait(PollEvent *events, int max_events, int64_t timeout_us) override;
+    void flush() override;
+    bool supportsCompletion() const override { return true; }
+    bool submit(IoRequest *req) override;
+    void cancel(int fd) override;
+
+private:
+    // 每个fd上multishot poll的状态，gen用来丢掉已经删除的poll产生的事件
+    struct FdState {
+        uint32_t gen = 0;
+        uint32_t events = 0;
+        bool armed = false;
+        void *data = nullptr;
+    };
+
+    // 以下函数都要在持有m_mutex时调用
+    // 保证提交队列里至少有reserve个空位，再取出一个，链接在一起的请求要一次预留好
+    io_uring_sqe *get_sqe_locked(unsigned reserve = 1);
+    void publish_locked();
+    FdState &get_state_locked(int fd);
+    void arm_locked(int fd, FdState &state);
+
+    unsigned unsubmitted() const;
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags, int64_t timeout_us);
+    // 处理一个完成事件，是就绪事件的话返回true并填好event
+    bool handle_cqe(const io_uring_cqe &cqe, PollEvent &event);
+    static void finish(IoRequest *req);
+
+private:
+    int m_ring_fd = -1;
+
+    void *m_sq_ring = nullptr;
+    size_t m_sq_ring_size = 0;
+    void *m_cq_ring = nullptr;
+    size_t m_cq_ring_size = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+
+    unsigned *m_sq_khead = nullptr;
+    unsigned *m_sq_ktail = nullptr;
+    unsigned *m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_sq_tail = 0; // 本地的队尾，publish之后内核才看得见
+
+    unsigned *m_cq_khead = nullptr;
+    unsigned *m_cq_ktail = nullptr;
+    io_uring_cqe *m_cqes = nullptr;
+    unsigned m_cq_mask = 0;
+
+    // 提交队列可以被多个线程写，完成队列只有拿到poller令牌的线程读
+    Spin_Mutex m_mutex;
+    std::vector<FdState> m_fds;
+};
+
+}
+
+#endif
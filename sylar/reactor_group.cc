@@ -0,0 +1,182 @@
+#include "reactor_group.h"
+#include "config.h"
+#include "fd_manager.h"
+#include "hook.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 每个reactor的线程是否绑定到一个核上（第i个reactor绑第i%核数个核）
+static ConfigVar<bool>::ptr g_reactor_pin_cpu =
+    Config::Lookup<bool>("reactor.pin_cpu", false, "pin each reactor thread to a cpu");
+
+ReactorGroup::ReactorGroup(size_t reactors, const std::string &name)
+{
+    long cpus = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    if (reactors == 0) {
+        reactors = (size_t) cpus;
+    }
+    bool pin = g_reactor_pin_cpu->getValue();
+    for (size_t i = 0; i < reactors; ++i) {
+        m_reactors.emplace_back(new IOManager(1, false, name + "_" + std::to_string(i)));
+        if (pin) {
+            int cpu = (int) (i % cpus);
+            post(i, [cpu] {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                if (rt) {
+                    SYLAR_LOG_ERROR(g_logger) << "pin reactor to cpu " << cpu
+                                              << " failed, errno=" << rt;
+                }
+            });
+        }
+    }
+}
+
+ReactorGroup::~ReactorGroup()
+{
+    stop();
+}
+
+int ReactorGroup::getThisIndex() const
+{
+    IOManager *iom = IOManager::GetThis();
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        if (m_reactors[i].get() == iom) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+int ReactorGroup::open_listener(sockaddr *addr, socklen_t addrlen, bool reuseport)
+{
+    // 用原始的socket，不能注册到调用者所在的IOManager里（调用者可能是别的reactor）
+    int fd = socket_f(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "listener socket failed, errno=" << errno
+                                  << " (" << strerror(errno) << ")";
+        return -1;
+    }
+    int on = 1;
+    setsockopt_f(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((reuseport && setsockopt_f(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+        || bind(fd, addr, addrlen)
+        || ::listen(fd, SOMAXCONN)) {
+        SYLAR_LOG_ERROR(g_logger) << "listener setup failed, errno=" << errno
+                                  << " (" << strerror(errno) << ")";
+        close_f(fd);
+        return -1;
+    }
+    // 端口为0的话取回实际的地址，之后的监听socket绑同一个端口
+    getsockname(fd, addr, &addrlen);
+    // 交给hook管理：设置成非阻塞，没有新连接时accept挂起协程而不是阻塞线程
+    FdMgr::GetInstance()->getFdCtx(fd, true);
+    return fd;
+}
+
+bool ReactorGroup::listen_reuseport(sockaddr *addr, socklen_t addrlen, AcceptCallback cb)
+{
+    auto shared_cb = std::make_shared<AcceptCallback>(std::move(cb));
+    std::vector<int> fds;
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        int fd = open_listener(addr, addrlen, true);
+        if (fd < 0) {
+            for (int opened : fds) {
+                FdMgr::GetInstance()->delFdCtx(opened);
+                close_f(opened);
+            }
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+        start_accept(i, fds[i], false, shared_cb);
+    }
+    return true;
+}
+
+bool ReactorGroup::listen_round_robin(sockaddr *addr, socklen_t addrlen, AcceptCallback cb)
+{
+    int fd = open_listener(addr, addrlen, false);
+    if (fd < 0) {
+        return false;
+    }
+    start_accept(0, fd, true, std::make_shared<AcceptCallback>(std::move(cb)));
+    return true;
+}
+
+void ReactorGroup::start_accept(size_t index, int listen_fd, bool round_robin,
+                                std::shared_ptr<AcceptCallback> cb)
+{
+    {
+        Mutex::Lock lock(m_mutex);
+        m_listeners.emplace_back(listen_fd, index);
+    }
+    post(index, [this, listen_fd, round_robin, cb] {
+        accept_loop(listen_fd, round_robin, cb);
+    });
+}
+
+void ReactorGroup::accept_loop(int listen_fd, bool round_robin,
+                               const std::shared_ptr<AcceptCallback> &cb)
+{
+    IOManager *iom = IOManager::GetThis();
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EBADF || errno == EINVAL) {
+                // 监听socket被stop关掉了
+                break;
+            }
+            SYLAR_LOG_ERROR(g_logger) << "accept listen_fd=" << listen_fd << " errno=" << errno
+                                      << " (" << strerror(errno) << ")";
+            continue;
+        }
+        IOManager *target = round_robin ? m_reactors[next()].get() : iom;
+        if (target == iom) {
+            iom->schedule([cb, fd] { (*cb)(fd); });
+            continue;
+        }
+        // 常驻注册模式下hook的accept已经把fd注册到了当前reactor的后端
+        // 先删掉，到目标reactor上重新注册，之后的事件才会在目标reactor上触发
+        iom->cancel_all(fd);
+        target->schedule([cb, fd] {
+            IOManager::GetThis()->register_fd(fd);
+            (*cb)(fd);
+        });
+    }
+}
+
+void ReactorGroup::stop()
+{
+    std::vector<std::pair<int, size_t>> listeners;
+    {
+        Mutex::Lock lock(m_mutex);
+        if (m_stopped) {
+            return;
+        }
+        m_stopped = true;
+        listeners.swap(m_listeners);
+    }
+    for (auto &i : listeners) {
+        int fd = i.first;
+        // 在监听socket所在的reactor上关，hook的close会唤醒挂起的accept
+        post(i.second, [fd] { close(fd); });
+    }
+    for (auto &reactor : m_reactors) {
+        reactor->stop();
+    }
+}
+
+}
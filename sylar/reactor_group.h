@@ -0,0 +1,74 @@
+#ifndef __SYLAR_REACTOR_GROUP_H__
+#define __SYLAR_REACTOR_GROUP_H__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+#include "iomanager.h"
+#include "thread.h"
+
+namespace sylar {
+
+// 一组互相独立的单线程IOManager（reactor），每个有自己的后端、定时器和任务队列
+// 一个连接从接受到关闭都留在同一个reactor上，它的协程、fd上下文和定时器不会在线程之间来回
+// 跨reactor的交互只能通过post
+class ReactorGroup {
+public:
+    typedef std::shared_ptr<ReactorGroup> ptr;
+    // 新连接的回调，在连接所属的reactor上的新协程里执行，由回调负责关闭fd
+    typedef std::function<void(int fd)> AcceptCallback;
+
+    // reactors为0时每个核一个
+    explicit ReactorGroup(size_t reactors = 0, const std::string &name = "reactor");
+    ~ReactorGroup();
+
+    ReactorGroup(const ReactorGroup &) = delete;
+    ReactorGroup &operator=(const ReactorGroup &) = delete;
+
+    size_t size() const { return m_reactors.size(); }
+    IOManager *getReactor(size_t index) const { return m_reactors[index].get(); }
+    // 轮流选一个reactor
+    size_t next() { return m_next.fetch_add(1, std::memory_order_relaxed) % m_reactors.size(); }
+    // 当前线程所在的reactor的下标，不在本组的reactor上时返回-1
+    int getThisIndex() const;
+
+    // 把任务交给指定的reactor执行，可以在任何线程调用
+    template<typename Fiber_or_Cb>
+    void post(size_t index, Fiber_or_Cb fc)
+    {
+        m_reactors[index % m_reactors.size()]->schedule(std::move(fc));
+    }
+
+    // 每个reactor用SO_REUSEPORT各开一个监听socket，由内核把新连接分给各个reactor
+    // 端口为0时所有reactor共用第一次绑定分到的端口，并把实际的地址写回addr
+    bool listen_reuseport(sockaddr *addr, socklen_t addrlen, AcceptCallback cb);
+    // 只在第一个reactor上监听，接受的连接轮流交给各个reactor（内核不支持SO_REUSEPORT时用）
+    bool listen_round_robin(sockaddr *addr, socklen_t addrlen, AcceptCallback cb);
+
+    // 关掉所有监听socket，等所有reactor上的任务、事件和定时器结束
+    void stop();
+
+private:
+    // 创建监听socket，交给hook管理，但不注册到任何reactor上
+    int open_listener(sockaddr *addr, socklen_t addrlen, bool reuseport);
+    void start_accept(size_t index, int listen_fd, bool round_robin,
+                      std::shared_ptr<AcceptCallback> cb);
+    // 在监听socket所在的reactor上循环接受连接，直到监听socket被关掉
+    void accept_loop(int listen_fd, bool round_robin, const std::shared_ptr<AcceptCallback> &cb);
+
+private:
+    std::vector<std::unique_ptr<IOManager>> m_reactors;
+    std::atomic<size_t> m_next{0};
+    Mutex m_mutex;
+    // 监听socket和它所在的reactor
+    std::vector<std::pair<int, size_t>> m_listeners;
+    bool m_stopped = false;
+};
+
+}
+
+#endif //__SYLAR_REACTOR_GROUP_H__
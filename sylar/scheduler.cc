@@ -10,6 +10,8 @@ static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 static thread_local Scheduler *t_scheduler = nullptr;
 // 当前线程的主协程
 static thread_local Fiber *t_fiber = nullptr;
+// 当前线程对应的工作线程（不是任何调度器的工作线程时为空）
+static thread_local Scheduler::Worker *t_worker = nullptr;
 
 Scheduler::Scheduler(size_t thread_count, bool use_caller, const std::string &name)
     : m_name(name)
@@ -25,7 +27,13 @@ Scheduler::Scheduler(size_t thread_count, bool use_caller, const std::string &na
         SYLAR_ASSERT(GetThis() == nullptr)
         t_scheduler = this;
 
-        m_root_fiber.reset(new Fiber([this] { run(); }, 0, true));
+        m_workers.emplace_back(new Worker);
+        Worker *worker = m_workers.back().get();
+        worker->thread_id = GetThreadId();
+        m_root_fiber.reset(new Fiber([this, worker] {
+            t_worker = worker;
+            run();
+        }, 0, true));
         Thread::SetName(name);
 
         t_fiber = m_root_fiber.get();
@@ -37,6 +45,14 @@ Scheduler::Scheduler(size_t thread_count, bool use_caller, const std::string &na
         m_root_thread_id = -1;
     }
     m_thread_count = thread_count;
+    for (size_t i = 0; i < thread_count; ++i) {
+        m_workers.emplace_back(new Worker);
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        m_workers[i]->scheduler = this;
+        m_workers[i]->index = (int) i;
+        m_workers[i]->rand_state = (uint64_t) (uintptr_t) m_workers[i].get() + i + 1;
+    }
 
     //start();
 }
@@ -49,6 +65,18 @@ Scheduler::~Scheduler()
     if (t_scheduler == this) {
         t_scheduler = nullptr;
     }
+    // 释放本地队列里没来得及执行的任务
+    for (auto &worker : m_workers) {
+        while (Task *task = worker->queue.pop()) {
+            Task::Destroy(task);
+        }
+        while (Task *task = worker->mailbox.pop_front()) {
+            Task::Destroy(task);
+        }
+    }
+    while (Task *task = m_fibers.pop_front()) {
+        Task::Destroy(task);
+    }
 }
 
 Scheduler *Scheduler::GetThis()
@@ -74,9 +102,15 @@ void Scheduler::start()
     SYLAR_ASSERT(m_threads.empty())
 
     m_threads.resize(m_thread_count);
+    size_t first_worker = m_root_fiber ? 1 : 0;
     for (size_t i = 0; i < m_thread_count; ++i) {
         // 每个线程都去执行run方法
-        m_threads[i].reset(new Thread([this] { run(); },
+        Worker *worker = m_workers[first_worker + i].get();
+        m_threads[i].reset(new Thread([this, worker] {
+                                          t_worker = worker;
+                                          worker->thread_id = GetThreadId();
+                                          run();
+                                      },
                                       m_name + "_" + std::to_string(i)));
         m_thread_ids.emplace_back(m_threads[i]->getId());
     }
@@ -157,6 +191,222 @@ void Scheduler::setThis()
     t_scheduler = this;
 }
 
+Scheduler::Worker *Scheduler::get_this_worker() const
+{
+    if (t_worker && t_worker->scheduler == this) {
+        return t_worker;
+    }
+    return nullptr;
+}
+
+bool Scheduler::has_task(Worker *worker) const
+{
+    if (worker->mailbox_size > 0 || m_fibers_size > 0) {
+        return true;
+    }
+    for (auto &w : m_workers) {
+        if (!w->queue.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::schedule_tasks(TaskList &tasks)
+{
+    bool need_tickle = false;
+    TaskList globals;
+    while (Task *task = tasks.pop_front()) {
+        if (push_mailbox(task)) {
+            continue;
+        }
+        if (push_local(task)) {
+            need_tickle = true;
+        } else {
+            globals.push_back(task);
+        }
+    }
+    if (!globals.empty()) {
+        MutexType::Lock lock(m_mutex);
+        while (Task *task = globals.pop_front()) {
+            need_tickle = schedule_no_lock(task) || need_tickle;
+        }
+    }
+    if (need_tickle) {
+        tickle();
+    }
+}
+
+bool Scheduler::schedule_no_lock(Task *task)
+{
+    // 若m_fibers为空，说明此时没有协程任务，则插入一个任务并返回true
+    bool need_tickle = m_fibers.empty();
+    ++m_task_count;
+    m_fibers.push_back(task);
+    ++m_fibers_size;
+    return need_tickle;
+}
+
+bool Scheduler::push_local(Task *task)
+{
+    if (task->thread != -1 || !t_worker || t_worker->scheduler != this) {
+        return false;
+    }
+    // 先加计数再入队，保证任务被取走之前stopping()不会误判为空
+    ++m_task_count;
+    if (!t_worker->queue.push(task)) {
+        // 本地队列满了，交给全局队列
+        --m_task_count;
+        return false;
+    }
+    // 有空闲线程的话通知它们过来偷
+    return true;
+}
+
+Scheduler::Worker *Scheduler::find_worker(int thread)
+{
+    // 线程数一般不多，直接遍历
+    for (auto &worker : m_workers) {
+        if (worker->thread_id == thread) {
+            return worker.get();
+        }
+    }
+    return nullptr;
+}
+
+bool Scheduler::push_mailbox(Task *task)
+{
+    if (task->thread == -1) {
+        return false;
+    }
+    Worker *worker = find_worker(task->thread);
+    if (!worker) {
+        return false;
+    }
+    ++m_task_count;
+    {
+        Spin_Mutex::Lock lock(worker->mailbox_mutex);
+        worker->mailbox.push_back(task);
+        ++worker->mailbox_size;
+    }
+    if (worker != t_worker) {
+        tickle_worker(worker);
+    }
+    return true;
+}
+
+// 协程还在别的线程上切出去的路上（EXEC状态），暂时不能执行
+static bool is_executing(Task *task)
+{
+    return task->isFiber() && task->getFiber()->getState() == Fiber::EXEC;
+}
+
+Task *Scheduler::take_mailbox(Worker *worker)
+{
+    if (worker->mailbox_size == 0) {
+        return nullptr;
+    }
+    Spin_Mutex::Lock lock(worker->mailbox_mutex);
+    Task *prev = nullptr;
+    for (Task *task = worker->mailbox.front(); task; prev = task, task = task->next) {
+        if (is_executing(task)) {
+            continue;
+        }
+        worker->mailbox.erase_after(prev);
+        --worker->mailbox_size;
+        --m_task_count;
+        return task;
+    }
+    return nullptr;
+}
+
+Task *Scheduler::steal_task(Worker *worker)
+{
+    size_t n = m_workers.size();
+    if (n <= 1) {
+        return nullptr;
+    }
+    // xorshift随机选一个起点，避免所有空闲线程都去偷同一个
+    uint64_t x = worker->rand_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    worker->rand_state = x;
+
+    size_t start = x % n;
+    for (size_t i = 0; i < n; ++i) {
+        Worker *victim = m_workers[(start + i) % n].get();
+        if (victim == worker) {
+            continue;
+        }
+        if (Task *task = victim->queue.steal()) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+Task *Scheduler::take_task(Worker *worker, bool &tickle_me)
+{
+    // 1. 信箱里的任务只能由本线程执行，优先处理
+    if (Task *task = take_mailbox(worker)) {
+        return task;
+    }
+
+    // 2. 本地队列，后进先出，cache最热
+    while (Task *task = worker->queue.pop()) {
+        if (is_executing(task)) {
+            // 先放到全局队列里
+            MutexType::Lock lock(m_mutex);
+            m_fibers.push_back(task);
+            ++m_fibers_size;
+            continue;
+        }
+        --m_task_count;
+        // 本地还有剩余任务时让空闲线程来偷
+        tickle_me = !worker->queue.empty();
+        return task;
+    }
+
+    // 3. 全局队列
+    {
+        MutexType::Lock lock(m_mutex);
+        Task *prev = nullptr;
+        for (Task *task = m_fibers.front(); task; prev = task, task = task->next) {
+            if (task->thread != -1 &&
+                task->thread != GetThreadId()) {
+                // 如果该协程任务指定了线程且不是本线程
+                // 则发出信号给其他线程，然后跳过该协程
+                tickle_me = true;
+                continue;
+            }
+            if (is_executing(task)) {
+                // 该协程任务正在执行中则跳过
+                continue;
+            }
+
+            m_fibers.erase_after(prev);
+            --m_fibers_size;
+            --m_task_count;
+            tickle_me |= !m_fibers.empty();
+            return task;
+        }
+    }
+
+    // 4. 去其他线程的本地队列里偷
+    if (Task *task = steal_task(worker)) {
+        if (is_executing(task)) {
+            MutexType::Lock lock(m_mutex);
+            m_fibers.push_back(task);
+            ++m_fibers_size;
+            return nullptr;
+        }
+        --m_task_count;
+        return task;
+    }
+    return nullptr;
+}
+
 void Scheduler::run()
 {
     // 每个新线程都会运行该函数
@@ -170,135 +420,73 @@ void Scheduler::run()
         t_fiber = Fiber::GetThis().get();
     }
 
+    // 不是由start()/构造函数创建的线程（例如直接调用run），用一个临时的工作线程
+    std::unique_ptr<Worker> temp_worker;
+    if (!t_worker || t_worker->scheduler != this) {
+        temp_worker.reset(new Worker);
+        temp_worker->scheduler = this;
+        temp_worker->rand_state = (uint64_t) (uintptr_t) temp_worker.get();
+        t_worker = temp_worker.get();
+    }
+    Worker *worker = t_worker;
+
     // 空闲协程，用来占住cpu
     Fiber::ptr idle_fiber(new Fiber([this] { idle(); }));
     Fiber::ptr cb_fiber;
 
-    Fiber_and_Thread ft;
     while (true) {
         //SYLAR_LOG_INFO(g_logger) << "Loop !";
-        ft.reset();
         bool tickle_me = false;
 
-        MutexType::Lock lock(m_mutex);
-        //SYLAR_LOG_DEBUG(g_logger) << "before it. ";
-        auto it = m_fibers.begin();
-        //SYLAR_LOG_DEBUG(g_logger) << "after it. ";
-        while (it != m_fibers.end()) {
-            if (it->thread != -1 &&
-                it->thread != GetThreadId()) {
-                // 如果该协程任务指定了线程且不是本线程
-                // 则发出信号给其他线程，然后跳过该协程
-                ++it;
-                tickle_me = true;
-                continue;
-            }
-
-            //SYLAR_ASSERT(it->fiber || it->cb)
-            SYLAR_ASSERT(std::holds_alternative<Fiber::ptr>(it->fiber_or_cb) ||
-                std::holds_alternative<std::function<void()>>(it->fiber_or_cb))
-//                if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
-//                    // 该协程任务正在执行中则跳过
-//                    ++it;
-//                    continue;
-//                }
-            if (auto f = std::get_if<0>(&(it->fiber_or_cb))) {
-                if ((*f)->getState() == Fiber::EXEC) {
-                    // 该协程任务正在执行中则跳过
-                    ++it;
-                    continue;
-                }
-            }
-
-            ft = *it;
-            m_fibers.erase(it++);
-
-            break;
-        }
-
-        tickle_me |= it != m_fibers.end();
-
-        // 此处注意解锁，不然后面idle协程调用stopping()函数判断的时候
-        // 拿不到锁，导致死锁
-        lock.unlock();
+        Task *task = take_task(worker, tickle_me);
 
         if (tickle_me) {
             tickle();
         }
-        if (std::get_if<0>(&ft.fiber_or_cb) &&
-            std::get<0>(ft.fiber_or_cb)) {
-            auto it_fiber = std::get_if<0>(&ft.fiber_or_cb);
-            if ((*it_fiber)->getState() != Fiber::TERM) {
+        if (task && task->isFiber()) {
+            Fiber::ptr fiber = std::move(task->getFiber());
+            Task::Destroy(task);
+            if (fiber->getState() != Fiber::TERM) {
                 // 如果是协程并且该协程还没有结束,
                 // 则执行该协程，标记该线程为活跃状态
                 ++m_active_thread_count;
                 // 将该协程与当前线程正在执行的协程交换
-                (*it_fiber)->swapIn();
+                // 切出来时没结束的协程已经是挂起状态，这之后可能马上被别的线程切进去，
+                // 所以只能看swapIn返回的状态，不能再修改它的状态
+                Fiber::State state = fiber->swapIn();
                 --m_active_thread_count;
 
-                if ((*it_fiber)->getState() == Fiber::READY) {
+                if (state == Fiber::READY) {
                     // 如果该协程调用了“Yield_to_Ready"，则说明还有任务要做
                     // 则重新把该协程丢进协程队列
-                    schedule((*it_fiber));
-                } else if ((*it_fiber)->getState() != Fiber::TERM
-                    && (*it_fiber)->getState() != Fiber::EXCPT) {
-                    // 如果该协程还没有结束，则设为挂起状态
-                    SYLAR_LOG_DEBUG(g_logger) << "Change state to HOLD in fiber_run, id="
-                                              << (*it_fiber)->getId();
-                    (*it_fiber)->setState(Fiber::HOLD);
+                    schedule(&fiber);
                 }
-                ft.reset();
-
             }
-//            if (ft.fiber && ft.fiber->getState() != Fiber::TERM) {
-//                // 如果是协程并且该协程还没有结束,
-//                // 则执行该协程，标记该线程为活跃状态
-//                ++m_active_thread_count;
-//                ft.fiber->swapIn();
-//                --m_active_thread_count;
-//
-//                if (ft.fiber->getState() == Fiber::READY) {
-//                    // 如果该协程调用了“Yield_to_Ready"，则说明还有任务要做
-//                    // 则重新把该协程丢进协程队列
-//                    schedule(ft.fiber);
-//                } else if (ft.fiber->getState() != Fiber::TERM
-//                        || ft.fiber->getState() != Fiber::EXCPT)
-//                {
-//                    // 如果该协程还没有结束，则设为挂起状态
-//                    ft.fiber->setState(Fiber::HOLD);
-//                }
-//                ft.reset();
-
-            //} else if (ft.cb) {
-        } else if (std::get_if<1>(&ft.fiber_or_cb) &&
-            std::get<1>(ft.fiber_or_cb)) {
-            // 如果是回调
-            // 则用cb_fiber来接收这个回调
-            auto it_cb = std::get_if<1>(&ft.fiber_or_cb);
-            //Fiber::ptr cb_fiber(new Fiber(*it_cb));
 
+        } else if (task) {
+            // 如果是回调
+            // 则用cb_fiber来接收这个回调，回调执行完之后任务节点由Invoker释放
+            // Invoker只有一个指针大小，装进std::function不需要分配内存
             if (cb_fiber) {
                 // 如果cb_fiber已经初始化过
-                cb_fiber->reset(*it_cb);
+                cb_fiber->reset(Task::Invoker{task});
             } else {
-                cb_fiber.reset(new Fiber(*it_cb));
+                cb_fiber.reset(new Fiber(Task::Invoker{task}, 0, false, m_shared_stack));
             }
-            ft.reset();
             ++m_active_thread_count;
             SYLAR_ASSERT2(cb_fiber->m_cb, "No cb!")
-            cb_fiber->swapIn();
+            Fiber::State state = cb_fiber->swapIn();
             --m_active_thread_count;
 
-            if (cb_fiber->getState() == Fiber::READY) {
-                schedule(cb_fiber);
-            } else if (cb_fiber->getState() == Fiber::TERM
-                || cb_fiber->getState() == Fiber::EXCPT) {
+            if (state == Fiber::READY) {
+                // 该协程还要接着执行，交给调度器之后就不能再复用了
+                schedule(&cb_fiber);
+            } else if (state == Fiber::TERM
+                || state == Fiber::EXCPT) {
                 // 该协程的任务已经结束
                 cb_fiber->reset(nullptr);
             } else {
                 // 该协程任务还没结束，只是被挂起了
-                //SYLAR_LOG_DEBUG(g_logger) << "Change state to HOLD in run, id=" << cb_fiber->getId();
-                cb_fiber->setState(Fiber::HOLD);
                 cb_fiber.reset();
             }
 
@@ -320,6 +508,7 @@ void Scheduler::run()
         }
 
     }
+    t_worker = nullptr;
 
 }
 
@@ -338,15 +527,18 @@ void Scheduler::idle()
 void Scheduler::tickle()
 {
 
+}
+void Scheduler::tickle_worker(Worker *worker)
+{
+    tickle();
 }
 bool Scheduler::stopping()
 {
-    MutexType::Lock lock(m_mutex);
     //SYLAR_LOG_DEBUG(g_logger) << "Scheduler stopping, m_stopping=" << m_stopping
     //    << " m_fibers.size=" << m_fibers.size() << " active_thread_count="
     //    << m_active_thread_count;
     return m_auto_stop && m_stopping
-        && m_fibers.empty()
+        && m_task_count == 0
         && m_active_thread_count == 0;
 }
 
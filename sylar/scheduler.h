@@ -8,13 +8,13 @@
 #include <memory>
 #include <utility>
 #include <vector>
-#include <list>
 #include <string>
 #include <atomic>
-#include <variant>
 
 #include "fiber.h"
 #include "thread.h"
+#include "task.h"
+#include "work_stealing_queue.h"
 
 namespace sylar {
 
@@ -22,6 +22,8 @@ namespace sylar {
     public:
         typedef std::shared_ptr<Scheduler> ptr;
         typedef Mutex MutexType;
+        // 工作线程的本地状态（每个线程一个本地任务队列）
+        struct Worker;
 
         explicit Scheduler(size_t threads = 1, bool use_caller = true,
                   const std::string& name = "");
@@ -35,14 +37,25 @@ namespace sylar {
         void start();
         void stop();
 
+        // 调度器用来执行回调的协程是否使用共享栈（见Fiber的共享栈模式）
+        // 需要在start之前设置
+        void setSharedStack(bool v) { m_shared_stack = v; }
+        bool isSharedStack() const { return m_shared_stack; }
+
         // 单个加入队列
+        // 指定了线程的任务直接放进目标线程的信箱
+        // 本调度器的工作线程加入的任务优先放进自己的本地队列，其他线程加入的放进全局队列
         template<typename Fiber_or_Cb>
         void schedule(Fiber_or_Cb fc, int thread = -1)
         {
-            bool need_tickle = false;
-            {
+            Task *task = Task::Create(std::move(fc), thread);
+            if (!task || push_mailbox(task)) {
+                return;
+            }
+            bool need_tickle = push_local(task);
+            if (!need_tickle) {
                 MutexType::Lock lock(m_mutex);
-                need_tickle = schedule_no_lock(fc, thread);
+                need_tickle = schedule_no_lock(task);
             }
             if (need_tickle) {
                 tickle();
@@ -52,19 +65,20 @@ namespace sylar {
         template<typename Input_Iterator>
         void schedule(Input_Iterator begin, Input_Iterator end)
         {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while (begin != end) {
-                    // 解引用得到元素，再取地址，从而使用第二个构造函数（swap版本）
-                    need_tickle = schedule_no_lock(&*begin) || need_tickle;
-                    ++begin;
+            TaskList tasks;
+            while (begin != end) {
+                // 解引用得到元素，再取地址，从而使用指针版本的构造函数（swap版本）
+                Task *task = Task::Create(&*begin, -1);
+                ++begin;
+                if (task) {
+                    tasks.push_back(task);
                 }
             }
-            if (need_tickle) {
-                tickle();
-            }
+            schedule_tasks(tasks);
         }
+        // 批量加入已经创建好的任务（可以指定线程），全局队列只加一次锁，最多通知一次
+        // 返回时tasks为空
+        void schedule_tasks(TaskList &tasks);
 
     protected:
         virtual void tickle();
@@ -72,94 +86,75 @@ namespace sylar {
         void run();
         virtual bool stopping();
         virtual void idle();
+        // 只通知指定的工作线程，默认退化为tickle()
+        virtual void tickle_worker(Worker *worker);
 
         void setThis();
 
-    private:
-        template<typename Fiber_or_Cb>
-        bool schedule_no_lock(Fiber_or_Cb fc, int thread = -1)
-        {
-            // 若m_fibers为空，说明此时没有协程任务，则插入一个任务并返回true
-            bool need_tickle = m_fibers.empty();
-            Fiber_and_Thread ft(fc, thread);
-            //if (ft.fiber || ft.cb)
-            if (std::holds_alternative<Fiber::ptr>(ft.fiber_or_cb) ||
-                    std::holds_alternative<std::function<void()>>(ft.fiber_or_cb)){
-                m_fibers.push_back(ft);
-            }
-            return need_tickle;
+        // 当前线程在本调度器中对应的工作线程，不是本调度器的线程时返回nullptr
+        Worker *get_this_worker() const;
+        // 是否有该工作线程可以执行的任务（信箱、全局队列、自己或其他线程的本地队列）
+        bool has_task(Worker *worker) const;
 
-        }
+    private:
+        // 放进全局队列，返回是否需要通知其他线程
+        bool schedule_no_lock(Task *task);
+        // 当前线程是本调度器的工作线程并且任务没有指定线程时，放进本地队列
+        bool push_local(Task *task);
+        // 指定了线程的任务放进该线程的信箱并只通知该线程，找不到目标线程时返回false
+        bool push_mailbox(Task *task);
+        // 从信箱中取一个任务
+        Task *take_mailbox(Worker *worker);
+        Worker *find_worker(int thread);
+        // 依次从信箱、本地队列、全局队列、其他线程的本地队列取一个任务
+        Task *take_task(Worker *worker, bool &tickle_me);
+        // 从随机选一个其他线程开始，偷一个任务
+        Task *steal_task(Worker *worker);
 
     public:
         // 获得当前的协程调度器
         static Scheduler* GetThis();
         static Fiber* GetMainFiber();
 
-    private:
-        struct Fiber_and_Thread {
-            // 可以存一个协程，也可以只存一个函数指针
-            std::variant<Fiber::ptr, std::function<void()>> fiber_or_cb;
-//            Fiber::ptr fiber;
-//            std::function<void()> cb;
-            int thread;
-
-            Fiber_and_Thread(Fiber::ptr f, int thr)
-                : fiber_or_cb(std::move(f)), thread(thr)
-            {}
-            // 此处传智能指针的指针的目的是：当我们不需要传入实参的引用时，可以通过swap,
-            // 从而使协程对象的引用计数不发生改变
-            Fiber_and_Thread(Fiber::ptr* f, int thr)
-                : thread(thr)
-            {
-                // 这里可能有点问题，感觉这么写很没必要
-                fiber_or_cb = (Fiber::ptr) nullptr;
-                std::get<0>(fiber_or_cb).swap(*f);
-                //fiber.swap(*f);
-            }
-
-            Fiber_and_Thread(std::function<void()> f, int thr)
-                : fiber_or_cb(std::move(f)), thread(thr)
-            {}
-
-            Fiber_and_Thread(std::function<void()>* f, int thr)
-                : thread(thr)
-            {
-                fiber_or_cb = (std::function<void()>) nullptr;
-                std::get<1>(fiber_or_cb).swap(*f);
-                //cb.swap(*f);
-            }
-            // 定义默认构造函数的原因是：
-            // stl容器初始化非空时，里面的元素都是以默认构造函数构造的
-            Fiber_and_Thread(): thread(-1)
-            {}
-
-            void reset()
-            {
-                fiber_or_cb.emplace<0>(nullptr);
-                fiber_or_cb.emplace<1>(nullptr);
-//                fiber = nullptr;
-//                cb = nullptr;
-                thread = -1;
-            }
+    public:
+        // 每个工作线程一个
+        struct Worker {
+            Scheduler *scheduler = nullptr;
+            int index = -1; // 在m_workers里的下标，临时的工作线程为-1
+            // 本地任务队列，只有本线程从底部取，其他线程从顶部偷
+            WorkStealingQueue<Task *> queue;
+            uint64_t rand_state = 0; // 选择偷取对象用的随机数状态
+            std::atomic<int> thread_id{-1}; // 线程启动之后才知道
+            // 信箱，存放指定在本线程执行的任务，任何线程都可以往里放
+            Spin_Mutex mailbox_mutex;
+            TaskList mailbox;
+            std::atomic<size_t> mailbox_size{0};
+            int wake_fd = -1; // 空闲时睡在这个fd上，由IOManager创建
         };
 
     private:
         MutexType m_mutex;
         // 线程池
         std::vector<Thread::ptr> m_threads;
-        // 协程队列（可以是协程，也可以是函数指针）
-        std::list<Fiber_and_Thread> m_fibers;
+        // 全局协程队列（可以是协程，也可以是函数指针）
+        // 存放其他线程加入的任务、本地队列放不下的任务以及指定的线程还没启动的任务
+        TaskList m_fibers;
+        std::atomic<size_t> m_fibers_size{0}; // 不加锁读取全局队列的长度
+        // 全局队列、所有本地队列和信箱中的任务总数
+        std::atomic<size_t> m_task_count{0};
         std::string m_name;
         Fiber::ptr m_root_fiber; // 创建协程调度器的线程中执行run方法的协程
 
     protected:
+        // 工作线程，构造时就按线程数创建好，运行期间不再改变
+        std::vector<std::unique_ptr<Worker>> m_workers;
         std::vector<int> m_thread_ids;
         size_t m_thread_count = 0; // 协程调度器支配的线程数
         std::atomic<size_t> m_active_thread_count{0};
         std::atomic<size_t> m_idle_thread_count{0};
         bool m_stopping = true;
         bool m_auto_stop = true;
+        bool m_shared_stack = false; // 回调协程是否使用共享栈
         int m_root_thread_id = 0; // 协程调度器所在线程的id
 
     };
@@ -0,0 +1,261 @@
+#include "stack_allocator.h"
+#include "clock.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 使用哪种栈分配器: malloc / mmap
+static ConfigVar<std::string>::ptr g_fiber_stack_allocator =
+    Config::Lookup<std::string>("fiber.stack_allocator", "mmap", "fiber stack allocator(malloc/mmap)");
+
+// 每个线程缓存里驻留的栈的总字节数超过该值后，把最久没用的一批栈MADV_DONTNEED，降到一半
+// 为0时不按字节数限制，只受fiber.stack_cache_count限制
+static ConfigVar<uint64_t>::ptr g_fiber_stack_cache_high_water =
+    Config::Lookup<uint64_t>("fiber.stack_cache_high_water", 64 * 1024 * 1024,
+                             "fiber stack cache high water(bytes per thread, 0 means unlimited)");
+
+// 每个线程每个大小等级最多缓存的栈个数，超过直接munmap
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache_count =
+    Config::Lookup<uint32_t>("fiber.stack_cache_count", 256, "fiber stack cache count(per size class per thread)");
+
+// 配置项的读取要加读锁，分配栈又是热路径，所以缓存一份，由监听器来更新
+static std::atomic<StackAllocator *> s_default_allocator{nullptr};
+static std::atomic<uint64_t> s_cache_high_water{0};
+static std::atomic<uint32_t> s_cache_count{0};
+
+void *MallocStackAllocator::alloc(size_t size)
+{
+    return malloc(size);
+}
+
+void MallocStackAllocator::dealloc(void *vp, size_t size)
+{
+    free(vp);
+}
+
+static size_t Page_size()
+{
+    static size_t s_page_size = sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+// 大小等级的个数：第i级的栈大小为2^i字节
+static const size_t SIZE_CLASS_COUNT = 48;
+
+static size_t Size_class(size_t rounded_size)
+{
+    return 63 - __builtin_clzll(rounded_size);
+}
+
+// 缓存里的栈地址是页对齐的，用最低位标记该栈是否已经MADV_DONTNEED过
+static const uintptr_t STACK_RELEASED = 0x1;
+
+// 每个线程独占的栈缓存，不需要加锁
+struct StackCache {
+    std::vector<uintptr_t> free_lists[SIZE_CLASS_COUNT];
+    size_t cached_bytes = 0; // 缓存中仍然驻留在物理内存里的字节数
+    size_t cached_count = 0;
+    uint64_t last_trim_ms = 0; // 上次整理的时间
+    // 析构之后还可能有协程被释放（比如在更晚析构的thread_local里），之后的栈不再进缓存
+    bool exited = false;
+
+    ~StackCache()
+    {
+        for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i) {
+            for (auto entry : free_lists[i]) {
+                char *vp = (char *) (entry & ~STACK_RELEASED);
+                munmap(vp - Page_size(), ((size_t) 1 << i) + Page_size());
+            }
+            free_lists[i].clear();
+        }
+        cached_bytes = 0;
+        cached_count = 0;
+        exited = true;
+    }
+};
+
+static thread_local StackCache t_stack_cache;
+
+// 两次整理至少间隔多久：同时存活的协程比高水位多时，每次都整理会让刚还回来的栈马上又缺页
+static const uint64_t TRIM_INTERVAL_MS = 1000;
+
+// 超过高水位后一次把驻留的字节数降到target以下，不用每次归还都madvise
+// 分配从列表末尾取，所以从列表头开始放，最近归还、马上会被复用的栈保持驻留
+static void Trim_cache(StackCache &cache, size_t target)
+{
+    for (size_t i = 0; i < SIZE_CLASS_COUNT && cache.cached_bytes > target; ++i) {
+        size_t size = (size_t) 1 << i;
+        for (auto &entry : cache.free_lists[i]) {
+            if (cache.cached_bytes <= target) {
+                break;
+            }
+            if (!(entry & STACK_RELEASED)) {
+                madvise((void *) entry, size, MADV_DONTNEED);
+                entry |= STACK_RELEASED;
+                cache.cached_bytes -= size;
+            }
+        }
+    }
+}
+
+// 超过高水位并且离上次整理已经过了TRIM_INTERVAL_MS才整理
+static void Maybe_trim(StackCache &cache)
+{
+    uint64_t high_water = s_cache_high_water;
+    if (!high_water || cache.cached_bytes <= high_water) {
+        return;
+    }
+    uint64_t now = Clock::NowMs();
+    if (now - cache.last_trim_ms < TRIM_INTERVAL_MS) {
+        return;
+    }
+    cache.last_trim_ms = now;
+    Trim_cache(cache, high_water / 2);
+}
+
+size_t MmapStackAllocator::RoundSize(size_t size)
+{
+    size_t page = Page_size();
+    size = (size + page - 1) & ~(page - 1);
+    if (size & (size - 1)) {
+        // 不是2的幂则向上取整
+        size = (size_t) 1 << (64 - __builtin_clzll(size));
+    }
+    return size;
+}
+
+size_t MmapStackAllocator::CachedCount()
+{
+    return t_stack_cache.cached_count;
+}
+
+void *MmapStackAllocator::alloc(size_t size)
+{
+    size = RoundSize(size);
+    size_t cls = Size_class(size);
+    SYLAR_ASSERT(cls < SIZE_CLASS_COUNT)
+
+    auto &cache = t_stack_cache;
+    auto &list = cache.free_lists[cls];
+    if (!cache.exited && !list.empty()) {
+        uintptr_t entry = list.back();
+        list.pop_back();
+        --cache.cached_count;
+        if (!(entry & STACK_RELEASED)) {
+            cache.cached_bytes -= size;
+        }
+        return (void *) (entry & ~STACK_RELEASED);
+    }
+
+    // 缓存里没有，则新映射一块，低地址处多留一个保护页
+    size_t page = Page_size();
+    void *base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "mmap stack failed, size=" << size
+                                  << " errno=" << errno << " " << strerror(errno);
+        return nullptr;
+    }
+    if (mprotect(base, page, PROT_NONE)) {
+        // 没有保护页的栈溢出时会悄悄踩坏别的内存，宁可分配失败
+        SYLAR_LOG_ERROR(g_logger) << "mprotect guard page failed, errno=" << errno
+                                  << " " << strerror(errno);
+        munmap(base, size + page);
+        return nullptr;
+    }
+    return (char *) base + page;
+}
+
+void MmapStackAllocator::dealloc(void *vp, size_t size)
+{
+    if (!vp) {
+        return;
+    }
+    size = RoundSize(size);
+    size_t cls = Size_class(size);
+    auto &cache = t_stack_cache;
+    auto &list = cache.free_lists[cls];
+
+    if (cache.exited || list.size() >= s_cache_count) {
+        // 线程的缓存已经析构或者该等级缓存已满，直接还给内核
+        munmap((char *) vp - Page_size(), size + Page_size());
+        return;
+    }
+    list.push_back((uintptr_t) vp);
+    ++cache.cached_count;
+    cache.cached_bytes += size;
+    Maybe_trim(cache);
+}
+
+void MmapStackAllocator::Trim()
+{
+    auto &cache = t_stack_cache;
+    if (!cache.exited) {
+        Maybe_trim(cache);
+    }
+}
+
+StackAllocator *StackAllocator::GetByName(const std::string &name)
+{
+    static MallocStackAllocator s_malloc_allocator;
+    static MmapStackAllocator s_mmap_allocator;
+    if (name == "malloc") {
+        return &s_malloc_allocator;
+    }
+    if (name == "mmap") {
+        return &s_mmap_allocator;
+    }
+    return nullptr;
+}
+
+StackAllocator *StackAllocator::GetDefault()
+{
+    StackAllocator *allocator = s_default_allocator;
+    // 静态初始化期间配置还没有读进来
+    return allocator ? allocator : GetByName("mmap");
+}
+
+static void Set_default_allocator(const std::string &name)
+{
+    StackAllocator *allocator = StackAllocator::GetByName(name);
+    if (!allocator) {
+        SYLAR_LOG_ERROR(g_logger) << "Invalid fiber.stack_allocator: " << name
+                                  << ", use mmap instead";
+        allocator = StackAllocator::GetByName("mmap");
+    }
+    s_default_allocator = allocator;
+}
+
+// 同hook.cc，在main函数之前初始化缓存的配置并注册监听器
+struct _Stack_allocator_initer {
+    _Stack_allocator_initer()
+    {
+        Set_default_allocator(g_fiber_stack_allocator->getValue());
+        s_cache_high_water = g_fiber_stack_cache_high_water->getValue();
+        s_cache_count = g_fiber_stack_cache_count->getValue();
+
+        g_fiber_stack_allocator->addListener([](const std::string &old_value, const std::string &new_value) {
+            SYLAR_LOG_INFO(g_logger) << "Fiber stack allocator changed from "
+                                     << old_value << " to " << new_value;
+            Set_default_allocator(new_value);
+        });
+        g_fiber_stack_cache_high_water->addListener([](const uint64_t &old_value, const uint64_t &new_value) {
+            s_cache_high_water = new_value;
+        });
+        g_fiber_stack_cache_count->addListener([](const uint32_t &old_value, const uint32_t &new_value) {
+            s_cache_count = new_value;
+        });
+    }
+};
+static _Stack_allocator_initer s_stack_allocator_initer;
+
+}
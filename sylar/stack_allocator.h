@@ -0,0 +1,59 @@
+#ifndef __SYLAR_STACK_ALLOCATOR_H__
+#define __SYLAR_STACK_ALLOCATOR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sylar {
+
+// 协程栈分配器接口
+class StackAllocator {
+public:
+    virtual ~StackAllocator() = default;
+
+    // 分配一块至少size字节的栈空间，返回栈的低地址
+    virtual void *alloc(size_t size) = 0;
+    // 归还栈空间，size必须与alloc时一致
+    virtual void dealloc(void *vp, size_t size) = 0;
+
+    virtual const char *getName() const = 0;
+
+public:
+    // 按配置项fiber.stack_allocator返回对应的分配器
+    static StackAllocator *GetDefault();
+    // 按名字查找分配器("malloc" / "mmap")，找不到返回nullptr
+    static StackAllocator *GetByName(const std::string &name);
+};
+
+// 以malloc的方式分配栈空间（原来的实现）
+class MallocStackAllocator : public StackAllocator {
+public:
+    void *alloc(size_t size) override;
+    void dealloc(void *vp, size_t size) override;
+    const char *getName() const override { return "malloc"; }
+};
+
+// 以mmap的方式分配栈空间
+// 1. 每个栈的低地址处有一个PROT_NONE的保护页，栈溢出时直接段错误而不是悄悄踩坏别的内存
+// 2. 每个线程按大小等级缓存归还的栈，下次分配直接复用，不用再走mmap/munmap
+// 3. 线程缓存里驻留的字节数超过高水位(fiber.stack_cache_high_water)后，
+//    一次把最久没用的一批栈用MADV_DONTNEED还给内核，降到高水位的一半，只保留虚拟地址
+//    整理最多每秒一次，归还栈的时候和IOManager空闲的时候检查
+class MmapStackAllocator : public StackAllocator {
+public:
+    void *alloc(size_t size) override;
+    void dealloc(void *vp, size_t size) override;
+    const char *getName() const override { return "mmap"; }
+
+    // 栈实际占用的映射大小(不含保护页)，按大小等级向上取整
+    static size_t RoundSize(size_t size);
+    // 当前线程缓存的栈数目
+    static size_t CachedCount();
+    // 当前线程的缓存超过高水位的话整理一次，线程空闲时调用，突发之后的栈不会一直驻留
+    static void Trim();
+};
+
+}
+
+#endif
@@ -3,12 +3,15 @@
 
 #include "sylar/config.h"
 #include "sylar/log.h"
+#include "sylar/async_log.h"
+#include "sylar/binlog.h"
 #include "sylar/thread.h"
 #include "sylar/util.h"
 #include "sylar/singleton.h"
 #include "sylar/fiber.h"
 #include "sylar/scheduler.h"
 #include "sylar/iomanager.h"
+#include "sylar/reactor_group.h"
 #include "sylar/hook.h"
 
 
@@ -0,0 +1,116 @@
+#include "task.h"
+
+namespace sylar {
+
+namespace {
+
+// 空闲节点，直接复用任务节点的内存
+struct FreeTaskNode {
+    FreeTaskNode *next;
+    FreeTaskNode *next_batch; // 全局缓存中下一批
+    size_t batch_size;    // 只有每批的第一个节点有效
+};
+
+static_assert(sizeof(FreeTaskNode) <= sizeof(Task), "task node too small");
+
+// 每个线程最多缓存多少个节点，超过之后把一批还给全局缓存
+const size_t LOCAL_CACHE_MAX = 256;
+const size_t BATCH_SIZE = 128;
+
+// 全局缓存，节点以批为单位进出，减少加锁次数
+// 生产者线程和消费者线程不是同一个时，节点通过这里回到生产者线程
+struct GlobalCache {
+    Spin_Mutex mutex;
+    FreeTaskNode *batches = nullptr;
+};
+
+GlobalCache &GetGlobalCache()
+{
+    // 进程退出之前节点一直留在缓存里，故意不析构
+    static GlobalCache *cache = new GlobalCache;
+    return *cache;
+}
+
+void PushBatch(FreeTaskNode *batch, size_t size)
+{
+    batch->batch_size = size;
+    GlobalCache &global = GetGlobalCache();
+    Spin_Mutex::Lock lock(global.mutex);
+    batch->next_batch = global.batches;
+    global.batches = batch;
+}
+
+struct LocalCache {
+    FreeTaskNode *head = nullptr;
+    size_t count = 0;
+    bool exited = false;
+
+    // 线程退出时把本线程缓存的节点都还给全局缓存
+    ~LocalCache()
+    {
+        if (head) {
+            PushBatch(head, count);
+        }
+        head = nullptr;
+        count = 0;
+        exited = true;
+    }
+};
+
+thread_local LocalCache t_cache;
+
+}
+
+void *Task::AllocNode()
+{
+    LocalCache &cache = t_cache;
+    if (cache.exited) {
+        // 线程的缓存已经析构，从全局缓存拿一批过来就再也还不回去了
+        return ::operator new(sizeof(Task));
+    }
+    if (!cache.head) {
+        GlobalCache &global = GetGlobalCache();
+        Spin_Mutex::Lock lock(global.mutex);
+        if (global.batches) {
+            FreeTaskNode *batch = global.batches;
+            global.batches = batch->next_batch;
+            cache.head = batch;
+            cache.count = batch->batch_size;
+        }
+    }
+    if (!cache.head) {
+        return ::operator new(sizeof(Task));
+    }
+    FreeTaskNode *node = cache.head;
+    cache.head = node->next;
+    --cache.count;
+    return node;
+}
+
+void Task::FreeNode(void *ptr)
+{
+    LocalCache &cache = t_cache;
+    if (cache.exited) {
+        ::operator delete(ptr);
+        return;
+    }
+    auto *node = (FreeTaskNode *) ptr;
+    node->next = cache.head;
+    cache.head = node;
+    ++cache.count;
+
+    if (cache.count >= LOCAL_CACHE_MAX) {
+        // 摘下前面一批还给全局缓存
+        FreeTaskNode *batch = cache.head;
+        FreeTaskNode *last = batch;
+        for (size_t i = 1; i < BATCH_SIZE; ++i) {
+            last = last->next;
+        }
+        cache.head = last->next;
+        cache.count -= BATCH_SIZE;
+        last->next = nullptr;
+        PushBatch(batch, BATCH_SIZE);
+    }
+}
+
+}
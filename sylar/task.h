@@ -0,0 +1,258 @@
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "fiber.h"
+
+namespace sylar {
+
+// 调度器中的一个任务：一个协程，或者一个可调用对象
+// 可调用对象不超过INLINE_SIZE时直接存在任务内部，不走堆分配
+// 任务本身带next指针，可以直接挂在TaskList上，节点从TaskPool里取
+class Task {
+public:
+    static const size_t INLINE_SIZE = 64;
+
+    Task() = default;
+
+    Task(Fiber::ptr f, int thr)
+        : m_fiber(std::move(f)), thread(thr)
+    {
+        pin_shared_stack();
+    }
+    // 传指针时把实参的内容换出来，这样协程对象的引用计数不发生改变
+    Task(Fiber::ptr *f, int thr)
+        : thread(thr)
+    {
+        m_fiber.swap(*f);
+        pin_shared_stack();
+    }
+    Task(std::function<void()> *f, int thr)
+        : thread(thr)
+    {
+        if (*f) {
+            emplace(std::move(*f));
+            *f = nullptr;
+        }
+    }
+    template<typename F, typename D = typename std::decay<F>::type,
+             typename = typename std::enable_if<
+                 !std::is_same<D, Task>::value
+                 && !std::is_same<D, Fiber::ptr>::value
+                 && !std::is_pointer<D>::value>::type>
+    Task(F &&f, int thr)
+        : thread(thr)
+    {
+        if constexpr (std::is_same<D, std::function<void()>>::value) {
+            if (!f) {
+                return;
+            }
+        }
+        emplace(std::forward<F>(f));
+    }
+    // 普通函数指针
+    Task(void (*f)(), int thr)
+        : thread(thr)
+    {
+        if (f) {
+            emplace(f);
+        }
+    }
+
+    Task(Task &&other) noexcept
+    {
+        *this = std::move(other);
+    }
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            m_fiber = std::move(other.m_fiber);
+            if (other.m_ops) {
+                other.m_ops->move(other.m_storage, m_storage);
+                m_ops = other.m_ops;
+                other.m_ops = nullptr;
+            }
+            thread = other.thread;
+            other.thread = -1;
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    // 是否真的有协程或者回调
+    bool valid() const { return m_fiber || m_ops; }
+    bool isFiber() const { return (bool) m_fiber; }
+    Fiber::ptr &getFiber() { return m_fiber; }
+
+    // 执行回调
+    void operator()() { m_ops->invoke(m_storage); }
+
+    void reset()
+    {
+        m_fiber.reset();
+        if (m_ops) {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+        thread = -1;
+    }
+
+    // 从当前线程的缓存中取一个节点构造任务，没有协程或回调时返回nullptr
+    template<typename Fiber_or_Cb>
+    static Task *Create(Fiber_or_Cb &&fc, int thr)
+    {
+        Task *task = new (AllocNode()) Task(std::forward<Fiber_or_Cb>(fc), thr);
+        if (!task->valid()) {
+            Destroy(task);
+            return nullptr;
+        }
+        return task;
+    }
+    // 析构任务并把节点还回缓存（可以在任意线程调用）
+    static void Destroy(Task *task)
+    {
+        task->~Task();
+        FreeNode(task);
+    }
+
+    // 把任务包装成std::function，执行完之后自动销毁任务
+    // 只有一个指针大小，std::function可以直接存在内部而不用分配
+    struct Invoker {
+        Task *task;
+        void operator()() const
+        {
+            struct Guard {
+                Task *task;
+                ~Guard() { Destroy(task); }
+            } guard{task};
+            (*task)();
+        }
+    };
+
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        void (*move)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    template<typename F, bool INLINE>
+    struct OpsImpl;
+
+    // 小对象直接放在m_storage里
+    template<typename F>
+    struct OpsImpl<F, true> {
+        static void invoke(void *storage) { (*(F *) storage)(); }
+        static void move(void *from, void *to)
+        {
+            new (to) F(std::move(*(F *) from));
+            ((F *) from)->~F();
+        }
+        static void destroy(void *storage) { ((F *) storage)->~F(); }
+        static constexpr Ops ops{&invoke, &move, &destroy};
+    };
+    // 大对象放到堆上，m_storage里只存指针
+    template<typename F>
+    struct OpsImpl<F, false> {
+        static void invoke(void *storage) { (**(F **) storage)(); }
+        static void move(void *from, void *to) { *(F **) to = *(F **) from; }
+        static void destroy(void *storage) { delete *(F **) storage; }
+        static constexpr Ops ops{&invoke, &move, &destroy};
+    };
+
+    template<typename F>
+    void emplace(F &&f)
+    {
+        typedef typename std::decay<F>::type D;
+        const bool is_inline = sizeof(D) <= INLINE_SIZE
+            && alignof(D) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<D>::value;
+        if constexpr (is_inline) {
+            new (m_storage) D(std::forward<F>(f));
+        } else {
+            *(D **) m_storage = new D(std::forward<F>(f));
+        }
+        m_ops = &OpsImpl<D, is_inline>::ops;
+    }
+
+    void pin_shared_stack()
+    {
+        // 共享栈协程绑定了线程，没有指定线程时只能回到绑定的线程执行
+        if (thread == -1 && m_fiber && m_fiber->isSharedStack()) {
+            thread = m_fiber->getStackThread();
+        }
+    }
+
+    static void *AllocNode();
+    static void FreeNode(void *node);
+
+private:
+    alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+    const Ops *m_ops = nullptr;
+    Fiber::ptr m_fiber;
+
+public:
+    int thread = -1;
+    // 侵入式队列的下一个节点
+    Task *next = nullptr;
+};
+
+// 侵入式的单向任务队列，不加锁，由使用者保护
+class TaskList {
+public:
+    bool empty() const { return m_head == nullptr; }
+    size_t size() const { return m_size; }
+    Task *front() const { return m_head; }
+
+    void push_back(Task *task)
+    {
+        task->next = nullptr;
+        if (m_tail) {
+            m_tail->next = task;
+        } else {
+            m_head = task;
+        }
+        m_tail = task;
+        ++m_size;
+    }
+
+    // 删除prev之后的那个节点（prev为nullptr表示删除头节点），返回被删除的节点
+    Task *erase_after(Task *prev)
+    {
+        Task *task = prev ? prev->next : m_head;
+        if (!task) {
+            return nullptr;
+        }
+        if (prev) {
+            prev->next = task->next;
+        } else {
+            m_head = task->next;
+        }
+        if (m_tail == task) {
+            m_tail = prev;
+        }
+        task->next = nullptr;
+        --m_size;
+        return task;
+    }
+
+    Task *pop_front() { return erase_after(nullptr); }
+
+private:
+    Task *m_head = nullptr;
+    Task *m_tail = nullptr;
+    size_t m_size = 0;
+};
+
+}
+
+#endif
@@ -1,6 +1,8 @@
 #include "timer.h"
-#include "util.h"
+#include "timer_wheel.h"
+#include "clock.h"
 #include "log.h"
+#include "macro.h"
 
 #include <utility>
 
@@ -8,6 +10,23 @@ namespace sylar {
 
 static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+// 在[deadline, deadline + slack]里找一个尽量整的时间点：
+// 按不超过slack的最大的2的幂向上取整，slack相近的定时器就会落在同一个时间点上
+static uint64_t coalesce(uint64_t deadline, uint64_t slack)
+{
+    if (slack == 0) {
+        return deadline;
+    }
+    uint64_t granularity = 1ull << (63 - __builtin_clzll(slack));
+    return (deadline + granularity - 1) & ~(granularity - 1);
+}
+
+static uint64_t to_us(std::chrono::microseconds duration)
+{
+    // 负的时间当作0
+    return duration.count() > 0 ? duration.count() : 0;
+}
+
 bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const
 {
     if (!lhs && !rhs) {
@@ -28,95 +47,281 @@ bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs)
     // 否则比较地址
     return lhs.get() < rhs.get();
 }
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager)
+Timer::Timer(uint64_t us, uint64_t slack, std::function<void()> cb, bool recurring,
+             TimerManager *manager)
     : m_recurring(recurring),
-      m_ms(ms),
+      m_us(us),
+      m_slack(slack),
       m_cb(std::move(cb)),
       m_manager(manager)
 {
-    m_next = Get_current_ms() + m_ms;
+    // 到期时间从现取的时间算，缓存的时间落后了这一轮已经跑过的任务，用它会让定时器提前触发
+    m_next = coalesce(Clock::NowUs() + m_us, m_slack);
 }
 
 Timer::Timer(uint64_t next_time)
-    : m_next(next_time) {}
+{
+    m_next = next_time;
+}
 
 bool Timer::cancel()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (m_cb) {
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it != m_manager->m_timers.end()) {
-            m_manager->m_timers.erase(it);
-        }
+    bool active = true;
+    if (!m_active.compare_exchange_strong(active, false)) {
+        // 已经触发过或者被取消过了
+        return false;
+    }
+    TimerManager::Shard &shard = *m_manager->m_shards[m_shard];
+    --shard.count;
+    if (m_manager->current_shard() != m_shard) {
+        // 不是自己的分片，让负责的线程去删，到那之前触发时会被跳过
+        m_manager->post_message(m_shard, {TimerManager::TimerMessage::CANCEL, shared_from_this()}, false);
         return true;
     }
-    return false;
+    m_manager->erase_timer(shard, this);
+    m_cb = nullptr;
+    return true;
 }
 
 bool Timer::refresh()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (!m_cb) {
+    if (!m_active) {
         return false;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if (it == m_manager->m_timers.end()) {
+    if (m_manager->current_shard() != m_shard) {
+        m_manager->post_message(m_shard, {TimerManager::TimerMessage::REFRESH, shared_from_this()}, false);
+        return true;
+    }
+    return m_manager->refresh_timer(*m_manager->m_shards[m_shard], shared_from_this());
+}
+
+bool Timer::reset(std::chrono::microseconds period, bool from_now)
+{
+    if (!m_active) {
+        return false;
+    }
+    uint64_t us = to_us(period);
+    if (m_manager->current_shard() != m_shard) {
+        // 可能变得更早，要通知负责的线程
+        TimerManager::TimerMessage msg{TimerManager::TimerMessage::RESET, shared_from_this()};
+        msg.us = us;
+        msg.from_now = from_now;
+        m_manager->post_message(m_shard, std::move(msg), true);
+        return true;
+    }
+    return m_manager->reset_timer(*m_manager->m_shards[m_shard], shared_from_this(), us, from_now);
+}
+
+TimerManager::TimerManager(Engine engine, size_t shards)
+    : m_engine(engine)
+{
+    if (shards == 0) {
+        shards = 1;
+    }
+    uint64_t now_us = Clock::NowUs();
+    for (size_t i = 0; i < shards; ++i) {
+        m_shards.emplace_back(new Shard);
+        if (m_engine == WHEEL) {
+            m_shards.back()->wheel.reset(new TimerWheel(now_us));
+        }
+    }
+}
+
+TimerManager::~TimerManager() = default;
+
+TimerManager::Engine TimerManager::EngineFromName(const std::string &name)
+{
+    if (name == "wheel") {
+        return WHEEL;
+    }
+    if (name != "set") {
+        SYLAR_LOG_ERROR(g_logger) << "unknown timer engine: " << name << ", use set";
+    }
+    return SET;
+}
+
+int TimerManager::select_shard()
+{
+    return (int) (m_next_shard++ % m_shards.size());
+}
+
+bool TimerManager::has_timer()
+{
+    for (auto &shard : m_shards) {
+        if (shard->count > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TimerManager::has_timer_message(int shard)
+{
+    return m_shards[shard]->inbox_size > 0;
+}
+
+void TimerManager::insert_timer(Shard &shard, const Timer::ptr &timer)
+{
+    if (m_engine == WHEEL) {
+        shard.wheel->insert(timer);
+    } else {
+        shard.timers.insert(timer);
+    }
+}
+
+bool TimerManager::erase_timer(Shard &shard, Timer *timer)
+{
+    if (m_engine == WHEEL) {
+        return shard.wheel->remove(timer);
+    }
+    auto it = shard.timers.find(timer->shared_from_this());
+    if (it == shard.timers.end()) {
         return false;
     }
+    shard.timers.erase(it);
+    return true;
+}
+
+void TimerManager::take_expired(Shard &shard, uint64_t now_us, std::vector<Timer::ptr> &expired,
+                                TimerNode *&nodes)
+{
+    if (m_engine == WHEEL) {
+        shard.wheel->advance(now_us, expired, nodes);
+        return;
+    }
+    if (shard.timers.empty() || (*shard.timers.begin())->m_next > now_us) {
+        // 说明所有的计时器的执行时间都没到
+        return;
+    }
+    Timer::ptr now_timer(new Timer(now_us));
+    // 找出第一个执行时间大于当前时刻的timer
+    auto it = shard.timers.upper_bound(now_timer);
+    expired.insert(expired.end(), shard.timers.begin(), it);
+    shard.timers.erase(shard.timers.begin(), it);
+}
+
+bool TimerManager::refresh_timer(Shard &shard, const Timer::ptr &timer)
+{
     // 先删，再添加，因为set的迭代器是const的，直接修改会影响数据结构
-    m_manager->m_timers.erase(it);
-    m_next = Get_current_ms() + m_ms;
-    m_manager->add_timer(shared_from_this(), lock);
-    //m_manager->m_timers.insert(shared_from_this());
+    if (!timer->m_active || !erase_timer(shard, timer.get())) {
+        return false;
+    }
+    timer->m_next = coalesce(Clock::NowUs() + timer->m_us, timer->m_slack);
+    insert_timer(shard, timer);
     return true;
 }
 
-bool Timer::reset(uint64_t ms, bool from_now)
+bool TimerManager::reset_timer(Shard &shard, const Timer::ptr &timer, uint64_t us, bool from_now)
 {
-    if (ms == m_ms && !from_now) {
+    if (us == timer->m_us && !from_now) {
         // 如果执行周期一样并且不需要从当前开始改变
         return true;
     }
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if (it == m_manager->m_timers.end()) {
+    if (!timer->m_active || !erase_timer(shard, timer.get())) {
         return false;
     }
-    m_manager->m_timers.erase(shared_from_this());
     if (from_now) {
-        m_next = Get_current_ms() + ms;
+        timer->m_next = coalesce(Clock::NowUs() + us, timer->m_slack);
     } else {
         // 否则先求出当初添加time时的时间点，再加上新的执行周期
-        m_next = m_next - m_ms + ms;
+        // 有slack时m_next是合并之后的，求出的起点最多晚一个slack
+        timer->m_next = coalesce(timer->m_next - timer->m_us + us, timer->m_slack);
     }
-    m_ms = ms;
-    m_manager->add_timer(shared_from_this(), lock);
-    //m_manager->m_timers.insert(shared_from_this());
+    timer->m_us = us;
+    insert_timer(shard, timer);
     return true;
 }
 
-Timer::ptr TimerManager::add_timer(Timer::ptr timer, RWMutexType::WriteLock &lock)
+void TimerManager::handle_messages(Shard &shard)
 {
-    //RWMutexType::WriteLock lock(m_mutex);
-    SYLAR_LOG_DEBUG(g_logger) << "m_timers.size=" << m_timers.size();
-    auto it = m_timers.insert(timer).first;
-    bool at_front = (it == m_timers.begin());
-    lock.unlock();
+    if (shard.inbox_size == 0) {
+        return;
+    }
+    {
+        Spin_Mutex::Lock lock(shard.inbox_mutex);
+        shard.processing.swap(shard.inbox);
+        shard.inbox_size = 0;
+    }
+    for (auto &msg : shard.processing) {
+        const Timer::ptr &timer = msg.timer;
+        switch (msg.type) {
+            case TimerMessage::ADD:
+                if (timer->m_active) {
+                    insert_timer(shard, timer);
+                }
+                break;
+            case TimerMessage::CANCEL:
+                erase_timer(shard, timer.get());
+                timer->m_cb = nullptr;
+                break;
+            case TimerMessage::REFRESH:
+                refresh_timer(shard, timer);
+                break;
+            case TimerMessage::RESET:
+                reset_timer(shard, timer, msg.us, msg.from_now);
+                break;
+        }
+    }
+    shard.processing.clear();
+}
+
+void TimerManager::post_message(int shard, TimerMessage msg, bool notify)
+{
+    {
+        Spin_Mutex::Lock lock(m_shards[shard]->inbox_mutex);
+        m_shards[shard]->inbox.push_back(std::move(msg));
+        ++m_shards[shard]->inbox_size;
+    }
+    if (notify) {
+        on_timer_insert_at_front(shard);
+    }
+}
 
-    if (at_front) {
-        SYLAR_LOG_DEBUG(g_logger) << "Insert a timer at front.";
-        on_timer_insert_at_front();
+Timer::ptr TimerManager::add_timer(std::chrono::microseconds period, std::function<void()> cb,
+                                   bool recurring, std::chrono::microseconds slack)
+{
+    Timer::ptr timer(new Timer(to_us(period), to_us(slack), std::move(cb), recurring, this));
+    int shard = current_shard();
+    if (shard >= 0) {
+        // 自己的分片：当前线程醒着，回到idle时会重新算超时时间，不用通知
+        timer->m_shard = shard;
+        ++m_shards[shard]->count;
+        insert_timer(*m_shards[shard], timer);
+        return timer;
     }
+    shard = select_shard();
+    timer->m_shard = shard;
+    ++m_shards[shard]->count;
+    post_message(shard, {TimerMessage::ADD, timer}, true);
     return timer; // 把新添加的timer返回出去，以防需要做进一步操作
 }
 
-Timer::ptr TimerManager::add_timer(uint64_t ms, std::function<void()> cb, bool recurring)
+bool TimerManager::add_timer_node(TimerNode *node, std::chrono::microseconds timeout,
+                                  TimerNode::Callback cb, std::chrono::microseconds slack)
 {
-    Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
-    return add_timer(timer, lock);
+    int shard = current_shard();
+    if (shard < 0 || m_engine != WHEEL) {
+        return false;
+    }
+    SYLAR_ASSERT(!node->is_pending())
+    node->m_next = coalesce(Clock::NowUs() + to_us(timeout), to_us(slack));
+    node->m_shard = shard;
+    node->m_fire = cb;
+    ++m_shards[shard]->count;
+    m_shards[shard]->wheel->insert(node);
+    return true;
+}
+
+bool TimerManager::cancel_timer_node(TimerNode *node)
+{
+    if (!node->is_pending()) {
+        return false;
+    }
+    SYLAR_ASSERT(current_shard() == node->m_shard)
+    Shard &shard = *m_shards[node->m_shard];
+    shard.wheel->remove(node);
+    --shard.count;
+    return true;
 }
 
 // 该函数将cb封装起来
@@ -129,91 +334,94 @@ static void Cond_cb(const std::weak_ptr<void> &weak_con, const std::function<voi
     }
 }
 
-Timer::ptr TimerManager::add_condition_timer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond,
-                                             bool recurring)
+Timer::ptr TimerManager::add_condition_timer(std::chrono::microseconds period, std::function<void()> cb,
+                                             std::weak_ptr<void> weak_cond, bool recurring,
+                                             std::chrono::microseconds slack)
 {
-    return add_timer(ms, std::bind(&Cond_cb, weak_cond, cb), recurring);
+    return add_timer(period, std::bind(&Cond_cb, weak_cond, cb), recurring, slack);
 }
 
 uint64_t TimerManager::get_next_timeout()
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_timers.empty()) {
+    uint64_t us = get_next_timeout_us();
+    return us == ~0ull ? ~0ull : (us + 999) / 1000;
+}
+
+uint64_t TimerManager::get_next_timeout_us()
+{
+    int index = current_shard();
+    if (index < 0) {
+        return ~0ull;
+    }
+    Shard &shard = *m_shards[index];
+    handle_messages(shard);
+    uint64_t next;
+    if (m_engine == WHEEL) {
+        // 时间轮给出的可能比真正的到期时间早，早醒一次没有关系
+        next = shard.wheel->next_expire();
+    } else {
+        next = shard.timers.empty() ? ~0ull : (*shard.timers.begin())->m_next;
+    }
+    if (next == ~0ull) {
         return ~0ull; // 返回最大时间
     }
 
-    const Timer::ptr &next = *m_timers.begin();
-    uint64_t now_ms = Get_current_ms();
-    if (now_ms >= next->m_next) {
+    uint64_t now_us = Clock::CachedUs();
+    if (now_us >= next) {
         // 当前时间已经超过了执行时间
         return 0;
     } else {
-        return next->m_next - now_ms;
+        return next - now_us;
     }
 }
 
 void TimerManager::list_expired_cbs(std::vector<std::function<void()>> &cbs)
 {
-    //SYLAR_LOG_DEBUG(g_logger) << "Get into list_expired_cbs.";
-    uint64_t now_ms = Get_current_ms();
+    int index = current_shard();
+    if (index < 0) {
+        return;
+    }
+    Shard &shard = *m_shards[index];
+    handle_messages(shard);
+
+    uint64_t now_us = Clock::CachedUs();
     std::vector<Timer::ptr> expired_timers;
-    {
-        //SYLAR_LOG_DEBUG(g_logger) << "list expired cbs: before getting the lock";
-        RWMutexType::ReadLock lock(m_mutex);
-        //SYLAR_LOG_DEBUG(g_logger) << "list expired cbs: after getting the lock";
-        if (m_timers.empty()) {
-            return;
-        }
+    TimerNode *nodes = nullptr;
+    take_expired(shard, now_us, expired_timers, nodes);
+    while (nodes) {
+        // 回调里可能重新添加这个节点，先把下一个取出来
+        TimerNode *node = nodes;
+        nodes = node->m_wheel_next;
+        node->m_wheel_next = nullptr;
+        --shard.count;
+        node->m_fire(node);
     }
-    //SYLAR_LOG_DEBUG(g_logger) << "list expired cbs: before getting the lock";
-    RWMutexType::WriteLock lock(m_mutex);
-    //SYLAR_LOG_DEBUG(g_logger) << "list expired cbs: after getting the lock";
-    if ((*m_timers.begin())->m_next > now_ms) {
-        // 说明所有的计时器的执行时间都没到
-        //SYLAR_LOG_DEBUG(g_logger) << "No timer is ready to call!";
+    if (expired_timers.empty()) {
         return;
     }
-    Timer::ptr now_timer(new Timer(now_ms));
-    // 找出第一个执行时间大于当前时刻的timer
-    auto it = m_timers.upper_bound(now_timer);
-//        if (it == m_timers.begin()) {
-//            return;
-//        }
-
-    if (it == m_timers.begin()) {
-        // 说明只有一个，或者m_timers就只有一个元素
-        expired_timers.insert(expired_timers.begin(), *it);
-        m_timers.erase(it);
-    } else {
-        expired_timers.insert(expired_timers.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
-    }
     // 扩容
-    cbs.reserve(expired_timers.size());
+    cbs.reserve(cbs.size() + expired_timers.size());
 
     for (auto &timer : expired_timers) {
-        //SYLAR_LOG_DEBUG(g_logger) << "Add one expired timer.";
-        cbs.push_back(timer->m_cb);
         if (timer->m_recurring) {
+            if (!timer->m_active) {
+                // 被别的线程取消了，消息还没处理
+                timer->m_cb = nullptr;
+                continue;
+            }
             // 如果是循环计时器,则重新放回去
-            //SYLAR_LOG_DEBUG(g_logger) << "A recurring timer is added again.";
-            timer->m_next = now_ms + timer->m_ms;
-            add_timer(timer, lock);
-        } else {
-            timer->m_cb = nullptr;
+            cbs.push_back(timer->m_cb);
+            timer->m_next = coalesce(now_us + timer->m_us, timer->m_slack);
+            insert_timer(shard, timer);
+            continue;
         }
+        bool active = true;
+        if (timer->m_active.compare_exchange_strong(active, false)) {
+            --shard.count;
+            cbs.push_back(std::move(timer->m_cb));
+        }
+        timer->m_cb = nullptr;
     }
 }
 
-bool TimerManager::detect_clock_rollover(uint64_t now_ms)
-{
-    bool rollover = false;
-    if (now_ms < m_previous_time &&
-        now_ms < m_previous_time - 60 * 60 * 1000) {
-        rollover = true;
-    }
-    m_previous_time = now_ms;
-    return rollover;
-}
-
 }
\ No newline at end of file
@@ -1,8 +1,13 @@
 #ifndef __SYLAR_TIMER_H__
 #define __SYLAR_TIMER_H__
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "thread.h"
 
@@ -10,9 +15,42 @@
 namespace sylar {
 
     class TimerManager;
+    class TimerWheel;
 
-    class Timer: public std::enable_shared_from_this<Timer> {
+    // 挂在定时器存储（时间轮）里的节点
+    // Timer由shared_ptr管理；也可以把节点直接嵌在别的对象里当作侵入式的定时器，
+    // 见TimerManager::add_timer_node
+    class TimerNode {
     friend class TimerManager;
+    friend class TimerWheel;
+
+    public:
+        // 侵入式定时器到期时的回调
+        typedef void (*Callback)(TimerNode* node);
+
+        TimerNode() = default;
+        TimerNode(const TimerNode&) = delete;
+        TimerNode& operator=(const TimerNode&) = delete;
+
+        // 是否已经添加并且还没到期、没被取消
+        bool is_pending() const { return m_level >= 0; }
+
+    protected:
+        uint64_t m_next = 0; // 下一次执行的具体时间点(us)，有slack的话是合并之后的时间点
+        // 所属的分片，m_next和存储只由负责该分片的线程修改
+        int m_shard = 0;
+        Callback m_fire = nullptr; // 侵入式定时器的回调，Timer为空
+
+        // 挂在时间轮槽上的双向链表
+        TimerNode* m_wheel_prev = nullptr;
+        TimerNode* m_wheel_next = nullptr;
+        int m_level = -1; // 所在的层，-1表示不在时间轮里
+        unsigned m_slot = 0;
+    };
+
+    class Timer: public TimerNode, public std::enable_shared_from_this<Timer> {
+    friend class TimerManager;
+    friend class TimerWheel;
 
     public:
         typedef std::shared_ptr<Timer> ptr;
@@ -22,20 +60,27 @@ namespace sylar {
         // 刷新该计时器的下一次执行时间
         bool refresh();
         // 重置计时器（执行周期或者执行时间）
-        bool reset(uint64_t ms, bool from_now);
+        bool reset(uint64_t ms, bool from_now)
+        {
+            return reset(std::chrono::milliseconds(ms), from_now);
+        }
+        bool reset(std::chrono::microseconds period, bool from_now);
 
     private:
-        Timer(uint64_t ms, std::function<void()> cb,
+        Timer(uint64_t us, uint64_t slack, std::function<void()> cb,
               bool recurring, TimerManager* manager);
         explicit Timer(uint64_t next_time); // 该构造函数用来构造一个用来从set里取timer的timer
 
 
     private:
         bool m_recurring = false; // 是否循环使用定时器
-        uint64_t m_ms = 0; // 执行周期
-        uint64_t m_next = 0; // 下一次执行的具体时间点
+        uint64_t m_us = 0; // 执行周期(us)，和m_cb一样只由负责分片的线程修改
+        uint64_t m_slack = 0; // 允许晚多久触发(us)
         std::function<void()> m_cb;
         TimerManager* m_manager = nullptr;
+        // 既没有触发（非循环的）也没有被取消，哪个线程都可以改，用CAS决定谁赢
+        std::atomic<bool> m_active{true};
+        Timer::ptr m_self; // 在时间轮里时持有自己
     private:
         struct Comparator {
             bool operator()(const Timer::ptr& lhs,
@@ -43,44 +88,138 @@ namespace sylar {
         };
     };
 
+    // 定时器按线程分片，每个分片只由负责它的线程添加、删除和触发，不用加锁
+    // 其他线程对分片的操作作为消息放进分片的信箱，由负责的线程取出来执行
     class TimerManager {
     friend class Timer;
 
     public:
         typedef RWMutex RWMutexType;
 
-        TimerManager() = default;
-        virtual ~TimerManager() = default;
+        // 定时器的存储方式
+        enum Engine {
+            // 按时间排序的set，添加/删除O(logn)
+            SET,
+            // 分层时间轮，添加/删除/刷新O(1)，精度1us
+            WHEEL
+        };
+
+        explicit TimerManager(Engine engine = SET, size_t shards = 1);
+        virtual ~TimerManager();
+
+        // "set" / "wheel"，不认识的名字返回SET
+        static Engine EngineFromName(const std::string& name);
+        Engine getEngine() const { return m_engine; }
 
+        // 在当前线程负责的分片里添加，当前线程不负责分片时交给select_shard选出的分片
+        // 时间内部按微秒计，比微秒更细的duration向上取整
+        // slack为允许晚多久触发：到期时间会在[到期时间, 到期时间+slack]里对齐到尽量整的时间点，
+        // 相近的定时器落到同一个时间点一起触发，减少唤醒次数。读写超时这类不需要准时的定时器用
+        Timer::ptr add_timer(std::chrono::microseconds period, std::function<void()> cb,
+                             bool recurring = false,
+                             std::chrono::microseconds slack = std::chrono::microseconds(0));
         Timer::ptr add_timer(uint64_t ms, std::function<void()> cb,
-                             bool recurring = false);
-        Timer::ptr add_timer(Timer::ptr timer, RWMutexType::WriteLock& lock);
+                             bool recurring = false,
+                             std::chrono::microseconds slack = std::chrono::microseconds(0))
+        {
+            return add_timer(std::chrono::milliseconds(ms), std::move(cb), recurring, slack);
+        }
+        template<class Rep, class Period>
+        Timer::ptr add_timer(std::chrono::duration<Rep, Period> period, std::function<void()> cb,
+                             bool recurring = false,
+                             std::chrono::microseconds slack = std::chrono::microseconds(0))
+        {
+            return add_timer(std::chrono::ceil<std::chrono::microseconds>(period),
+                             std::move(cb), recurring, slack);
+        }
+        Timer::ptr add_condition_timer(std::chrono::microseconds period, std::function<void()> cb,
+                                       std::weak_ptr<void> weak_cond,
+                                       bool recurring = false,
+                                       std::chrono::microseconds slack = std::chrono::microseconds(0));
         Timer::ptr add_condition_timer(uint64_t ms, std::function<void()> cb,
                                        std::weak_ptr<void> weak_cond,
-                                       bool recurring = false);
+                                       bool recurring = false,
+                                       std::chrono::microseconds slack = std::chrono::microseconds(0))
+        {
+            return add_condition_timer(std::chrono::milliseconds(ms), std::move(cb),
+                                       std::move(weak_cond), recurring, slack);
+        }
+
+        // 侵入式的定时器：节点的内存由调用者提供，添加和取消都不分配内存
+        // 只能由负责分片的线程添加和取消，到期时在该线程里直接调用cb，节点在那之前不能销毁
+        // 当前线程不负责分片或者存储方式是set时返回false，调用者改用add_timer
+        bool add_timer_node(TimerNode* node, std::chrono::microseconds timeout,
+                            TimerNode::Callback cb,
+                            std::chrono::microseconds slack = std::chrono::microseconds(0));
+        // 还没到期的话取消并返回true，必须在添加它的线程里调用
+        bool cancel_timer_node(TimerNode* node);
 
+        // 当前线程负责的分片里最近的定时器还有多久到期(ms，向上取整)，不负责分片的线程返回~0ull
         uint64_t get_next_timeout();
-        // 找出所有已经超时的cb
+        // 同上，单位是us
+        uint64_t get_next_timeout_us();
+        // 找出当前线程负责的分片里所有已经超时的cb
         void list_expired_cbs(std::vector<std::function<void()>>& cbs);
     protected:
-        // 当新添加的定时器处于set的第一位（下一次触发时间最早）
-        virtual void on_timer_insert_at_front() = 0;
-
-        bool has_timer()
-        {
-            return !m_timers.empty();
-        }
+        // 当前线程负责的分片，不负责任何分片时返回-1
+        // 默认只有一个分片，所有线程都当作负责它，只能单线程使用
+        virtual int current_shard() { return 0; }
+        // 不负责分片的线程添加定时器时放到哪个分片，默认轮流放
+        virtual int select_shard();
+        // 别的线程往分片里添加了定时器（可能比之前最早的还早），负责它的线程要重新算超时时间
+        virtual void on_timer_insert_at_front(int shard) = 0;
+
+        // 所有分片里是否还有没触发的定时器
+        bool has_timer();
+        // 分片的信箱里是否有还没处理的消息
+        bool has_timer_message(int shard);
 
     private:
-        bool detect_clock_rollover(uint64_t now_ms);
-    private:
-        RWMutexType m_mutex;
-        std::set<Timer::ptr, Timer::Comparator> m_timers;
-        uint64_t m_previous_time = 0;
-    };
+        // 其他线程发给分片的操作
+        struct TimerMessage {
+            enum Type {
+                ADD,
+                CANCEL,
+                REFRESH,
+                RESET
+            };
+            Type type;
+            Timer::ptr timer;
+            uint64_t us = 0; // RESET用
+            bool from_now = false;
+        };
 
+        struct Shard {
+            std::set<Timer::ptr, Timer::Comparator> timers;
+            std::unique_ptr<TimerWheel> wheel;
+            // 还没触发也没取消的定时器个数（包括侵入式的），用来判断能不能停止
+            std::atomic<size_t> count{0};
 
-    static void Cond_cb(const std::weak_ptr<void>& weak_con, const std::function<void()>& cb);
+            Spin_Mutex inbox_mutex;
+            std::vector<TimerMessage> inbox;
+            std::atomic<size_t> inbox_size{0};
+            std::vector<TimerMessage> processing; // 和inbox交换，复用内存
+        };
+
+        // 以下函数只能由负责shard的线程调用
+        void insert_timer(Shard& shard, const Timer::ptr& timer);
+        // 从存储里拿出来，不在里面返回false
+        bool erase_timer(Shard& shard, Timer* timer);
+        // 取出所有到期的定时器，到期的侵入式定时器串成链表放在nodes里
+        void take_expired(Shard& shard, uint64_t now_us, std::vector<Timer::ptr>& expired,
+                          TimerNode*& nodes);
+        bool refresh_timer(Shard& shard, const Timer::ptr& timer);
+        bool reset_timer(Shard& shard, const Timer::ptr& timer, uint64_t us, bool from_now);
+        // 执行信箱里的消息
+        void handle_messages(Shard& shard);
+
+        // 发消息给负责shard的线程，notify为true时通知它重新算超时时间
+        void post_message(int shard, TimerMessage msg, bool notify);
+    private:
+        Engine m_engine;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+        std::atomic<size_t> m_next_shard{0};
+    };
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include "timer_wheel.h"
+
+namespace sylar {
+
+// 每层槽数的位数和每槽跨度的位数
+static const unsigned LEVEL_BITS[TimerWheel::LEVELS] = {8, 6, 6, 6, 6};
+static const unsigned LEVEL_SHIFT[TimerWheel::LEVELS] = {0, 8, 14, 20, 26};
+// 最高层能表示的最远距离(约71分钟)，更远的先放在最远处，到时候再重新放
+static const uint64_t MAX_DELTA = (1ull << 32) - 1;
+
+TimerWheel::TimerWheel(uint64_t now_us)
+    : m_tick(now_us)
+{
+    for (int level = 0; level < LEVELS; ++level) {
+        m_slots[level] = new TimerNode *[1u << LEVEL_BITS[level]]();
+    }
+}
+
+TimerWheel::~TimerWheel()
+{
+    // 释放时间轮持有的引用
+    for (int level = 0; level < LEVELS; ++level) {
+        for (unsigned slot = 0; slot < (1u << LEVEL_BITS[level]); ++slot) {
+            TimerNode *node = detach(level, slot);
+            while (node) {
+                TimerNode *next = node->m_wheel_next;
+                node->m_wheel_prev = node->m_wheel_next = nullptr;
+                node->m_level = -1;
+                if (!node->m_fire) {
+                    static_cast<Timer *>(node)->m_self.reset();
+                }
+                node = next;
+            }
+        }
+        delete[] m_slots[level];
+    }
+}
+
+void TimerWheel::insert(const Timer::ptr &timer)
+{
+    timer->m_self = timer;
+    link(timer.get());
+    ++m_size;
+}
+
+void TimerWheel::insert(TimerNode *node)
+{
+    link(node);
+    ++m_size;
+}
+
+bool TimerWheel::remove(TimerNode *node)
+{
+    if (node->m_level < 0) {
+        return false;
+    }
+    unlink(node);
+    --m_size;
+    if (!node->m_fire) {
+        // 可能是最后一个引用，放到最后释放
+        Timer::ptr self = std::move(static_cast<Timer *>(node)->m_self);
+    }
+    return true;
+}
+
+void TimerWheel::link(TimerNode *timer)
+{
+    // 已经过期的放在马上要处理的槽里
+    uint64_t expire = timer->m_next < m_tick ? m_tick : timer->m_next;
+    uint64_t delta = expire - m_tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expire = m_tick + MAX_DELTA;
+    }
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << LEVEL_SHIFT[level + 1])) {
+        ++level;
+    }
+    unsigned slot = (expire >> LEVEL_SHIFT[level]) & ((1u << LEVEL_BITS[level]) - 1);
+
+    TimerNode *&head = m_slots[level][slot];
+    timer->m_level = level;
+    timer->m_slot = slot;
+    timer->m_wheel_prev = nullptr;
+    timer->m_wheel_next = head;
+    if (head) {
+        head->m_wheel_prev = timer;
+    }
+    head = timer;
+    m_bits[level][slot >> 6] |= 1ull << (slot & 63);
+}
+
+void TimerWheel::unlink(TimerNode *timer)
+{
+    if (timer->m_wheel_prev) {
+        timer->m_wheel_prev->m_wheel_next = timer->m_wheel_next;
+    } else {
+        TimerNode *&head = m_slots[timer->m_level][timer->m_slot];
+        head = timer->m_wheel_next;
+        if (!head) {
+            m_bits[timer->m_level][timer->m_slot >> 6] &= ~(1ull << (timer->m_slot & 63));
+        }
+    }
+    if (timer->m_wheel_next) {
+        timer->m_wheel_next->m_wheel_prev = timer->m_wheel_prev;
+    }
+    timer->m_wheel_prev = timer->m_wheel_next = nullptr;
+    timer->m_level = -1;
+}
+
+TimerNode *TimerWheel::detach(int level, unsigned slot)
+{
+    TimerNode *head = m_slots[level][slot];
+    m_slots[level][slot] = nullptr;
+    m_bits[level][slot >> 6] &= ~(1ull << (slot & 63));
+    return head;
+}
+
+void TimerWheel::cascade(int level, unsigned slot)
+{
+    // 这个槽里的定时器都在下一圈之内到期，重新放一遍就落到了低层
+    TimerNode *timer = detach(level, slot);
+    while (timer) {
+        TimerNode *next = timer->m_wheel_next;
+        link(timer);
+        timer = next;
+    }
+}
+
+int TimerWheel::find_slot(int level, unsigned from) const
+{
+    unsigned slots = 1u << LEVEL_BITS[level];
+    unsigned words = (slots + 63) / 64;
+    const uint64_t *bits = m_bits[level];
+    // 第一个字先去掉from之前的位，绕回来时再看这些位
+    unsigned word = from >> 6;
+    uint64_t mask = ~0ull << (from & 63);
+    for (unsigned i = 0; i <= words; ++i) {
+        uint64_t b = bits[word] & mask;
+        if (b) {
+            unsigned slot = word * 64 + __builtin_ctzll(b);
+            return (int) ((slot - from) & (slots - 1));
+        }
+        word = (word + 1) % words;
+        mask = ~0ull;
+    }
+    return -1;
+}
+
+uint64_t TimerWheel::next_expire() const
+{
+    if (!m_size) {
+        return ~0ull;
+    }
+    uint64_t next = ~0ull;
+    for (int level = 0; level < LEVELS; ++level) {
+        // 第0层的槽对应[m_tick, m_tick + 256)里的每一微秒
+        // 高层的槽在时间走到它的起点时往下搬，m_tick刚好在起点上时当前槽还没搬
+        uint64_t start = m_tick >> LEVEL_SHIFT[level];
+        if (m_tick & ((1ull << LEVEL_SHIFT[level]) - 1)) {
+            ++start;
+        }
+        int offset = find_slot(level, start & ((1u << LEVEL_BITS[level]) - 1));
+        if (offset < 0) {
+            continue;
+        }
+        uint64_t time = (start + offset) << LEVEL_SHIFT[level];
+        if (time < next) {
+            next = time;
+        }
+    }
+    return next;
+}
+
+void TimerWheel::advance(uint64_t now_us, std::vector<Timer::ptr> &expired, TimerNode *&nodes)
+{
+    while (m_size) {
+        // 中间没有事情的时间直接跳过
+        uint64_t next = next_expire();
+        if (next > now_us) {
+            break;
+        }
+        m_tick = next;
+        // 走到高层槽的起点，把它搬到低层；低层转完一圈才轮到更高一层
+        for (int level = 1; level < LEVELS; ++level) {
+            if (m_tick & ((1ull << LEVEL_SHIFT[level]) - 1)) {
+                break;
+            }
+            cascade(level, (m_tick >> LEVEL_SHIFT[level]) & ((1u << LEVEL_BITS[level]) - 1));
+        }
+        TimerNode *timer = detach(0, m_tick & ((1u << LEVEL_BITS[0]) - 1));
+        while (timer) {
+            TimerNode *next_timer = timer->m_wheel_next;
+            timer->m_wheel_prev = timer->m_wheel_next = nullptr;
+            if (timer->m_next > m_tick) {
+                // 太远被放在最远处的，还没到真正的时间
+                link(timer);
+            } else {
+                timer->m_level = -1;
+                --m_size;
+                if (timer->m_fire) {
+                    timer->m_wheel_next = nodes;
+                    nodes = timer;
+                } else {
+                    expired.push_back(std::move(static_cast<Timer *>(timer)->m_self));
+                }
+            }
+            timer = next_timer;
+        }
+        ++m_tick;
+    }
+    if (m_tick <= now_us) {
+        m_tick = now_us + 1;
+    }
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef __SYLAR_TIMER_WHEEL_H__
+#define __SYLAR_TIMER_WHEEL_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "timer.h"
+
+namespace sylar {
+
+// 分层的哈希时间轮，精度1us
+// 第0层256个槽，每槽1us；往上每层64个槽，每槽是下一层一整圈
+// 定时器用侵入式的双向链表挂在槽上，添加/删除都是O(1)
+// 高层的槽在时间走到它的起点时整体往下层搬(cascade)，最终都在第0层到期
+// 不加锁，每个分片一个时间轮，只由负责该分片的线程访问
+class TimerWheel {
+public:
+    static const int LEVELS = 5;
+
+    explicit TimerWheel(uint64_t now_us);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // 按timer->m_next放进时间轮，时间轮持有timer直到删除或者到期
+    void insert(const Timer::ptr &timer);
+    // 侵入式的定时器，时间轮不持有它
+    void insert(TimerNode *node);
+    // 不在时间轮里返回false
+    bool remove(TimerNode *node);
+
+    // 最近一次需要处理的时间点(us)，没有定时器时返回~0ull
+    // 可能是高层槽往下搬的时间，比真正的到期时间早，到时候再算一次即可
+    uint64_t next_expire() const;
+    // 把时间推进到now_us，取出所有到期的定时器
+    // 到期的侵入式定时器用m_wheel_next串起来挂在nodes前面
+    void advance(uint64_t now_us, std::vector<Timer::ptr> &expired, TimerNode *&nodes);
+
+    size_t size() const { return m_size; }
+
+private:
+    void link(TimerNode *node);
+    void unlink(TimerNode *node);
+    // 把一个槽整个摘下来，返回链表头
+    TimerNode *detach(int level, unsigned slot);
+    void cascade(int level, unsigned slot);
+    // 从from开始绕一圈，找第一个非空槽，返回距离from的偏移，没有返回-1
+    int find_slot(int level, unsigned from) const;
+
+private:
+    // 下一个要处理的时间点，之前的都已经处理完
+    uint64_t m_tick;
+    size_t m_size = 0;
+    TimerNode **m_slots[LEVELS];
+    // 每层哪些槽非空，第0层256位，其他层只用第一个字
+    uint64_t m_bits[LEVELS][4]{};
+};
+
+}
+
+#endif
@@ -0,0 +1,433 @@
+#include "poller.h"
+#include "log.h"
+#include "macro.h"
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// user_data的低3位表示完成事件的类型
+// 完成式请求直接存IoRequest的指针（至少8字节对齐）
+// poll相关的存 fd << 32 | gen << 3 | 类型
+enum {
+    KIND_REQUEST = 0,     // 完成式请求本身
+    KIND_TIMEOUT = 1,     // 完成式请求链接的超时
+    KIND_POLL = 2,        // multishot poll产生的就绪事件
+    KIND_POLL_UPDATE = 3, // 修改poll关注的事件
+    KIND_IGNORE = 4       // 删除、取消之类不关心结果的
+};
+static const uint64_t KIND_MASK = 0x7;
+static const uint32_t GEN_MASK = 0x1fffffff;
+
+static uint64_t Poll_data(int fd, uint32_t gen, int kind)
+{
+    return ((uint64_t) fd << 32) | ((uint64_t) (gen & GEN_MASK) << 3) | kind;
+}
+
+UringPoller::~UringPoller()
+{
+    if (m_sqes) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if (m_sq_ring) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if (m_ring_fd >= 0) {
+        close(m_ring_fd);
+    }
+}
+
+bool UringPoller::init(unsigned entries)
+{
+    io_uring_params params{};
+    // multishot poll会一直产生完成事件，完成队列开大一些
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = entries * 4;
+    m_ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (m_ring_fd < 0) {
+        SYLAR_LOG_INFO(g_logger) << "io_uring_setup failed errno=" << errno
+                                 << " (" << strerror(errno) << ")";
+        return false;
+    }
+    // 完成队列满了不丢事件、等待时可以带超时，这两个是必须的
+    if (!(params.features & IORING_FEAT_NODROP)
+        || !(params.features & IORING_FEAT_EXT_ARG)) {
+        SYLAR_LOG_INFO(g_logger) << "io_uring features=" << params.features
+                                 << " not supported";
+        return false;
+    }
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        m_cq_ring_size = m_sq_ring_size;
+    }
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        m_sq_ring = nullptr;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED) {
+            m_cq_ring = nullptr;
+            return false;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = (io_uring_sqe *) sqes;
+
+    char *sq = (char *) m_sq_ring;
+    m_sq_khead = (unsigned *) (sq + params.sq_off.head);
+    m_sq_ktail = (unsigned *) (sq + params.sq_off.tail);
+    m_sq_array = (unsigned *) (sq + params.sq_off.array);
+    m_sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    m_sq_tail = *m_sq_ktail;
+    // 提交队列的下标和sqe一一对应，不用每次都填
+    for (unsigned i = 0; i < m_sq_entries; ++i) {
+        m_sq_array[i] = i;
+    }
+
+    char *cq = (char *) m_cq_ring;
+    m_cq_khead = (unsigned *) (cq + params.cq_off.head);
+    m_cq_ktail = (unsigned *) (cq + params.cq_off.tail);
+    m_cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // 按fd取消请求要5.19以上的内核，顺便确认请求能正常提交和完成
+    // 用ring自己的fd来试，上面没有请求，结果应该是取消了0个
+    {
+        Spin_Mutex::Lock lock(m_mutex);
+        io_uring_sqe *sqe = get_sqe_locked();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = m_ring_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = KIND_IGNORE;
+        publish_locked();
+    }
+    if (enter(unsubmitted(), 1, IORING_ENTER_GETEVENTS, -1) < 0) {
+        return false;
+    }
+    unsigned head = *m_cq_khead;
+    if (head == __atomic_load_n(m_cq_ktail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    int res = m_cqes[head & m_cq_mask].res;
+    __atomic_store_n(m_cq_khead, head + 1, __ATOMIC_RELEASE);
+    if (res < 0) {
+        SYLAR_LOG_INFO(g_logger) << "io_uring cancel by fd not supported: " << res;
+        return false;
+    }
+    return true;
+}
+
+io_uring_sqe *UringPoller::get_sqe_locked(unsigned reserve)
+{
+    if (m_sq_tail + reserve - __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE) > m_sq_entries) {
+        // 提交队列满了，先把已经写好的提交掉
+        publish_locked();
+        enter(unsubmitted(), 0, 0, -1);
+        if (m_sq_tail + reserve - __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE) > m_sq_entries) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring submission queue is full";
+            return nullptr;
+        }
+    }
+    io_uring_sqe *sqe = &m_sqes[m_sq_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    ++m_sq_tail;
+    return sqe;
+}
+
+void UringPoller::publish_locked()
+{
+    // sqe写完之后才能让内核看见新的队尾
+    __atomic_store_n(m_sq_ktail, m_sq_tail, __ATOMIC_RELEASE);
+}
+
+unsigned UringPoller::unsubmitted() const
+{
+    return __atomic_load_n(m_sq_ktail, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE);
+}
+
+int UringPoller::enter(unsigned to_submit, unsigned min_complete,
+                       unsigned flags, int64_t timeout_us)
+{
+    if (timeout_us >= 0 && (flags & IORING_ENTER_GETEVENTS)) {
+        __kernel_timespec ts{};
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (long long) (timeout_us % 1000000) * 1000;
+        io_uring_getevents_arg arg{};
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        return (int) syscall(__NR_io_uring_enter, m_ring_fd, to_submit, min_complete,
+                             flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    return (int) syscall(__NR_io_uring_enter, m_ring_fd, to_submit, min_complete,
+                         flags, nullptr, 0);
+}
+
+UringPoller::FdState &UringPoller::get_state_locked(int fd)
+{
+    if ((size_t) fd >= m_fds.size()) {
+        m_fds.resize(std::max((size_t) fd + 1, m_fds.size() * 3 / 2));
+    }
+    return m_fds[fd];
+}
+
+void UringPoller::arm_locked(int fd, FdState &state)
+{
+    io_uring_sqe *sqe = get_sqe_locked();
+    if (!sqe) {
+        return;
+    }
+    ++state.gen;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = state.events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = Poll_data(fd, state.gen, KIND_POLL);
+    state.armed = true;
+}
+
+bool UringPoller::update(int fd, uint32_t old_events, uint32_t events, void *data)
+{
+    Spin_Mutex::Lock lock(m_mutex);
+    FdState &state = get_state_locked(fd);
+    state.events = events;
+    state.data = data;
+    if (!events) {
+        if (state.armed) {
+            io_uring_sqe *sqe = get_sqe_locked();
+            if (!sqe) {
+                return false;
+            }
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = Poll_data(fd, state.gen, KIND_POLL);
+            sqe->user_data = KIND_IGNORE;
+        }
+        // 换一代，还在队列里的旧事件都会被丢掉
+        ++state.gen;
+        state.armed = false;
+    } else if (!state.armed) {
+        arm_locked(fd, state);
+        if (!state.armed) {
+            return false;
+        }
+    } else {
+        // 原地修改还在生效的poll关注的事件
+        io_uring_sqe *sqe = get_sqe_locked();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = Poll_data(fd, state.gen, KIND_POLL);
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = events;
+        sqe->user_data = Poll_data(fd, state.gen, KIND_POLL_UPDATE);
+    }
+    publish_locked();
+    return true;
+}
+
+bool UringPoller::submit(IoRequest *req)
+{
+    bool has_timeout = req->timeout_ms != ~0ull;
+    req->remain = has_timeout ? 2 : 1;
+    req->timed_out = false;
+
+    Spin_Mutex::Lock lock(m_mutex);
+    io_uring_sqe *sqe = get_sqe_locked(req->remain);
+    if (!sqe) {
+        return false;
+    }
+    sqe->fd = req->fd;
+    switch (req->op) {
+    case IoRequest::RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uint64_t) (uintptr_t) req->buf;
+        sqe->len = req->len;
+        sqe->msg_flags = req->flags;
+        break;
+    case IoRequest::SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t) (uintptr_t) req->buf;
+        sqe->len = req->len;
+        sqe->msg_flags = req->flags;
+        break;
+    case IoRequest::ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = (uint64_t) (uintptr_t) req->addr;
+        sqe->addr2 = (uint64_t) (uintptr_t) req->addrlen;
+        sqe->accept_flags = req->flags;
+        break;
+    case IoRequest::CONNECT:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (uint64_t) (uintptr_t) req->addr;
+        sqe->off = req->len;
+        break;
+    }
+    sqe->user_data = (uint64_t) (uintptr_t) req;
+
+    if (has_timeout) {
+        // 超时由内核负责，时间到了请求会被取消
+        sqe->flags |= IOSQE_IO_LINK;
+        req->timeout_ts.tv_sec = req->timeout_ms / 1000;
+        req->timeout_ts.tv_nsec = (long long) (req->timeout_ms % 1000) * 1000000;
+        io_uring_sqe *timeout_sqe = get_sqe_locked();
+        timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout_sqe->fd = -1;
+        timeout_sqe->addr = (uint64_t) (uintptr_t) &req->timeout_ts;
+        timeout_sqe->len = 1;
+        timeout_sqe->user_data = (uint64_t) (uintptr_t) req | KIND_TIMEOUT;
+    }
+    publish_locked();
+    return true;
+}
+
+void UringPoller::cancel(int fd)
+{
+    Spin_Mutex::Lock lock(m_mutex);
+    io_uring_sqe *sqe = get_sqe_locked();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = KIND_IGNORE;
+    publish_locked();
+    // fd马上就要关闭了，取消请求要在关闭之前生效，不能等下次批量提交
+    enter(unsubmitted(), 0, 0, -1);
+}
+
+void UringPoller::flush()
+{
+    unsigned to_submit = unsubmitted();
+    if (to_submit) {
+        enter(to_submit, 0, 0, -1);
+    }
+}
+
+int UringPoller::wait(PollEvent *events, int max_events, int64_t timeout_us)
+{
+    int rt = 0;
+    int saved_errno = 0;
+    unsigned to_submit = unsubmitted();
+    if (timeout_us == 0 && !to_submit) {
+        // 不等待又没有要提交的，完成队列在共享内存里，直接看就行（忙等时不用进内核）
+    } else if (*m_cq_khead == __atomic_load_n(m_cq_ktail, __ATOMIC_ACQUIRE)) {
+        // 提交和等待在同一次系统调用里完成
+        rt = enter(to_submit, 1, IORING_ENTER_GETEVENTS, timeout_us);
+        saved_errno = errno;
+    } else if (to_submit) {
+        enter(to_submit, 0, 0, -1);
+    }
+
+    int count = 0;
+    unsigned head = *m_cq_khead;
+    unsigned tail = __atomic_load_n(m_cq_ktail, __ATOMIC_ACQUIRE);
+    while (head != tail && count < max_events) {
+        io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+        ++head;
+        if (handle_cqe(cqe, events[count])) {
+            ++count;
+        }
+    }
+    __atomic_store_n(m_cq_khead, head, __ATOMIC_RELEASE);
+
+    if (count == 0 && rt < 0 && saved_errno == EINTR) {
+        errno = EINTR;
+        return -1;
+    }
+    return count;
+}
+
+void UringPoller::finish(IoRequest *req)
+{
+    if (--req->remain == 0) {
+        req->done(req);
+    }
+}
+
+bool UringPoller::handle_cqe(const io_uring_cqe &cqe, PollEvent &event)
+{
+    uint64_t data = cqe.user_data;
+    int kind = (int) (data & KIND_MASK);
+    switch (kind) {
+    case KIND_REQUEST: {
+        auto req = (IoRequest *) (uintptr_t) data;
+        req->result = cqe.res;
+        finish(req);
+        return false;
+    }
+    case KIND_TIMEOUT: {
+        auto req = (IoRequest *) (uintptr_t) (data & ~KIND_MASK);
+        if (cqe.res == -ETIME) {
+            req->timed_out = true;
+        }
+        finish(req);
+        return false;
+    }
+    case KIND_POLL:
+    case KIND_POLL_UPDATE: {
+        int fd = (int) (data >> 32);
+        uint32_t gen = (uint32_t) (data >> 3) & GEN_MASK;
+        Spin_Mutex::Lock lock(m_mutex);
+        if ((size_t) fd >= m_fds.size()) {
+            return false;
+        }
+        FdState &state = m_fds[fd];
+        if ((state.gen & GEN_MASK) != gen) {
+            // 已经删除或者重新注册过的poll
+            return false;
+        }
+        if (kind == KIND_POLL_UPDATE) {
+            // 修改失败说明poll已经结束了，还有人关注的话重新注册
+            if (cqe.res < 0 && state.events && !state.armed) {
+                arm_locked(fd, state);
+                publish_locked();
+            }
+            return false;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            // multishot poll结束了（比如完成队列溢出），之后不会再有事件
+            state.armed = false;
+            if (cqe.res > 0 && state.events) {
+                arm_locked(fd, state);
+                publish_locked();
+            }
+        }
+        event.data = state.data;
+        // 出错时当作错误事件，让等待的协程自己去拿错误码
+        event.events = cqe.res > 0 ? (uint32_t) cqe.res : EPOLLERR;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+}
@@ -1,14 +1,36 @@
 #include "util.h"
 #include "log.h"
 #include "fiber.h"
+#include "clock.h"
 
 #include <execinfo.h>
 
 namespace sylar {
 
+// 每条日志都要取，缓存起来省掉系统调用
+static thread_local pid_t t_tid = 0;
+
+// fork出来的子进程里只剩调用fork的线程，它缓存的还是父进程里的tid
+static void reset_tid_after_fork()
+{
+    t_tid = 0;
+}
+
+struct _Tid_initer {
+    _Tid_initer()
+    {
+        pthread_atfork(nullptr, nullptr, reset_tid_after_fork);
+    }
+};
+
+static _Tid_initer s_tid_initer;
+
 pid_t GetThreadId()
 {
-    return (pid_t) syscall(SYS_gettid);
+    if (!t_tid) {
+        t_tid = (pid_t) syscall(SYS_gettid);
+    }
+    return t_tid;
 }
 
 uint32_t GetFiberId()
@@ -52,15 +74,11 @@ std::string Backtrace_to_string(int size, int skip, const std::string &prefix)
 
 uint64_t Get_current_ms()
 {
-    struct timeval tv{};
-    gettimeofday(&tv, nullptr);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    return Clock::NowMs();
 }
 
 uint64_t Get_current_us()
 {
-    struct timeval tv{};
-    gettimeofday(&tv, nullptr);
-    return tv.tv_sec * 1000 * 1000 + tv.tv_usec;
+    return Clock::NowUs();
 }
 }
\ No newline at end of file
@@ -24,9 +24,9 @@ void Backtrace(std::vector<std::string>& bt, int size, int skip);
 std::string Backtrace_to_string(int size, int skip, const std::string& prefix = "");//常引用可以默认初始化
 
 
-// 获取当前的时间(ms)
+// 获取当前的单调时间(ms)，只能用来算时间差，见Clock
 uint64_t Get_current_ms();
-// 获取当前时间(us)
+// 获取当前的单调时间(us)
 uint64_t Get_current_us();
 }
 
@@ -0,0 +1,98 @@
+#ifndef __SYLAR_WORK_STEALING_QUEUE_H__
+#define __SYLAR_WORK_STEALING_QUEUE_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace sylar {
+
+// 有界的Chase-Lev无锁双端队列
+// 只有所属线程可以push/pop(从bottom端)，其他线程只能steal(从top端)
+// 元素必须是指针之类可以原子读写的类型，空值(T())表示没有取到
+template<typename T, size_t CAPACITY = 1024>
+class WorkStealingQueue {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of 2");
+
+public:
+    // 所属线程调用，队列满了返回false
+    bool push(T value)
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        if (bottom - top >= (int64_t) CAPACITY) {
+            return false;
+        }
+        m_buffer[bottom & MASK].store(value, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 所属线程调用，后进先出
+    T pop()
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+
+        T value = T();
+        if (top <= bottom) {
+            value = m_buffer[bottom & MASK].load(std::memory_order_relaxed);
+            if (top == bottom) {
+                // 只剩最后一个元素，要和steal抢
+                if (!m_top.compare_exchange_strong(top, top + 1,
+                                                   std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed)) {
+                    value = T();
+                }
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+        } else {
+            // 队列是空的，恢复bottom
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return value;
+    }
+
+    // 其他线程调用，先进先出
+    T steal()
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+
+        if (top < bottom) {
+            T value = m_buffer[top & MASK].load(std::memory_order_relaxed);
+            if (m_top.compare_exchange_strong(top, top + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                return value;
+            }
+        }
+        return T();
+    }
+
+    // 近似的元素个数
+    size_t size() const
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        return bottom > top ? bottom - top : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    static const size_t MASK = CAPACITY - 1;
+
+    // top和bottom分别被不同的线程频繁修改，放在不同的cache line上
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    alignas(64) std::atomic<T> m_buffer[CAPACITY];
+};
+
+}
+
+#endif
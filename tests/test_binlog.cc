@@ -0,0 +1,166 @@
+#include "../sylar/sylar.h"
+#include "../sylar/config.h"
+#include "../sylar/clock.h"
+
+#include <cstdarg>
+#include <libgen.h>
+#include <sys/stat.h>
+
+static std::string s_dir;
+
+static uint64_t file_size(const std::string &path)
+{
+    struct stat st{};
+    return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+// SYLAR_LOG_FMT_*每行的耗时
+// 文本模式输出到/dev/null，二进制模式写到临时目录里的文件
+uint64_t bench(sylar::Logger::ptr logger, bool binary, int threads, int lines)
+{
+    std::string path = s_dir + "/bench.bin";
+    if (binary) {
+        sylar::Config::Lookup<std::string>("log.binary_file")->setValue(path);
+    }
+
+    std::vector<sylar::Thread::ptr> ths;
+    uint64_t begin = sylar::Clock::NowNs();
+    for (int i = 0; i < threads; ++i) {
+        ths.emplace_back(new sylar::Thread([=] {
+            for (int n = 0; n < lines; ++n) {
+                SYLAR_LOG_FMT_INFO(logger, "thread %d request %d done, cost %.3fms, path=%s",
+                                   i, n, n / 1000.0, "/index.html");
+            }
+        }, "log_" + std::to_string(i)));
+    }
+    for (auto &t : ths) {
+        t->join();
+    }
+    uint64_t produce = sylar::Clock::NowNs() - begin;
+    // 关闭时把缓冲区里剩下的都写出去
+    sylar::Config::Lookup<std::string>("log.binary_file")->setValue("");
+    uint64_t total = sylar::Clock::NowNs() - begin;
+
+    uint64_t count = (uint64_t) threads * lines;
+    std::cout << "mode=" << (binary ? "binary" : "text")
+              << " threads=" << threads
+              << " lines=" << count
+              << " caller=" << produce / count << "ns/line"
+              << " total=" << total / count << "ns/line";
+    if (binary) {
+        std::cout << " bytes=" << file_size(path)
+                  << " dropped=" << sylar::BinaryLogMgr::GetInstance()->getDropped();
+    }
+    std::cout << std::endl;
+    return count;
+}
+
+static std::string text(const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// 同一行日志用二进制模式记下来，再用snprintf格式化一遍作为期望的结果
+#define CHECK_FMT(fmt, ...) \
+    SYLAR_LOG_FMT_INFO(logger, fmt, __VA_ARGS__); \
+    expects.push_back(text(fmt, __VA_ARGS__))
+
+// 二进制模式解码出来的内容要和printf的结果一样：整数的宽度和符号，%s的精度，不是%s的char指针
+void test_format(sylar::Logger::ptr logger, const std::string &tool)
+{
+    std::string path = s_dir + "/format.bin";
+    sylar::Config::Lookup<std::string>("log.binary_file")->setValue(path);
+    std::vector<std::string> expects;
+    // 没有'\0'结尾，只能按精度读
+    char slice[4] = {'a', 'b', 'c', 'd'};
+    char binary[8] = {'\x01', '\x02', '\x03'};
+    CHECK_FMT("%x %u %d %hx", -1, -1, 3000000000u, (short) -2);
+    CHECK_FMT("%hhd %hhu %ld %llu %c %%", 300, -1, -5L, 18446744073709551615ull, 'x');
+    CHECK_FMT("%5d|%-5u|%05x|%#o", (int8_t) -3, (uint16_t) 65535, (uint8_t) 255, 8u);
+    CHECK_FMT("slice=%.*s|%.3s|%-6s|", 4, slice, "abcdef", "ab");
+    CHECK_FMT("%*d|%.*f|%5.2f|%g", 6, 42, 2, 3.14159, 2.5f, 1e-10);
+    CHECK_FMT("ptr=%p", binary);
+    sylar::Config::Lookup<std::string>("log.binary_file")->setValue("");
+
+    std::string cmd = tool + " " + path;
+    FILE *fp = popen(cmd.c_str(), "r");
+    if (!fp) {
+        std::cout << "run " << cmd << " failed" << std::endl;
+        return;
+    }
+    char line[1024];
+    size_t n = 0;
+    size_t wrong = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        // 内容在第5个tab之后
+        std::string msg = line;
+        size_t pos = 0;
+        for (int i = 0; i < 5 && pos != std::string::npos; ++i) {
+            pos = msg.find('\t', pos + (i ? 1 : 0));
+        }
+        msg = pos == std::string::npos ? "" : msg.substr(pos + 1);
+        if (!msg.empty() && msg.back() == '\n') {
+            msg.pop_back();
+        }
+        if (n >= expects.size() || msg != expects[n]) {
+            std::cout << "format mismatch: got \"" << msg << "\" expect \""
+                      << (n < expects.size() ? expects[n] : "") << "\"" << std::endl;
+            ++wrong;
+        }
+        ++n;
+    }
+    pclose(fp);
+    std::cout << "format: lines=" << n << " expect=" << expects.size() << " wrong=" << wrong << std::endl;
+}
+
+// 用sylar_logdecode还原，看看行数对不对，再打印前几行
+void decode(const std::string &tool, uint64_t expect)
+{
+    std::string cmd = tool + " -s " + s_dir + "/bench.bin";
+    FILE *fp = popen(cmd.c_str(), "r");
+    if (!fp) {
+        std::cout << "run " << cmd << " failed" << std::endl;
+        return;
+    }
+    char line[1024];
+    uint64_t n = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (n++ < 3) {
+            std::cout << line;
+        }
+    }
+    pclose(fp);
+    std::cout << "decoded lines=" << n << (n == expect ? "" : " MISMATCH") << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    char dir[] = "/tmp/test_binlog_XXXXXX";
+    s_dir = mkdtemp(dir);
+
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    // config/log.yaml里的格式
+    logger->setFormatter("%d%T%m%n");
+    logger->addAppender(sylar::LogAppender::ptr(new sylar::FileLogAppender("/dev/null")));
+
+    // 解码工具和测试程序在同一个目录下
+    std::string self = argv[0];
+    std::string tool = std::string(dirname(&self[0])) + "/sylar_logdecode";
+
+    test_format(logger, tool);
+    bench(logger, false, threads, lines);
+    uint64_t count = bench(logger, true, threads, lines);
+    decode(tool, count);
+
+    std::string cmd = "rm -rf " + s_dir;
+    system(cmd.c_str());
+    return 0;
+}
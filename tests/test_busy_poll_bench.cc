@@ -0,0 +1,123 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/config.h"
+#include "../sylar/clock.h"
+#include "test_helper.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+// ping-pong：主线程用阻塞的系统调用发1个字节，IOManager里的协程收到后回1个字节
+// 每次往返之间服务端都是空闲的，往返时间主要就是服务端从等待中醒来的延迟
+
+static void echo(int listen_fd)
+{
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "accept failed errno=" << errno;
+        return;
+    }
+    char c;
+    while (read(fd, &c, 1) == 1) {
+        if (write(fd, &c, 1) != 1) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static double cpu_ms()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0
+        + usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static double percentile_us(const std::vector<uint64_t> &sorted, double p)
+{
+    return sorted[(size_t) (p * (sorted.size() - 1))] / 1000.0;
+}
+
+void run(const std::string &poller, int busy_poll_us, int gap_us, int samples)
+{
+    sylar::Config::Lookup<std::string>("iomanager.poller")->setValue(poller);
+    sylar::Config::Lookup<int>("iomanager.busy_poll_us")->setValue(busy_poll_us);
+
+    sockaddr_in addr{};
+    int listen_fd = listen_on_loopback(addr, 1);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    int nodelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (connect(client, (sockaddr *) &addr, sizeof(addr))) {
+        SYLAR_LOG_ERROR(g_logger) << "connect failed errno=" << errno;
+        return;
+    }
+
+    std::vector<uint64_t> rtts;
+    rtts.reserve(samples);
+    double cpu_begin, wall_begin;
+    {
+        sylar::IOManager iom(1, false, "busy_poll");
+        // 连接已经在backlog里了，accept马上返回
+        iom.schedule([listen_fd] { echo(listen_fd); });
+
+        char c = 0;
+        // 预热，同时让服务端协程把连接接下来
+        for (int i = 0; i < 100; ++i) {
+            write(client, &c, 1);
+            read(client, &c, 1);
+        }
+        cpu_begin = cpu_ms();
+        wall_begin = sylar::Clock::NowNs() / 1000000.0;
+        for (int i = 0; i < samples; ++i) {
+            if (gap_us) {
+                usleep(gap_us);
+            }
+            uint64_t begin = sylar::Clock::NowNs();
+            write(client, &c, 1);
+            if (read(client, &c, 1) != 1) {
+                SYLAR_LOG_ERROR(g_logger) << "read failed errno=" << errno;
+                break;
+            }
+            rtts.push_back(sylar::Clock::NowNs() - begin);
+        }
+        close(client);
+    }
+    close(listen_fd);
+    double cpu = cpu_ms() - cpu_begin;
+    double wall = sylar::Clock::NowNs() / 1000000.0 - wall_begin;
+
+    std::sort(rtts.begin(), rtts.end());
+    SYLAR_LOG_INFO(g_logger) << "poller=" << poller
+                             << " busy_poll=" << busy_poll_us << "us"
+                             << " gap=" << gap_us << "us"
+                             << " samples=" << rtts.size()
+                             << " p50=" << percentile_us(rtts, 0.5) << "us"
+                             << " p99=" << percentile_us(rtts, 0.99) << "us"
+                             << " p99.9=" << percentile_us(rtts, 0.999) << "us"
+                             << " cpu=" << cpu * 100 / wall << "%";
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int samples = argc > 1 ? atoi(argv[1]) : 20000;
+
+    for (const char *poller : {"epoll", "io_uring"}) {
+        // 连续的往返：忙等总能等到下一个请求
+        // 有间隔的往返：间隔比预算长，忙等等不到，预算会自己降下来，不会一直白白占着CPU
+        for (int gap : {0, 200}) {
+            for (int busy_poll : {0, 50, 500}) {
+                run(poller, busy_poll, gap, gap ? samples / 10 : samples);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "../sylar/sylar.h"
+#include "../sylar/stack_allocator.h"
+
+#include <cstring>
+#include <ucontext.h>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+// 模拟一个短连接协程：用掉一部分栈之后就结束
+static void short_lived_task()
+{
+    char buf[16 * 1024];
+    memset(buf, 0, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+}
+
+// 测试协程创建-运行-销毁的吞吐
+// batch表示同时存活的协程数（模拟连接的抖动）
+void bench_create_destroy(const std::string &allocator, int count, int batch)
+{
+    sylar::Config::Lookup<std::string>("fiber.stack_allocator")->setValue(allocator);
+
+    std::vector<sylar::Fiber::ptr> fibers;
+    fibers.reserve(batch);
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < count; i += batch) {
+        for (int j = 0; j < batch; ++j) {
+            fibers.emplace_back(new sylar::Fiber(&short_lived_task));
+            fibers.back()->swapIn();
+        }
+        fibers.clear();
+    }
+    uint64_t cost = sylar::Get_current_us() - begin;
+
+    SYLAR_LOG_INFO(g_logger) << "allocator=" << allocator
+                             << " fibers=" << count
+                             << " batch=" << batch
+                             << " cost=" << cost << "us"
+                             << " per_fiber=" << (double) cost * 1000 / count << "ns"
+                             << " cached_stacks=" << sylar::MmapStackAllocator::CachedCount();
+}
+
+static const int PING_PONG_ROUNDS = 1000000;
+
+static void ping_pong_task()
+{
+    for (int i = 0; i < PING_PONG_ROUNDS; ++i) {
+        sylar::Fiber::Yield_to_Hold();
+    }
+}
+
+// 测试协程来回切换的开销（一次swapIn + 一次swapOut）
+void bench_fiber_switch()
+{
+    sylar::Fiber::ptr fiber(new sylar::Fiber(&ping_pong_task));
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i <= PING_PONG_ROUNDS; ++i) {
+        fiber->swapIn();
+    }
+    uint64_t cost = sylar::Get_current_us() - begin;
+    SYLAR_LOG_INFO(g_logger) << "fiber switch backend=" << sylar::Context::GetBackend()
+                             << " rounds=" << PING_PONG_ROUNDS
+                             << " per_switch=" << (double) cost * 1000 / (2 * PING_PONG_ROUNDS) << "ns";
+}
+
+// 作为对照，直接用glibc的swapcontext来回切换（原来的实现）
+static ucontext_t s_main_uctx;
+static ucontext_t s_task_uctx;
+
+static void ucontext_task()
+{
+    while (true) {
+        swapcontext(&s_task_uctx, &s_main_uctx);
+    }
+}
+
+void bench_ucontext_switch()
+{
+    std::vector<char> stack(128 * 1024);
+    getcontext(&s_task_uctx);
+    s_task_uctx.uc_link = nullptr;
+    s_task_uctx.uc_stack.ss_sp = stack.data();
+    s_task_uctx.uc_stack.ss_size = stack.size();
+    makecontext(&s_task_uctx, &ucontext_task, 0);
+
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < PING_PONG_ROUNDS; ++i) {
+        swapcontext(&s_main_uctx, &s_task_uctx);
+    }
+    uint64_t cost = sylar::Get_current_us() - begin;
+    SYLAR_LOG_INFO(g_logger) << "raw swapcontext rounds=" << PING_PONG_ROUNDS
+                             << " per_switch=" << (double) cost * 1000 / (2 * PING_PONG_ROUNDS) << "ns";
+}
+
+// 从/proc/self/statm读取虚拟内存和常驻内存(KB)
+static void get_memory_kb(uint64_t &vm_kb, uint64_t &rss_kb)
+{
+    uint64_t vm_pages = 0, rss_pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%lu %lu", &vm_pages, &rss_pages) != 2) {
+            vm_pages = rss_pages = 0;
+        }
+        fclose(fp);
+    }
+    vm_kb = vm_pages * (sysconf(_SC_PAGESIZE) / 1024);
+    rss_kb = rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 模拟挂起在do_io里的长连接协程：用掉几KB的栈然后挂起
+static void parked_task()
+{
+    char buf[2 * 1024];
+    memset(buf, 1, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+    sylar::Fiber::Yield_to_Hold();
+}
+
+// 测试大量挂起协程占用的内存：私有栈 vs 共享栈
+void bench_parked_fibers(bool shared_stack, int count)
+{
+    uint64_t vm_before, rss_before, vm_after, rss_after;
+    get_memory_kb(vm_before, rss_before);
+
+    std::vector<sylar::Fiber::ptr> fibers;
+    fibers.reserve(count);
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < count; ++i) {
+        fibers.emplace_back(new sylar::Fiber(&parked_task, 0, false, shared_stack));
+        fibers.back()->swapIn();
+    }
+    uint64_t park_cost = sylar::Get_current_us() - begin;
+    get_memory_kb(vm_after, rss_after);
+
+    begin = sylar::Get_current_us();
+    for (auto &fiber : fibers) {
+        fiber->swapIn();
+    }
+    uint64_t resume_cost = sylar::Get_current_us() - begin;
+    fibers.clear();
+
+    SYLAR_LOG_INFO(g_logger) << "parked fibers shared_stack=" << shared_stack
+                             << " count=" << count
+                             << " vm_delta=" << (vm_after - vm_before) / 1024 << "MB"
+                             << " rss_delta=" << (rss_after - rss_before) / 1024 << "MB"
+                             << " park_per_fiber=" << (double) park_cost * 1000 / count << "ns"
+                             << " resume_per_fiber=" << (double) resume_cost * 1000 / count << "ns";
+}
+
+int main(int argc, char *argv[])
+{
+    // 协程创建/销毁时会打INFO日志，压测时关掉
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+
+    sylar::Fiber::GetThis();
+    for (int batch : {1, 64, 256}) {
+        bench_create_destroy("malloc", count, batch);
+        bench_create_destroy("mmap", count, batch);
+    }
+
+    bench_ucontext_switch();
+    bench_fiber_switch();
+
+    bench_parked_fibers(false, 20000);
+    bench_parked_fibers(true, 20000);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __SYLAR_TEST_HELPER_H__
+#define __SYLAR_TEST_HELPER_H__
+
+// 几个测试程序共用的小工具，每个测试程序只有一个源文件，直接定义在头文件里
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef TEST_COUNT_ALLOC
+// 统计整个进程里operator new的调用次数，要统计的测试程序在include之前定义TEST_COUNT_ALLOC
+static std::atomic<uint64_t> s_alloc_count{0};
+
+void *operator new(size_t size)
+{
+    ++s_alloc_count;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+#endif
+
+// 进程累计的上下文切换次数（自愿+非自愿）
+static inline uint64_t context_switches()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// 在127.0.0.1的随机端口上监听，addr返回实际的地址
+static inline int listen_on_loopback(sockaddr_in &addr, int backlog = 1024)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(fd, (sockaddr *) &addr, sizeof(addr));
+    listen(fd, backlog);
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *) &addr, &len);
+    return fd;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/config.h"
+
+#define TEST_COUNT_ALLOC
+#include "test_helper.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static const size_t MSG_SIZE = 64;
+
+// 设置读写超时，让每次等待都带着定时器
+static void set_timeout(int fd, int ms)
+{
+    timeval tv{ms / 1000, ms % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void serve(int fd)
+{
+    set_timeout(fd, 3000);
+    char buf[MSG_SIZE];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        write(fd, buf, n);
+    }
+    close(fd);
+}
+
+// 先跑warmup轮把各种池子和缓冲区热起来，再统计rounds轮里的分配次数
+static void ping_pong(const sockaddr_in &addr, int warmup, int rounds,
+                      uint64_t &allocs, std::atomic<bool> &done)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    set_timeout(fd, 3000);
+    if (connect(fd, (const sockaddr *) &addr, sizeof(addr))) {
+        SYLAR_LOG_ERROR(g_logger) << "connect failed errno=" << errno;
+        close(fd);
+        done = true;
+        return;
+    }
+    char buf[MSG_SIZE] = {0};
+    uint64_t begin = 0;
+    for (int i = 0; i < warmup + rounds; ++i) {
+        if (i == warmup) {
+            begin = s_alloc_count;
+        }
+        write(fd, buf, sizeof(buf));
+        size_t got = 0;
+        while (got < sizeof(buf)) {
+            ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+    }
+    allocs = s_alloc_count - begin;
+    close(fd);
+    done = true;
+}
+
+void run(const std::string &engine, int warmup, int rounds)
+{
+    sylar::Config::Lookup<std::string>("iomanager.timer_engine")->setValue(engine);
+    std::atomic<bool> done{false};
+    uint64_t allocs = 0;
+    {
+        sylar::IOManager iom(1, false, "alloc");
+        iom.schedule([&] {
+            sockaddr_in addr{};
+            int listen_fd = listen_on_loopback(addr, 16);
+
+            sylar::IOManager::GetThis()->schedule([&, addr] {
+                ping_pong(addr, warmup, rounds, allocs, done);
+            });
+            int fd = accept(listen_fd, nullptr, nullptr);
+            close(listen_fd);
+            if (fd >= 0) {
+                serve(fd);
+            }
+        });
+        while (!done) {
+            usleep(1000);
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "timer_engine=" << engine
+                             << " requests=" << rounds
+                             << " allocs=" << allocs
+                             << " allocs_per_request=" << (double) allocs / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    // 完成式的io不走do_io的等待，这里只看就绪式的路径
+    sylar::Config::Lookup<std::string>("iomanager.poller")->setValue("epoll");
+    int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+
+    run("set", 1000, rounds);
+    run("wheel", 1000, rounds);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/config.h"
+#include "../sylar/hook.h"
+#include "../sylar/clock.h"
+#include "test_helper.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+// 同一个循环分别用原始的系统调用和hook之后的函数跑一遍，差值就是hook本身的开销
+// fd上一直有数据可读、缓冲区一直可写，不会走到EAGAIN之后的等待
+
+static double ns_per_op(uint64_t begin_ns, size_t ops)
+{
+    return (double) (sylar::Clock::NowNs() - begin_ns) / ops;
+}
+
+// 两个用hook过的socket/accept/connect建立的连接端，都有fd上下文
+static bool make_pair(int &client, int &server)
+{
+    sockaddr_in addr{};
+    int listen_fd = listen_on_loopback(addr, 1);
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client, (sockaddr *) &addr, sizeof(addr))) {
+        close(listen_fd);
+        return false;
+    }
+    server = accept(listen_fd, nullptr, nullptr);
+    close(listen_fd);
+    return server >= 0;
+}
+
+static void bench(size_t rounds)
+{
+    int client, server;
+    if (!make_pair(client, server)) {
+        SYLAR_LOG_ERROR(g_logger) << "make pair failed errno=" << errno;
+        return;
+    }
+    char c = 0;
+
+    uint64_t begin = sylar::Clock::NowNs();
+    for (size_t i = 0; i < rounds; ++i) {
+        write_f(client, &c, 1);
+        read_f(server, &c, 1);
+    }
+    double raw_rw = ns_per_op(begin, rounds);
+
+    begin = sylar::Clock::NowNs();
+    for (size_t i = 0; i < rounds; ++i) {
+        write(client, &c, 1);
+        read(server, &c, 1);
+    }
+    double hook_rw = ns_per_op(begin, rounds);
+
+    begin = sylar::Clock::NowNs();
+    for (size_t i = 0; i < rounds; ++i) {
+        fcntl_f(client, F_GETFL);
+    }
+    double raw_fcntl = ns_per_op(begin, rounds);
+
+    begin = sylar::Clock::NowNs();
+    for (size_t i = 0; i < rounds; ++i) {
+        fcntl(client, F_GETFL);
+    }
+    double hook_fcntl = ns_per_op(begin, rounds);
+
+    close(client);
+    close(server);
+
+    SYLAR_LOG_INFO(g_logger) << "rounds=" << rounds
+                             << " write+read raw=" << raw_rw << "ns"
+                             << " hooked=" << hook_rw << "ns"
+                             << " overhead=" << hook_rw - raw_rw << "ns";
+    SYLAR_LOG_INFO(g_logger) << "rounds=" << rounds
+                             << " fcntl(F_GETFL) raw=" << raw_fcntl << "ns"
+                             << " hooked=" << hook_fcntl << "ns"
+                             << " overhead=" << hook_fcntl - raw_fcntl << "ns";
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    // 完成式的读写直接交给内核，这里只看就绪式的路径
+    sylar::Config::Lookup<std::string>("iomanager.poller")->setValue("epoll");
+    size_t rounds = argc > 1 ? atoi(argv[1]) : 200000;
+
+    std::atomic<bool> done{false};
+    {
+        sylar::IOManager iom(1, false, "hook_bench");
+        iom.schedule([&] {
+            bench(rounds);
+            done = true;
+        });
+        while (!done) {
+            usleep(1000);
+        }
+    }
+    return 0;
+}
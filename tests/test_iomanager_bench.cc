@@ -0,0 +1,78 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "test_helper.h"
+
+#include <algorithm>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static uint64_t now_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 所有工作线程都空闲时，从外部线程加入一个任务，测量任务开始执行的延迟
+void bench_wakeup_latency(sylar::IOManager &iom, size_t threads, int rounds)
+{
+    std::vector<uint64_t> latencies;
+    latencies.reserve(rounds);
+    std::atomic<uint64_t> latency{0};
+    uint64_t switches = context_switches();
+    for (int i = 0; i < rounds; ++i) {
+        // 等工作线程都睡下去
+        usleep(200);
+        latency = 0;
+        uint64_t begin = now_ns();
+        iom.schedule([&latency, begin] { latency = now_ns() - begin; });
+        while (latency == 0) {
+            sched_yield();
+        }
+        latencies.push_back(latency);
+    }
+    switches = context_switches() - switches;
+    std::sort(latencies.begin(), latencies.end());
+    SYLAR_LOG_INFO(g_logger) << "wakeup threads=" << threads
+                             << " rounds=" << rounds
+                             << " p50=" << latencies[rounds / 2] / 1000.0 << "us"
+                             << " p99=" << latencies[rounds * 99 / 100] / 1000.0 << "us"
+                             << " ctx_switches_per_wakeup=" << (double) switches / rounds;
+}
+
+// 持续有少量任务进来时，每个任务引起的上下文切换次数
+void bench_switches_per_task(sylar::IOManager &iom, size_t threads, int count)
+{
+    std::atomic<int> done{0};
+    uint64_t switches = context_switches();
+    uint64_t begin = now_ns();
+    for (int i = 0; i < count; ++i) {
+        iom.schedule([&done] { ++done; });
+        if (i % 16 == 0) {
+            usleep(50);
+        }
+    }
+    while (done < count) {
+        sched_yield();
+    }
+    uint64_t cost = now_ns() - begin;
+    switches = context_switches() - switches;
+    SYLAR_LOG_INFO(g_logger) << "trickle threads=" << threads
+                             << " tasks=" << count
+                             << " cost=" << cost / 1000 << "us"
+                             << " ctx_switches_per_task=" << (double) switches / count;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+
+    for (size_t threads : {1, 2, 4, 8}) {
+        sylar::IOManager iom(threads, false, "bench");
+        bench_wakeup_latency(iom, threads, rounds);
+        bench_switches_per_task(iom, threads, rounds * 10);
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "../sylar/sylar.h"
+#include "../sylar/async_log.h"
+#include "../sylar/config.h"
+#include "../sylar/clock.h"
+
+#include <algorithm>
+#include <atomic>
+
+// 模拟慢的输出地：格式化之后丢掉，每隔一定条数卡一下，相当于磁盘写满了页缓存要等回写
+class SlowLogAppender : public sylar::LogAppender {
+public:
+    typedef std::shared_ptr<SlowLogAppender> ptr;
+    explicit SlowLogAppender(uint32_t stall_every, uint32_t stall_us)
+        : m_stall_every(stall_every), m_stall_us(stall_us) {}
+
+    void log(const std::shared_ptr<sylar::Logger> &logger, sylar::LogLevel::Level level, const sylar::LogEvent::ptr &event) override
+    {
+        sylar::Mutex::Lock lock(m_mutex);
+        m_ss.str("");
+        m_formatter->format(m_ss, logger, level, event);
+        if (++m_lines % m_stall_every == 0) {
+            usleep(m_stall_us);
+        }
+    }
+    std::string toYamlString() override { return ""; }
+
+    uint64_t getLines() const { return m_lines; }
+    void reset() { m_lines = 0; }
+
+private:
+    uint32_t m_stall_every;
+    uint32_t m_stall_us;
+    std::atomic<uint64_t> m_lines{0};
+    std::stringstream m_ss;
+};
+
+static double percentile_us(const std::vector<uint64_t> &sorted, double p)
+{
+    return sorted[(size_t) (p * (sorted.size() - 1))] / 1000.0;
+}
+
+void run(const std::string &mode, sylar::Logger::ptr logger, SlowLogAppender::ptr appender,
+         int threads, int lines)
+{
+    bool async = mode != "sync";
+    if (async) {
+        sylar::Config::Lookup<std::string>("log.async_overflow")->setValue(mode);
+    }
+    sylar::Config::Lookup<bool>("log.async")->setValue(async);
+    appender->reset();
+    uint64_t dropped_begin = sylar::AsyncLogMgr::GetInstance()->getDropped();
+
+    std::vector<std::vector<uint64_t>> costs(threads);
+    std::vector<sylar::Thread::ptr> ths;
+    uint64_t begin = sylar::Clock::NowNs();
+    for (int i = 0; i < threads; ++i) {
+        ths.emplace_back(new sylar::Thread([&, i] {
+            costs[i].reserve(lines);
+            for (int n = 0; n < lines; ++n) {
+                uint64_t t = sylar::Clock::NowNs();
+                SYLAR_LOG_INFO(logger) << "thread " << i << " line " << n << " of the async log bench";
+                costs[i].push_back(sylar::Clock::NowNs() - t);
+            }
+        }, "log_" + std::to_string(i)));
+    }
+    for (auto &t : ths) {
+        t->join();
+    }
+    uint64_t produce = sylar::Clock::NowNs() - begin;
+    // 关掉异步模式时会把剩下的日志全部输出
+    sylar::Config::Lookup<bool>("log.async")->setValue(false);
+    uint64_t total = sylar::Clock::NowNs() - begin;
+
+    std::vector<uint64_t> all;
+    for (auto &c : costs) {
+        all.insert(all.end(), c.begin(), c.end());
+    }
+    std::sort(all.begin(), all.end());
+    uint64_t expect = (uint64_t) threads * lines;
+    uint64_t dropped = sylar::AsyncLogMgr::GetInstance()->getDropped() - dropped_begin;
+    std::cout << "mode=" << mode
+              << " threads=" << threads
+              << " lines=" << expect
+              << " written=" << appender->getLines()
+              << " dropped=" << dropped
+              << (appender->getLines() + dropped == expect ? "" : " LOST")
+              << " p50=" << percentile_us(all, 0.5) << "us"
+              << " p99=" << percentile_us(all, 0.99) << "us"
+              << " max=" << all.back() / 1000.0 << "us"
+              << " produce=" << produce / 1000000.0 << "ms"
+              << " total=" << total / 1000000.0 << "ms"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int lines = argc > 1 ? atoi(argv[1]) : 50000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+
+    // config/log.yaml里的格式
+    sylar::Logger::ptr logger = SYLAR_LOG_NAME("bench");
+    logger->setFormatter("%d%T%m%n");
+    // 每256行卡1ms
+    SlowLogAppender::ptr appender(new SlowLogAppender(256, 1000));
+    logger->addAppender(appender);
+
+    sylar::Config::Lookup<uint32_t>("log.async_ring_size")->setValue(4096);
+    for (const char *mode : {"sync", "block", "drop", "sample"}) {
+        run(mode, logger, appender, threads, lines);
+    }
+    return 0;
+}
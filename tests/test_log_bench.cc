@@ -0,0 +1,91 @@
+#include "../sylar/sylar.h"
+#include "../sylar/clock.h"
+
+#define TEST_COUNT_ALLOC
+#include "test_helper.h"
+
+#include <atomic>
+#include <fstream>
+
+static void report(const std::string &name, int lines, uint64_t cost, uint64_t allocs)
+{
+    std::cout << name
+              << " lines=" << lines
+              << " " << cost / lines << "ns/line"
+              << " allocs/line=" << (double) allocs / lines << std::endl;
+}
+
+// 每行日志的耗时和分配次数，输出到/dev/null上的文件appender
+// batch为true时模拟异步日志的后台线程：每行末尾不flush，最后统一flush
+void bench(const std::string &pattern, bool batch, int lines)
+{
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    logger->setFormatter(pattern);
+    sylar::FileLogAppender::ptr appender(new sylar::FileLogAppender("/dev/null"));
+    logger->addAppender(appender);
+    std::string name = "pattern=" + pattern + (batch ? " batch" : " sync");
+    // 把换行去掉，方便看
+    for (size_t pos; (pos = name.find('\n')) != std::string::npos;) {
+        name.erase(pos, 1);
+    }
+
+    // 预热：每个线程第一次打日志会分配可以复用的东西
+    for (int i = 0; i < 100; ++i) {
+        SYLAR_LOG_INFO(logger) << "warm up " << i;
+    }
+    appender->flush();
+
+    std::unique_ptr<sylar::LogBatchScope> scope(batch ? new sylar::LogBatchScope : nullptr);
+    uint64_t allocs = s_alloc_count;
+    uint64_t begin = sylar::Clock::NowNs();
+    for (int i = 0; i < lines; ++i) {
+        SYLAR_LOG_INFO(logger) << "request " << i << " done, cost " << 1.5 << "ms, path=/index.html";
+    }
+    appender->flush();
+    uint64_t cost = sylar::Clock::NowNs() - begin;
+    report(name + " <<", lines, cost, s_alloc_count - allocs);
+
+    allocs = s_alloc_count;
+    begin = sylar::Clock::NowNs();
+    for (int i = 0; i < lines; ++i) {
+        SYLAR_LOG_FMT_INFO(logger, "request %d done, cost %.1fms, path=%s", i, 1.5, "/index.html");
+    }
+    appender->flush();
+    cost = sylar::Clock::NowNs() - begin;
+    report(name + " fmt", lines, cost, s_alloc_count - allocs);
+}
+
+// 只测格式化：同一个事件反复格式化，输出到/dev/null
+void bench_format(const std::string &pattern, int lines)
+{
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    sylar::LogFormatter::ptr formatter(new sylar::LogFormatter(pattern));
+    sylar::LogEvent::ptr event(new sylar::LogEvent(logger, sylar::LogLevel::INFO, __FILE__, __LINE__, 0,
+                                                   sylar::GetThreadId(), "main", 0, time(nullptr)));
+    event->getSS() << "request 1 done, cost 1.5ms, path=/index.html";
+    std::ofstream null("/dev/null");
+
+    sylar::LogBatchScope scope;
+    uint64_t allocs = s_alloc_count;
+    uint64_t begin = sylar::Clock::NowNs();
+    for (int i = 0; i < lines; ++i) {
+        formatter->format(null, logger, sylar::LogLevel::INFO, event);
+    }
+    uint64_t cost = sylar::Clock::NowNs() - begin;
+    std::string name = "pattern=" + pattern + " format only";
+    report(name, lines, cost, s_alloc_count - allocs);
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+
+    // config/log.yaml里的格式和Logger默认的格式
+    for (const char *pattern : {"%d%T%m%n", "%d%T%t%T%N%T%F%T[%p]%T[%c]%T<%f:%l>%T%m%n"}) {
+        bench_format(pattern, lines);
+        bench(pattern, false, lines);
+        bench(pattern, true, lines);
+    }
+    return 0;
+}
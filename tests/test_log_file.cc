@@ -0,0 +1,108 @@
+#include "../sylar/sylar.h"
+#include "../sylar/async_log.h"
+#include "../sylar/config.h"
+#include "../sylar/clock.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+static std::string s_dir;
+
+static size_t count_files(const std::string &prefix)
+{
+    size_t n = 0;
+    DIR *dir = opendir(s_dir.c_str());
+    while (dirent *d = readdir(dir)) {
+        if (std::string(d->d_name).compare(0, prefix.size(), prefix) == 0) {
+            ++n;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static uint64_t file_size(const std::string &path)
+{
+    struct stat st{};
+    return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+static sylar::Logger::ptr make_logger(const std::string &name, sylar::FileLogAppender::ptr appender)
+{
+    sylar::Logger::ptr logger(new sylar::Logger(name));
+    // config/log.yaml里的格式
+    logger->setFormatter("%d%T%m%n");
+    logger->addAppender(appender);
+    return logger;
+}
+
+// 每行的耗时，同步模式下每行都要写到文件里
+void bench(bool async, int lines)
+{
+    sylar::Config::Lookup<bool>("log.async")->setValue(async);
+    std::string path = s_dir + "/bench.log";
+    unlink(path.c_str());
+    sylar::FileLogAppender::ptr appender(new sylar::FileLogAppender(path));
+    sylar::Logger::ptr logger = make_logger("bench", appender);
+
+    uint64_t begin = sylar::Clock::NowNs();
+    for (int i = 0; i < lines; ++i) {
+        SYLAR_LOG_INFO(logger) << "line " << i << " of the file appender bench";
+    }
+    uint64_t produce = sylar::Clock::NowNs() - begin;
+    sylar::Config::Lookup<bool>("log.async")->setValue(false);
+    appender->flush();
+    uint64_t total = sylar::Clock::NowNs() - begin;
+    std::cout << "mode=" << (async ? "async" : "sync")
+              << " lines=" << lines
+              << " caller=" << produce / lines << "ns/line"
+              << " total=" << total / lines << "ns/line"
+              << " bytes=" << file_size(path) << std::endl;
+}
+
+// 按大小切分
+void test_rotate(int lines)
+{
+    std::string path = s_dir + "/rotate.log";
+    sylar::FileLogAppender::ptr appender(new sylar::FileLogAppender(path, 64 * 1024));
+    sylar::Logger::ptr logger = make_logger("rotate", appender);
+    for (int i = 0; i < lines; ++i) {
+        SYLAR_LOG_INFO(logger) << "line " << i << " of the rotate test";
+    }
+    appender->flush();
+    std::cout << "rotate: files=" << count_files("rotate.log")
+              << " current=" << file_size(path) << " bytes" << std::endl;
+}
+
+// 文件被挪走之后，一秒之内要重新创建
+void test_moved()
+{
+    std::string path = s_dir + "/moved.log";
+    sylar::FileLogAppender::ptr appender(new sylar::FileLogAppender(path));
+    sylar::Logger::ptr logger = make_logger("moved", appender);
+    SYLAR_LOG_INFO(logger) << "before move";
+    rename(path.c_str(), (path + ".old").c_str());
+    for (int i = 0; i < 30 && !file_size(path); ++i) {
+        usleep(100 * 1000);
+        SYLAR_LOG_INFO(logger) << "after move " << i;
+    }
+    std::cout << "moved: old=" << file_size(path + ".old")
+              << " new=" << file_size(path) << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+    char dir[] = "/tmp/test_log_file_XXXXXX";
+    s_dir = mkdtemp(dir);
+
+    bench(false, lines);
+    bench(true, lines);
+    test_rotate(20000);
+    test_moved();
+
+    std::string cmd = "rm -rf " + s_dir;
+    system(cmd.c_str());
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/config.h"
+#include "test_helper.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static const size_t MSG_SIZE = 64;
+
+// 服务端：每个连接一个协程，收到什么就回什么
+static void serve(int fd)
+{
+    char buf[MSG_SIZE];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        write(fd, buf, n);
+    }
+    close(fd);
+}
+
+// 客户端：发一个消息，等回复，重复rounds次
+static void ping_pong(const sockaddr_in &addr, int rounds, std::atomic<int> &done)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (const sockaddr *) &addr, sizeof(addr))) {
+        SYLAR_LOG_ERROR(g_logger) << "connect failed errno=" << errno;
+        close(fd);
+        ++done;
+        return;
+    }
+    char buf[MSG_SIZE] = {0};
+    for (int i = 0; i < rounds; ++i) {
+        size_t got = 0;
+        write(fd, buf, sizeof(buf));
+        while (got < sizeof(buf)) {
+            ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+    }
+    close(fd);
+    ++done;
+}
+
+void bench(const std::string &poller, bool persistent, size_t threads, int conns, int rounds)
+{
+    sylar::Config::Lookup<std::string>("iomanager.poller")->setValue(poller);
+    sylar::Config::Lookup<bool>("iomanager.persistent_events")->setValue(persistent);
+    std::atomic<int> done{0};
+    uint64_t begin = 0;
+    uint64_t switches = 0;
+    std::string name;
+    {
+        sylar::IOManager iom(threads, false, "bench");
+        name = iom.getPollerName();
+        iom.schedule([&] {
+            sockaddr_in addr{};
+            int listen_fd = listen_on_loopback(addr);
+            for (int i = 0; i < conns; ++i) {
+                sylar::IOManager::GetThis()->schedule([&addr, rounds, &done] {
+                    ping_pong(addr, rounds, done);
+                });
+            }
+            switches = context_switches();
+            begin = sylar::Get_current_us();
+            for (int i = 0; i < conns; ++i) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    break;
+                }
+                sylar::IOManager::GetThis()->schedule([fd] { serve(fd); });
+            }
+            close(listen_fd);
+        });
+        while (done < conns) {
+            usleep(1000);
+        }
+    }
+    uint64_t cost = sylar::Get_current_us() - begin;
+    switches = context_switches() - switches;
+    int requests = conns * rounds;
+    SYLAR_LOG_INFO(g_logger) << "poller=" << name
+                             << " persistent=" << persistent
+                             << " threads=" << threads
+                             << " conns=" << conns
+                             << " max_events=" << sylar::Config::Lookup<int>("iomanager.max_events")->getValue()
+                             << " requests=" << requests
+                             << " cost=" << cost / 1000 << "ms"
+                             << " qps=" << (uint64_t) (requests * 1000000.0 / cost)
+                             << " ctx_switches_per_request=" << (double) switches / requests;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+    int conns = argc > 2 ? atoi(argv[2]) : 16;
+
+    for (size_t threads : {1, 2}) {
+        bench("epoll", false, threads, conns, rounds);
+        bench("epoll", true, threads, conns, rounds);
+        bench("io_uring", false, threads, conns, rounds);
+    }
+
+    // 大量连接同时活跃：一次只取64个事件和按负载增大到1024个对比
+    for (int max_events : {64, 1024}) {
+        sylar::Config::Lookup<int>("iomanager.max_events")->setValue(max_events);
+        bench("epoll", true, 1, conns * 25, rounds / 25);
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/reactor_group.h"
+#include "../sylar/util.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <sstream>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static const size_t MSG_SIZE = 64;
+
+// 处理连接的线程换了几次：共享的IOManager里一个连接的协程可能被任意线程执行
+static std::atomic<uint64_t> s_migrations{0};
+
+// 回显
+static void serve(int fd)
+{
+    char buf[MSG_SIZE];
+    pid_t last = sylar::GetThreadId();
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        write(fd, buf, n);
+        pid_t now = sylar::GetThreadId();
+        if (now != last) {
+            ++s_migrations;
+            last = now;
+        }
+    }
+    close(fd);
+}
+
+static void ping_pong(const sockaddr_in &addr, int rounds, std::atomic<int> &done)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (const sockaddr *) &addr, sizeof(addr))) {
+        SYLAR_LOG_ERROR(g_logger) << "connect failed errno=" << errno;
+        close(fd);
+        ++done;
+        return;
+    }
+    char buf[MSG_SIZE] = {0};
+    for (int i = 0; i < rounds; ++i) {
+        size_t got = 0;
+        write(fd, buf, sizeof(buf));
+        while (got < sizeof(buf)) {
+            ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+    }
+    close(fd);
+    ++done;
+}
+
+// 客户端在另一个IOManager里跑，返回耗时(us)
+static uint64_t run_clients(const sockaddr_in &addr, size_t threads, int conns, int rounds)
+{
+    std::atomic<int> done{0};
+    uint64_t begin = sylar::Get_current_us();
+    {
+        sylar::IOManager clients(threads, false, "client");
+        for (int i = 0; i < conns; ++i) {
+            clients.schedule([&addr, rounds, &done] { ping_pong(addr, rounds, done); });
+        }
+        while (done < conns) {
+            usleep(1000);
+        }
+    }
+    return sylar::Get_current_us() - begin;
+}
+
+static void report(const std::string &mode, size_t threads, int conns, int rounds,
+                   uint64_t cost, const std::string &extra = "")
+{
+    int requests = conns * rounds;
+    SYLAR_LOG_INFO(g_logger) << "mode=" << mode
+                             << " threads=" << threads
+                             << " conns=" << conns
+                             << " qps=" << (uint64_t) (requests * 1000000.0 / cost)
+                             << " migrations_per_conn=" << (double) s_migrations / conns
+                             << extra;
+}
+
+// 对照：一个多线程的IOManager，所有线程共用一个后端和任务队列
+void bench_shared(size_t threads, int conns, int rounds)
+{
+    s_migrations = 0;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::atomic<bool> listening{false};
+    uint64_t cost;
+    {
+        sylar::IOManager server(threads, false, "shared");
+        server.schedule([&] {
+            int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            bind(listen_fd, (sockaddr *) &addr, sizeof(addr));
+            listen(listen_fd, SOMAXCONN);
+            socklen_t len = sizeof(addr);
+            getsockname(listen_fd, (sockaddr *) &addr, &len);
+            listening = true;
+            for (int i = 0; i < conns; ++i) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    break;
+                }
+                sylar::IOManager::GetThis()->schedule([fd] { serve(fd); });
+            }
+            close(listen_fd);
+        });
+        while (!listening) {
+            usleep(1000);
+        }
+        cost = run_clients(addr, threads, conns, rounds);
+    }
+    report("shared", threads, conns, rounds, cost);
+}
+
+void bench_group(bool reuseport, size_t threads, int conns, int rounds)
+{
+    s_migrations = 0;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sylar::ReactorGroup group(threads, "reactor");
+    std::vector<std::atomic<int>> per_reactor(group.size());
+    auto on_accept = [&group, &per_reactor](int fd) {
+        ++per_reactor[group.getThisIndex()];
+        serve(fd);
+    };
+    bool ok = reuseport
+        ? group.listen_reuseport((sockaddr *) &addr, sizeof(addr), on_accept)
+        : group.listen_round_robin((sockaddr *) &addr, sizeof(addr), on_accept);
+    if (!ok) {
+        SYLAR_LOG_ERROR(g_logger) << "listen failed";
+        return;
+    }
+    uint64_t cost = run_clients(addr, threads, conns, rounds);
+
+    // 往每个reactor上post一个任务，确认它在对应的线程上执行
+    std::atomic<int> wrong{0};
+    for (size_t i = 0; i < group.size(); ++i) {
+        group.post(i, [&group, &wrong, i] {
+            if (group.getThisIndex() != (int) i) {
+                ++wrong;
+            }
+        });
+    }
+    group.stop();
+
+    std::stringstream ss;
+    ss << " conns_per_reactor=";
+    for (size_t i = 0; i < per_reactor.size(); ++i) {
+        ss << (i ? "/" : "") << per_reactor[i];
+    }
+    ss << " post_wrong=" << wrong;
+    report(reuseport ? "reuseport" : "round_robin", threads, conns, rounds, cost, ss.str());
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int rounds = argc > 1 ? atoi(argv[1]) : 5000;
+    int conns = argc > 2 ? atoi(argv[2]) : 32;
+
+    for (size_t threads : {2, 4}) {
+        bench_shared(threads, conns, rounds);
+        bench_group(true, threads, conns, rounds);
+        bench_group(false, threads, conns, rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "../sylar/sylar.h"
+
+#include <atomic>
+#include <thread>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static std::atomic<uint64_t> s_done{0};
+
+// 模拟一个很短的任务
+static void tiny_task()
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 100; ++i) {
+        x += i;
+    }
+    asm volatile("" : : "r"(x));
+    ++s_done;
+}
+
+// 外部线程往调度器里加任务（全部进全局队列）
+void bench_external(size_t threads, int count)
+{
+    s_done = 0;
+    sylar::Scheduler sc(threads, false, "bench");
+    sc.start();
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < count; ++i) {
+        sc.schedule(&tiny_task);
+    }
+    sc.stop();
+    uint64_t cost = sylar::Get_current_us() - begin;
+    SYLAR_LOG_INFO(g_logger) << "external threads=" << threads
+                             << " tasks=" << s_done
+                             << " cost=" << cost << "us"
+                             << " tasks_per_sec=" << (uint64_t) ((double) s_done * 1000000 / cost);
+}
+
+// 任务里再派生任务（进本地队列，空闲线程来偷）
+void bench_spawn(size_t threads, int count)
+{
+    s_done = 0;
+    const int fanout = 1000;
+    sylar::Scheduler sc(threads, false, "bench");
+    sc.start();
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < count / fanout; ++i) {
+        sc.schedule([fanout] {
+            for (int j = 0; j < fanout; ++j) {
+                sylar::Scheduler::GetThis()->schedule(&tiny_task);
+            }
+        });
+    }
+    sc.stop();
+    uint64_t cost = sylar::Get_current_us() - begin;
+    SYLAR_LOG_INFO(g_logger) << "spawn threads=" << threads
+                             << " tasks=" << s_done
+                             << " cost=" << cost << "us"
+                             << " tasks_per_sec=" << (uint64_t) ((double) s_done * 1000000 / cost);
+}
+
+// 所有任务都指定到同一个线程执行（直接进该线程的信箱）
+void bench_pinned(size_t threads, int count)
+{
+    s_done = 0;
+    sylar::Scheduler sc(threads, false, "bench");
+    sc.start();
+    // 先拿到一个工作线程的id
+    std::atomic<int> target{-1};
+    sc.schedule([&target] { target = sylar::GetThreadId(); });
+    while (target == -1) {
+        usleep(100);
+    }
+    uint64_t begin = sylar::Get_current_us();
+    for (int i = 0; i < count; ++i) {
+        sc.schedule(&tiny_task, target);
+    }
+    sc.stop();
+    uint64_t cost = sylar::Get_current_us() - begin;
+    SYLAR_LOG_INFO(g_logger) << "pinned threads=" << threads
+                             << " tasks=" << s_done
+                             << " cost=" << cost << "us"
+                             << " tasks_per_sec=" << (uint64_t) ((double) s_done * 1000000 / cost);
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    size_t max_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    for (size_t threads = 1; threads <= max_threads; ++threads) {
+        bench_external(threads, count);
+        bench_spawn(threads, count);
+        bench_pinned(threads, count);
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "../sylar/sylar.h"
+
+#define TEST_COUNT_ALLOC
+#include "test_helper.h"
+
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+static std::atomic<uint64_t> s_done{0};
+
+static void plain_task()
+{
+    ++s_done;
+}
+
+static void wait_done(uint64_t count)
+{
+    while (s_done < count) {
+        usleep(100);
+    }
+}
+
+static void report(const char *name, int count, uint64_t allocs, uint64_t cost)
+{
+    SYLAR_LOG_INFO(g_logger) << name
+                             << " tasks=" << count
+                             << " allocs_per_task=" << (double) allocs / count
+                             << " ns_per_task=" << (double) cost * 1000 / count;
+}
+
+// 调用fn加入count个任务，统计从加入到全部执行完的分配次数
+template<typename Fn>
+void bench(sylar::Scheduler &sc, const char *name, int count, Fn fn)
+{
+    // 先跑一轮预热，让任务节点和回调协程都缓存起来
+    for (int round = 0; round < 2; ++round) {
+        s_done = 0;
+        uint64_t allocs = s_alloc_count;
+        uint64_t begin = sylar::Get_current_us();
+        fn(count);
+        wait_done(count);
+        uint64_t cost = sylar::Get_current_us() - begin;
+        allocs = s_alloc_count - allocs;
+        if (round == 1) {
+            report(name, count, allocs, cost);
+        }
+    }
+}
+
+// 协程已经创建好，只统计调度的开销
+void bench_fiber_ptr(sylar::Scheduler &sc, int count)
+{
+    std::vector<sylar::Fiber::ptr> fibers;
+    fibers.reserve(count);
+    for (int round = 0; round < 2; ++round) {
+        s_done = 0;
+        for (int i = 0; i < count; ++i) {
+            fibers.emplace_back(new sylar::Fiber(&plain_task));
+        }
+        uint64_t allocs = s_alloc_count;
+        uint64_t begin = sylar::Get_current_us();
+        for (auto &fiber : fibers) {
+            sc.schedule(fiber);
+        }
+        wait_done(count);
+        uint64_t cost = sylar::Get_current_us() - begin;
+        allocs = s_alloc_count - allocs;
+        if (round == 1) {
+            report("fiber_ptr", count, allocs, cost);
+        }
+        fibers.clear();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+
+    sylar::Scheduler sc(1, false, "bench");
+    sc.start();
+
+    bench(sc, "function_pointer", count, [&sc](int n) {
+        for (int i = 0; i < n; ++i) {
+            sc.schedule(&plain_task);
+        }
+    });
+
+    // 捕获48字节的lambda，超过了std::function的内部缓冲区
+    bench(sc, "lambda_48B", count, [&sc](int n) {
+        for (int i = 0; i < n; ++i) {
+            uint64_t a = i, b = i + 1, c = i + 2, d = i + 3, e = i + 4, f = i + 5;
+            sc.schedule([a, b, c, d, e, f] {
+                asm volatile("" : : "r"(a + b + c + d + e + f));
+                ++s_done;
+            });
+        }
+    });
+
+    // 每个协程的栈都是一次mmap，数量太多会超过vm.max_map_count
+    bench_fiber_ptr(sc, std::min(count, 20000));
+
+    // 在工作线程里派生任务（走本地队列）
+    bench(sc, "spawn_in_worker", count, [&sc](int n) {
+        sc.schedule([n] {
+            for (int i = 0; i < n; ++i) {
+                sylar::Scheduler::GetThis()->schedule(&plain_task);
+            }
+        });
+    });
+
+    sc.stop();
+    return 0;
+}
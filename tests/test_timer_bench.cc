@@ -0,0 +1,133 @@
+#include "../sylar/sylar.h"
+#include "../sylar/timer.h"
+
+#include <random>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+// 不需要唤醒谁，只测定时器本身
+class BenchTimerManager : public sylar::TimerManager {
+public:
+    explicit BenchTimerManager(Engine engine)
+        : TimerManager(engine)
+    {}
+
+protected:
+    void on_timer_insert_at_front(int shard) override {}
+};
+
+static double ns_per_op(uint64_t begin_us, size_t ops)
+{
+    return (sylar::Get_current_us() - begin_us) * 1000.0 / ops;
+}
+
+void bench(sylar::TimerManager::Engine engine, size_t count)
+{
+    BenchTimerManager manager(engine);
+    std::mt19937 rng(12345);
+    std::vector<sylar::Timer::ptr> timers;
+    timers.reserve(count);
+    size_t fired = 0;
+    auto cb = [&fired] { ++fired; };
+
+    // 1. 添加count个1~60秒之后的定时器，模拟大量连接的读写超时
+    uint64_t begin = sylar::Get_current_us();
+    for (size_t i = 0; i < count; ++i) {
+        timers.push_back(manager.add_timer(1000 + rng() % 60000, cb));
+    }
+    double add_ns = ns_per_op(begin, count);
+
+    // 2. 一半刷新（连接上来了数据），一半取消（请求完成）
+    begin = sylar::Get_current_us();
+    for (size_t i = 0; i < count; i += 2) {
+        timers[i]->refresh();
+    }
+    double refresh_ns = ns_per_op(begin, count / 2);
+
+    begin = sylar::Get_current_us();
+    for (size_t i = 1; i < count; i += 2) {
+        timers[i]->cancel();
+    }
+    double cancel_ns = ns_per_op(begin, count / 2);
+
+    begin = sylar::Get_current_us();
+    for (size_t i = 0; i < count / 10; ++i) {
+        manager.get_next_timeout();
+    }
+    double next_ns = ns_per_op(begin, count / 10);
+
+    // 3. 在剩下的定时器之上，再加一批200ms内到期的，看到期的处理开销
+    size_t expire_count = count / 10;
+    std::vector<std::function<void()>> cbs;
+    for (size_t i = 0; i < expire_count; ++i) {
+        manager.add_timer(rng() % 200, cb);
+    }
+    uint64_t expire_us = 0;
+    while (fired < expire_count) {
+        usleep(1000);
+        begin = sylar::Get_current_us();
+        manager.list_expired_cbs(cbs);
+        expire_us += sylar::Get_current_us() - begin;
+        for (auto &i : cbs) {
+            i();
+        }
+        cbs.clear();
+    }
+
+    SYLAR_LOG_INFO(g_logger) << "engine=" << (engine == sylar::TimerManager::WHEEL ? "wheel" : "set")
+                             << " timers=" << count
+                             << " add=" << add_ns << "ns"
+                             << " refresh=" << refresh_ns << "ns"
+                             << " cancel=" << cancel_ns << "ns"
+                             << " next_timeout=" << next_ns << "ns"
+                             << " expire=" << expire_us * 1000.0 / expire_count << "ns";
+}
+
+// 模拟idle的循环：睡到最近的定时器到期，醒来取出到期的定时器
+// count个定时器随机分布在1秒内，看slack不同时要醒来多少次
+void bench_wakeups(sylar::TimerManager::Engine engine, size_t count, uint64_t slack_us)
+{
+    BenchTimerManager manager(engine);
+    std::mt19937 rng(12345);
+    size_t fired = 0;
+    auto cb = [&fired] { ++fired; };
+    for (size_t i = 0; i < count; ++i) {
+        manager.add_timer(std::chrono::microseconds(rng() % 1000000), cb, false,
+                          std::chrono::microseconds(slack_us));
+    }
+
+    std::vector<std::function<void()>> cbs;
+    size_t wakeups = 0;
+    while (fired < count) {
+        uint64_t timeout = manager.get_next_timeout_us();
+        if (timeout) {
+            usleep(timeout);
+        }
+        ++wakeups;
+        manager.list_expired_cbs(cbs);
+        for (auto &i : cbs) {
+            i();
+        }
+        cbs.clear();
+    }
+
+    SYLAR_LOG_INFO(g_logger) << "engine=" << (engine == sylar::TimerManager::WHEEL ? "wheel" : "set")
+                             << " timers=" << count
+                             << " slack=" << slack_us << "us"
+                             << " wakeups=" << wakeups
+                             << " timers_per_wakeup=" << (double) count / wakeups;
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    size_t count = argc > 1 ? atoi(argv[1]) : 1000000;
+    bench(sylar::TimerManager::SET, count);
+    bench(sylar::TimerManager::WHEEL, count);
+
+    for (uint64_t slack : {0, 1000, 10000}) {
+        bench_wakeups(sylar::TimerManager::SET, count / 10, slack);
+        bench_wakeups(sylar::TimerManager::WHEEL, count / 10, slack);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/config.h"
+#include "../sylar/clock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <sstream>
+
+sylar::Logger::ptr g_logger = SYLAR_LOGGER_ROOT();
+
+// 一个接一个地添加定时器，记录每个定时器回调真正执行的时间和预期时间的差
+struct JitterRun {
+    std::mt19937 rng{12345};
+    bool ms_api = false;     // 用毫秒的接口（延迟向上取整到毫秒）
+    int remain = 0;
+    uint64_t target_ns = 0;
+    std::vector<int64_t> errors;
+    std::atomic<bool> done{false};
+};
+
+static void arm(JitterRun &run);
+
+static void on_fire(JitterRun &run)
+{
+    run.errors.push_back((int64_t) (sylar::Clock::NowNs() - run.target_ns));
+    if (--run.remain > 0) {
+        arm(run);
+    } else {
+        run.done = true;
+    }
+}
+
+static void arm(JitterRun &run)
+{
+    // 20us ~ 2ms的随机延迟，模拟重试退避之类的短定时器
+    uint64_t delay_us = 20 + run.rng() % 2000;
+    run.target_ns = sylar::Clock::NowNs() + delay_us * 1000;
+    auto iom = sylar::IOManager::GetThis();
+    if (run.ms_api) {
+        iom->add_timer((delay_us + 999) / 1000, [&run] { on_fire(run); });
+    } else {
+        iom->add_timer(std::chrono::microseconds(delay_us), [&run] { on_fire(run); });
+    }
+}
+
+static double percentile_us(const std::vector<int64_t> &sorted, double p)
+{
+    size_t index = (size_t) (p * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+void run(const std::string &poller, const std::string &engine, bool ms_api,
+         size_t threads, int samples)
+{
+    sylar::Config::Lookup<std::string>("iomanager.poller")->setValue(poller);
+    sylar::Config::Lookup<std::string>("iomanager.timer_engine")->setValue(engine);
+    JitterRun jitter;
+    jitter.ms_api = ms_api;
+    jitter.remain = samples;
+    jitter.errors.reserve(samples);
+    {
+        sylar::IOManager iom(threads, false, "jitter");
+        iom.schedule([&jitter] { arm(jitter); });
+        while (!jitter.done) {
+            usleep(10000);
+        }
+    }
+
+    std::vector<int64_t> &errors = jitter.errors;
+    std::sort(errors.begin(), errors.end());
+    // 误差的分布：提前、<10us、<50us、<100us、<500us、<1ms、>=1ms
+    static const int64_t BOUNDS[] = {0, 10000, 50000, 100000, 500000, 1000000};
+    static const char *NAMES[] = {"early", "<10us", "<50us", "<100us", "<500us", "<1ms", ">=1ms"};
+    size_t buckets[7] = {0};
+    for (int64_t e : errors) {
+        size_t i = 0;
+        while (i < 6 && e >= BOUNDS[i]) {
+            ++i;
+        }
+        ++buckets[i];
+    }
+    std::stringstream ss;
+    for (size_t i = 0; i < 7; ++i) {
+        ss << " " << NAMES[i] << "=" << buckets[i] * 100.0 / errors.size() << "%";
+    }
+
+    SYLAR_LOG_INFO(g_logger) << "poller=" << poller
+                             << " engine=" << engine
+                             << " api=" << (ms_api ? "ms" : "us")
+                             << " threads=" << threads
+                             << " samples=" << errors.size()
+                             << " p50=" << percentile_us(errors, 0.5) << "us"
+                             << " p90=" << percentile_us(errors, 0.9) << "us"
+                             << " p99=" << percentile_us(errors, 0.99) << "us"
+                             << " p99.9=" << percentile_us(errors, 0.999) << "us"
+                             << " max=" << errors.back() / 1000.0 << "us";
+    SYLAR_LOG_INFO(g_logger) << "  distribution:" << ss.str();
+}
+
+int main(int argc, char *argv[])
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int samples = argc > 1 ? atoi(argv[1]) : 5000;
+    size_t threads = argc > 2 ? atoi(argv[2]) : 1;
+
+    // 对照：毫秒接口只能把延迟向上取整
+    run("epoll", "wheel", true, threads, samples);
+    for (const char *poller : {"epoll", "io_uring"}) {
+        for (const char *engine : {"set", "wheel"}) {
+            run(poller, engine, false, threads, samples);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,338 @@
+// 把log.binary_file写出的二进制日志还原成文本
+// 用法：sylar_logdecode [-s] <file>
+//   -s  按时间排序（默认按文件里的顺序，同一个线程内的日志总是有序的）
+// 输出格式：时间  线程id  协程id  [级别]  <文件:行号>  内容
+
+#include "../sylar/binlog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Site {
+    int32_t line;
+    sylar::LogLevel::Level level;
+    std::string file;
+    std::string fmt;
+};
+
+struct Line {
+    uint64_t time_ns;
+    std::string text;
+};
+
+// 一个编码过的参数
+struct Arg {
+    uint8_t type = 0;
+    uint8_t width = 8; // 整数本来的字节数
+    uint64_t bits = 0;
+    std::string str;
+
+    // 按本来的宽度和符号扩展到64位，相当于printf的实参经过默认提升之后的值
+    int64_t asInt() const
+    {
+        if (type == sylar::binlog::ARG_DOUBLE) {
+            return (int64_t) asDouble();
+        }
+        return extend(bits, width, type == sylar::binlog::ARG_INT);
+    }
+    double asDouble() const
+    {
+        if (type == sylar::binlog::ARG_DOUBLE) {
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+        return type == sylar::binlog::ARG_INT ? (double) asInt() : (double) (uint64_t) asInt();
+    }
+
+    // 取低width字节，按有无符号扩展到64位
+    static int64_t extend(uint64_t v, size_t width, bool is_signed)
+    {
+        if (width >= 8) {
+            return (int64_t) v;
+        }
+        int shift = 64 - width * 8;
+        return is_signed ? (int64_t) (v << shift) >> shift : (int64_t) ((v << shift) >> shift);
+    }
+};
+
+static bool decode_args(const char *p, const char *end, std::vector<Arg> &args)
+{
+    args.clear();
+    while (p < end) {
+        Arg arg;
+        uint8_t tag = *p++;
+        arg.type = tag & 0x0f;
+        if (arg.type == sylar::binlog::ARG_INT || arg.type == sylar::binlog::ARG_UINT) {
+            arg.width = tag >> 4;
+            if (arg.width == 0 || arg.width > 8 || end - p < arg.width) {
+                return false;
+            }
+            memcpy(&arg.bits, p, arg.width);
+            p += arg.width;
+        } else if (arg.type == sylar::binlog::ARG_STRING) {
+            uint32_t len;
+            if (end - p < (ssize_t) sizeof(len)) {
+                return false;
+            }
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if ((size_t) (end - p) < len) {
+                return false;
+            }
+            arg.str.assign(p, len);
+            p += len;
+        } else {
+            if (end - p < 8) {
+                return false;
+            }
+            memcpy(&arg.bits, p, 8);
+            p += 8;
+        }
+        args.push_back(std::move(arg));
+    }
+    return true;
+}
+
+// 按格式串把参数重新格式化一遍
+// 整数先按printf的规则处理：按转换的长度修饰（没有时是int）截断，%d/%i按有符号扩展，其余按无符号扩展，
+// 再统一用ll输出；浮点数都按double
+static std::string render(const std::string &fmt, const std::vector<Arg> &args)
+{
+    std::string out;
+    size_t next = 0;
+    auto take = [&]() -> const Arg * { return next < args.size() ? &args[next++] : nullptr; };
+    char buf[512];
+
+    for (size_t i = 0; i < fmt.size(); ++i) {
+        if (fmt[i] != '%') {
+            out.push_back(fmt[i]);
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            out.push_back('%');
+            ++i;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        std::string spec = "%";
+        size_t j = i + 1;
+        while (j < fmt.size() && strchr("-+ #0'", fmt[j])) {
+            spec.push_back(fmt[j++]);
+        }
+        for (int part = 0; part < 2; ++part) {
+            if (part == 1) {
+                if (j >= fmt.size() || fmt[j] != '.') {
+                    break;
+                }
+                spec.push_back(fmt[j++]);
+            }
+            if (j < fmt.size() && fmt[j] == '*') {
+                const Arg *arg = take();
+                spec += std::to_string(arg ? arg->asInt() : 0);
+                ++j;
+            }
+            while (j < fmt.size() && isdigit(fmt[j])) {
+                spec.push_back(fmt[j++]);
+            }
+        }
+        size_t length_begin = j;
+        while (j < fmt.size() && strchr("hljztLq", fmt[j])) {
+            ++j;
+        }
+        std::string length = fmt.substr(length_begin, j - length_begin);
+        size_t int_width = length == "hh" ? 1 : length == "h" ? 2 : length.empty() ? 4 : 8;
+        if (j >= fmt.size()) {
+            out += fmt.substr(i);
+            break;
+        }
+        char conv = fmt[j];
+        i = j;
+
+        const Arg *arg = take();
+        if (!arg) {
+            out += "<missing>";
+            continue;
+        }
+        int n = 0;
+        switch (conv) {
+            case 'd':
+            case 'i':
+                n = snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(),
+                             (long long) Arg::extend(arg->asInt(), int_width, true));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                n = snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(),
+                             (unsigned long long) Arg::extend(arg->asInt(), int_width, false));
+                break;
+            case 'c':
+                n = snprintf(buf, sizeof(buf), (spec + conv).c_str(), (int) arg->asInt());
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                n = snprintf(buf, sizeof(buf), (spec + conv).c_str(), arg->asDouble());
+                break;
+            case 'p':
+                n = snprintf(buf, sizeof(buf), (spec + conv).c_str(), (void *) (uintptr_t) arg->bits);
+                break;
+            case 's':
+                if (arg->type == sylar::binlog::ARG_STRING) {
+                    // 字符串可能很长，不走buf
+                    n = snprintf(nullptr, 0, (spec + conv).c_str(), arg->str.c_str());
+                    std::string tmp(n + 1, '\0');
+                    snprintf(&tmp[0], tmp.size(), (spec + conv).c_str(), arg->str.c_str());
+                    tmp.resize(n);
+                    out += tmp;
+                    continue;
+                }
+                n = snprintf(buf, sizeof(buf), "<not a string>");
+                break;
+            case 'n':
+                continue;
+            default:
+                n = snprintf(buf, sizeof(buf), "<bad conversion %%%c>", conv);
+                break;
+        }
+        out.append(buf, std::min<size_t>(std::max(n, 0), sizeof(buf) - 1));
+    }
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    bool sort = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0) {
+            sort = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        std::cerr << "usage: " << argv[0] << " [-s] <file>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        std::cerr << "open " << path << " failed" << std::endl;
+        return 1;
+    }
+    std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    sylar::binlog::FileHeader header;
+    if (data.size() < sizeof(header)) {
+        std::cerr << path << ": not a binary log" << std::endl;
+        return 1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, sylar::binlog::MAGIC, sizeof(header.magic)) != 0
+        || header.version != sylar::binlog::VERSION) {
+        std::cerr << path << ": not a binary log or unsupported version" << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, Site> sites;
+    std::vector<Line> lines;
+    std::vector<Arg> args;
+    size_t pos = sizeof(header);
+    while (pos < data.size()) {
+        sylar::binlog::RecordHeader rh;
+        if (data.size() - pos < sizeof(rh)) {
+            break;
+        }
+        memcpy(&rh, data.data() + pos, sizeof(rh));
+        if (rh.size < sizeof(rh) || data.size() - pos < rh.size) {
+            break;
+        }
+        const char *p = data.data() + pos + sizeof(rh);
+        const char *end = data.data() + pos + rh.size;
+        pos += rh.size;
+
+        if (rh.site == 0) {
+            sylar::binlog::SiteRecord sr;
+            if (end - p < (ssize_t) sizeof(sr)) {
+                continue;
+            }
+            memcpy(&sr, p, sizeof(sr));
+            p += sizeof(sr);
+            if (end - p < (ssize_t) sr.file_len + sr.fmt_len) {
+                continue;
+            }
+            Site &site = sites[sr.id];
+            site.line = sr.line;
+            site.level = (sylar::LogLevel::Level) sr.level;
+            site.file.assign(p, sr.file_len);
+            site.fmt.assign(p + sr.file_len, sr.fmt_len);
+            continue;
+        }
+
+        sylar::binlog::LogRecord lr;
+        if (end - p < (ssize_t) sizeof(lr)) {
+            continue;
+        }
+        memcpy(&lr, p, sizeof(lr));
+        p += sizeof(lr);
+
+        // 单调时间换算成墙上时间
+        uint64_t ns = header.realtime_ns + (int64_t) (lr.time_ns - header.monotonic_ns);
+        time_t sec = ns / 1000000000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        char time_buf[64];
+        size_t len = strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(time_buf + len, sizeof(time_buf) - len, ".%06u", (unsigned) (ns % 1000000000 / 1000));
+
+        std::string text = time_buf;
+        text += '\t' + std::to_string(lr.thread_id) + '\t' + std::to_string(lr.fiber_id) + '\t';
+        auto it = sites.find(rh.site);
+        if (it == sites.end()) {
+            text += "[UNKNOWN]\t<unknown site " + std::to_string(rh.site) + ">\t";
+        } else {
+            const Site &site = it->second;
+            text += std::string("[") + sylar::LogLevel::toString(site.level) + "]\t<"
+                    + site.file + ":" + std::to_string(site.line) + ">\t";
+            if (decode_args(p, end, args)) {
+                text += render(site.fmt, args);
+            } else {
+                text += "<corrupted arguments>";
+            }
+        }
+        text += '\n';
+        if (sort) {
+            lines.push_back({ns, std::move(text)});
+        } else {
+            std::cout << text;
+        }
+    }
+    if (pos < data.size()) {
+        // 进程崩溃时最后一条记录可能只写了一半
+        std::cerr << path << ": truncated record at offset " << pos << std::endl;
+    }
+
+    if (sort) {
+        std::stable_sort(lines.begin(), lines.end(), [](const Line &a, const Line &b) {
+            return a.time_ns < b.time_ns;
+        });
+        for (auto &line : lines) {
+            std::cout << line.text;
+        }
+    }
+    return 0;
+}